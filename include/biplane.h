@@ -0,0 +1,210 @@
+#ifndef LABEL_CATHETER_BIPLANE_H
+#define LABEL_CATHETER_BIPLANE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/LU>
+#include <Eigen/SVD>
+
+#include "bspline.h"
+#include "csv.h"
+#include "label_data.h"
+
+typedef Eigen::Matrix<float,3,4> ProjMatrix;
+
+//! @brief Read the 3x4 projection matrices of the two planes of a biplane system
+/*!
+ * The file holds 24 numbers, the rows of the first matrix then the rows of
+ * the second; anything after a '#' on a line is a comment. The matrices map
+ * homogeneous world points to pixels in the convention of the labelling
+ * tools: pixel (x, y) is centred on (x, y), origin at the top-left.
+ */
+inline bool ReadBiplaneCalibration(std::string const& file, ProjMatrix proj[2])
+{
+    std::ifstream in(file.c_str());
+    if(!in)
+        return false;
+
+    std::vector<float> values;
+    std::string line;
+    while(std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        char const* str = line.c_str();
+        char* end;
+        for(float v = strtof(str, &end); end != str; v = strtof(str, &end)) {
+            values.push_back(v);
+            str = end;
+        }
+    }
+
+    if(values.size() != 24)
+        return false;
+
+    for(int v = 0; v < 2; ++v)
+        for(int r = 0; r < 3; ++r)
+            for(int c = 0; c < 4; ++c)
+                proj[v](r, c) = values[12*v + 4*r + c];
+
+    return true;
+}
+
+/* Pixel of a world point */
+inline Eigen::Vector2f Project(ProjMatrix const& proj, Eigen::Vector3f const& pt)
+{
+    Eigen::Vector3f const x = proj.leftCols<3>()*pt + proj.col(3);
+    return x.head<2>()/x[2];
+}
+
+//! @brief World point seen at pixel pt0 by proj0 and pt1 by proj1, by linear (DLT) triangulation
+/*!
+ * The homogeneous point is the null vector of the 4x4 system x P3 - P1,
+ * y P3 - P2 of both views, solved by SVD in double precision with each row
+ * normalised. reproj_error receives the larger of the two pixel distances
+ * between the reprojected point and the clicked ones.
+ */
+inline Eigen::Vector3f Triangulate(ProjMatrix const& proj0, Eigen::Vector2f const& pt0, ProjMatrix const& proj1, Eigen::Vector2f const& pt1,
+                                   float* reproj_error = NULL)
+{
+    Eigen::Matrix4d A;
+    A.row(0) = (pt0[0]*proj0.row(2) - proj0.row(0)).cast<double>();
+    A.row(1) = (pt0[1]*proj0.row(2) - proj0.row(1)).cast<double>();
+    A.row(2) = (pt1[0]*proj1.row(2) - proj1.row(0)).cast<double>();
+    A.row(3) = (pt1[1]*proj1.row(2) - proj1.row(1)).cast<double>();
+    for(int r = 0; r < 4; ++r)
+        A.row(r).normalize();
+
+    Eigen::JacobiSVD<Eigen::Matrix4d> svd(A, Eigen::ComputeFullV);
+    Eigen::Vector4d const X = svd.matrixV().col(3);
+    Eigen::Vector3f const pt = (X.head<3>()/X[3]).cast<float>();
+
+    if(reproj_error)
+        *reproj_error = std::max((Project(proj0, pt) - pt0).norm(), (Project(proj1, pt) - pt1).norm());
+
+    return pt;
+}
+
+//! @brief Line (a, b, c), ax + by + c = 0, in view to of the points seen at pixel pt in view from
+/*!
+ * The projections in view to of the centre of camera from and of a point on
+ * the ray through pt span the line.
+ */
+inline Eigen::Vector3f EpipolarLine(ProjMatrix const& from, Eigen::Vector2f const& pt, ProjMatrix const& to)
+{
+    Eigen::Matrix<double,3,4> const P = from.cast<double>();
+
+    Eigen::JacobiSVD<Eigen::Matrix<double,3,4> > svd(P, Eigen::ComputeFullV);
+    Eigen::Vector4d const centre = svd.matrixV().col(3);
+
+    /* A point on the ray, through the pseudo-inverse */
+    Eigen::Vector4d const ray_pt = P.transpose()*(P*P.transpose()).inverse()*Eigen::Vector3d(pt[0], pt[1], 1);
+
+    Eigen::Matrix<double,3,4> const Q = to.cast<double>();
+    Eigen::Vector3d const line = (Q*centre).cross(Q*ray_pt);
+    return (line/line.head<2>().norm()).cast<float>();
+}
+
+/* Closest point to pt on a line normalised by EpipolarLine() */
+inline Eigen::Vector2f ClosestOnLine(Eigen::Vector3f const& line, Eigen::Vector2f const& pt)
+{
+    return pt - (line[0]*pt[0] + line[1]*pt[1] + line[2])*line.head<2>();
+}
+
+/* Largest pixel displacement of the projection of pt per unit move in the world, for sampling tolerances */
+inline float PixelsPerUnit(ProjMatrix const& proj, Eigen::Vector3f const& pt)
+{
+    Eigen::Vector2f const x = Project(proj, pt);
+    float ppu = 0;
+    for(int i = 0; i < 3; ++i)
+        ppu = std::max(ppu, (Project(proj, pt + Eigen::Vector3f::Unit(i)) - x).norm());
+    return ppu;
+}
+
+//! @brief Write the connected pixel chain of the projection of a 3D B-spline, returns the end of the output
+/*!
+ * The curve is sampled finely enough that consecutive projections are
+ * within a pixel of each other at the scale of the first knot, the rest is
+ * bridged by the PixelChainWriter.
+ */
+template<int max_pts, typename OutputIt>
+OutputIt RasteriseProjectedPts(Bspline<float,3,max_pts> const& bspline, ProjMatrix const& proj, OutputIt out)
+{
+    if(!bspline.IsReady())
+        return out;
+
+    std::vector<Eigen::Vector3f> pts;
+    bspline.SampleUniform(0.9f/std::max(1e-6f, PixelsPerUnit(proj, bspline.GetKnotPt(0))), std::back_inserter(pts));
+
+    PixelChainWriter<OutputIt> writer(out);
+    for(auto const& pt : pts)
+        writer = Project(proj, pt);
+
+    return writer.Base();
+}
+
+//! @brief Call f(frame_idx, closed, knots) for every row of label3d.csv, returns the number of frames
+template<typename F>
+size_t ForEachCSV3DRow(std::string const& csv_file, F f)
+{
+    if(!boost::filesystem::exists(csv_file))
+        return 0;
+
+    io::CSVReader<3> in(csv_file);
+    in.read_header(io::ignore_extra_column, "frame_idx", "closed", "knot_xyz");
+
+    int frame_idx;
+    int closed;
+    char* knot_xyz;
+    std::vector<float> values;
+    size_t num_frames = 0;
+    while(in.read_row(frame_idx, closed, knot_xyz)) {
+        values.clear();
+        char* end;
+        for(float v = strtof(knot_xyz, &end); end != knot_xyz; v = strtof(knot_xyz, &end)) {
+            values.push_back(v);
+            knot_xyz = end;
+        }
+
+        Eigen::Matrix<float,3,Eigen::Dynamic> knots(3, values.size()/3);
+        for(Eigen::Index k = 0; k < knots.cols(); ++k)
+            knots.col(k) = Eigen::Vector3f(values[3*k], values[3*k+1], values[3*k+2]);
+
+        f(size_t(frame_idx), closed != 0, static_cast<Eigen::Matrix<float,3,Eigen::Dynamic> const&>(knots));
+        num_frames = std::max(num_frames, size_t(frame_idx) + 1);
+    }
+
+    return num_frames;
+}
+
+//! @brief Append the 3D knots of one frame to label3d.csv, creating it with a header if needed
+template<int max_pts>
+bool AppendCSV3DFrame(std::string const& csv_file, size_t const frame_idx, Bspline<float,3,max_pts> const& bspline)
+{
+    FILE* fout = fopen(csv_file.c_str(), "a");
+    if(!fout)
+        return false;
+
+    fseek(fout, 0, SEEK_END);
+    if(ftell(fout) == 0)
+        fprintf(fout, "frame_idx,\tclosed,\tnum_knot_pt,\tknot_xyz\n");
+
+    fprintf(fout, "%d,\t%d,\t%d,\t", (int)frame_idx, bspline.type == Bspline<float,3,max_pts>::CLOSED ? 1 : 0, (int)bspline.GetNumKnotPts());
+    for(size_t k = 0; k < bspline.GetNumKnotPts(); ++k) {
+        Eigen::Vector3f const pt = bspline.GetKnotPt(k);
+        fprintf(fout, "%.9g %.9g %.9g ", pt[0], pt[1], pt[2]);
+    }
+    fprintf(fout, "\n");
+
+    return fclose(fout) == 0;
+}
+
+#endif // LABEL_CATHETER_BIPLANE_H
@@ -1,10 +1,12 @@
 #ifndef LABEL_CATHETER_BSPLINE_H
 #define LABEL_CATHETER_BSPLINE_H
 
+#include <iostream>
+#include <algorithm>
+#include <limits>
 #include <vector>
 
 #include <Eigen/Core>
-#include <Eigen/LU>
 
 using namespace std;
 using namespace Eigen;
@@ -12,169 +14,356 @@ using namespace Eigen;
 using namespace std;
 using namespace Eigen;
 
+//! @brief Columns of points with free space kept at both ends
+/*!
+ * Adding or removing a point at either end is amortised O(1): when one end
+ * runs out of room the points are recentred, or with max_pts == Dynamic the
+ * buffer doubles. A fixed max_pts keeps the points on the stack and rejects
+ * points beyond the capacity.
+ */
+template<typename _Tp,int dim,int max_pts = Dynamic>
+class BsplinePts
+{
+public:
+    typedef Matrix<_Tp,dim,max_pts> Buffer;
+    typedef Block<Buffer,dim,Dynamic,true> ColsBlock;
+    typedef Block<Buffer const,dim,Dynamic,true> ConstColsBlock;
+
+    BsplinePts() : begin(0), size(0)
+    {
+        if(max_pts == Dynamic)
+            buf.resize(dim, 0);
+    }
+
+    Index Size() const { return size; }
+    Index Capacity() const { return buf.cols(); }
+
+    ColsBlock Cols() { return buf.middleCols(begin, size); }
+    ConstColsBlock Cols() const { return buf.middleCols(begin, size); }
+
+    typename Buffer::ColXpr Col(Index const i) { return buf.col(begin+i); }
+    typename Buffer::ConstColXpr Col(Index const i) const { return buf.col(begin+i); }
+
+    _Tp& operator()(Index const r, Index const c) { return buf(r, begin+c); }
+    _Tp operator()(Index const r, Index const c) const { return buf(r, begin+c); }
+
+    void Clear()
+    {
+        begin = Capacity()/2;
+        size = 0;
+    }
+
+    /* Resize, keeping the leading points; new points are uninitialised */
+    bool Resize(Index const n)
+    {
+        if(n > Capacity() - begin && !Reserve(n, 0))
+            return false;
+
+        size = n;
+        return true;
+    }
+
+    template<typename Derived>
+    bool Assign(MatrixBase<Derived> const& pts)
+    {
+        if(pts.cols() > Capacity() - begin) {
+            Clear();
+            if(!Reserve(pts.cols(), 0))
+                return false;
+        }
+
+        size = pts.cols();
+        Cols() = pts;
+        return true;
+    }
+
+    bool PushBack(Matrix<_Tp,dim,1> const& pt)
+    {
+        if(begin + size == Capacity() && !Reserve(size+1, 1))
+            return false;
+
+        buf.col(begin + size++) = pt;
+        return true;
+    }
+
+    bool PushFront(Matrix<_Tp,dim,1> const& pt)
+    {
+        if(begin == 0 && !Reserve(size+1, -1))
+            return false;
+
+        buf.col(--begin) = pt;
+        ++size;
+        return true;
+    }
+
+    /* Insert before column i, moving the shorter side */
+    bool Insert(Index const i, Matrix<_Tp,dim,1> const& pt)
+    {
+        if(i <= 0)
+            return PushFront(pt);
+        if(i >= size)
+            return PushBack(pt);
+
+        if(i < size/2) {
+            Matrix<_Tp,dim,1> const first = Col(0);
+            if(!PushFront(first))
+                return false;
+            for(Index k = 1; k < i; ++k)
+                Col(k) = Col(k+1);
+        } else {
+            Matrix<_Tp,dim,1> const last = Col(size-1);
+            if(!PushBack(last))
+                return false;
+            for(Index k = size-2; k > i; --k)
+                Col(k) = Col(k-1);
+        }
+
+        Col(i) = pt;
+        return true;
+    }
+
+    /* Remove column i, moving the shorter side */
+    void Erase(Index const i)
+    {
+        if(i < 0 || i >= size)
+            return;
+
+        if(i < size/2) {
+            for(Index k = i; k > 0; --k)
+                Col(k) = Col(k-1);
+            PopFront();
+        } else {
+            for(Index k = i; k < size-1; ++k)
+                Col(k) = Col(k+1);
+            PopBack();
+        }
+    }
+
+    void PopBack()
+    {
+        if(size > 0)
+            --size;
+    }
+
+    void PopFront()
+    {
+        if(size > 0) {
+            ++begin;
+            --size;
+        }
+    }
+
+private:
+
+    /* Make room for n points, recentring them or growing the buffer; side < 0 leaves room at the front, > 0 at the back */
+    bool Reserve(Index const n, int const side)
+    {
+        /* Growing to 4n when over half full leaves n/2 free columns at each end after any reserve */
+        Index cap = Capacity();
+        if(max_pts == Dynamic && 2*n > cap) {
+            cap = max<Index>(8, 4*n);
+        } else if(n > cap) {
+            cerr << "Bspline capacity of " << max_pts << " points exceeded!" << endl;
+            return false;
+        }
+
+        /* Centre the points, favouring the side about to grow */
+        Index const slack = cap - size;
+        Index const new_begin = side < 0 ? slack - slack/2 : (side > 0 ? slack/2 : 0);
+
+        if(cap != Capacity()) {
+            Buffer grown(dim, cap);
+            grown.middleCols(new_begin, size) = Cols();
+            buf.swap(grown);
+        } else if(new_begin != begin && size > 0) {
+            /* Overlapping move within the buffer */
+            if(new_begin < begin)
+                for(Index i = 0; i < size; ++i)
+                    buf.col(new_begin+i) = buf.col(begin+i);
+            else
+                for(Index i = size-1; i >= 0; --i)
+                    buf.col(new_begin+i) = buf.col(begin+i);
+        }
+
+        begin = new_begin;
+        return true;
+    }
+
+    Buffer buf;
+    Index begin;
+    Index size;
+};
+
 //! @brief B-Spline template
-template<typename _Tp,int dim>
+/*!
+ * With max_pts set the knot and control points live in fixed-capacity storage
+ * on the stack; the default grows on demand. Knots are converted to control
+ * points with an O(n) (cyclic) tridiagonal solve.
+ */
+template<typename _Tp,int dim,int max_pts = Dynamic>
 class Bspline
 {
 
 public:
     enum BsplinType {OPEN = 0, CLOSED} type;
 
-    Bspline() : lod(30), type(OPEN)
+    Bspline() : type(OPEN), num_arc_segs(0), revision(0), lod(30)
     {
         CubicBsplineMatrix << 1.0, 4.0, 1.0, 0.0, -3.0, 0.0, 3.0, 0.0, 3.0, -6.0, 3.0, 0.0, -1.0, 3.0, -3.0, 1.0;
         CubicBsplineMatrix /= 6.0;
     }
 
-    ~Bspline()
-    {
-        knot_pts.conservativeResize(NoChange, 0);
-        ctrl_pts.conservativeResize(NoChange, 0);
-    }
-
     void Reset()
     {
-        knot_pts.conservativeResize(NoChange, 0);
-        ctrl_pts.conservativeResize(NoChange, 0);
+        knot_pts.Clear();
+        ctrl_pts.Clear();
+        num_arc_segs = 0;
+        ++revision;
     }
 
     bool IsReady() const
     {
-        return knot_pts.cols() > 3 && ctrl_pts.cols() > 3;
+        return knot_pts.Size() > 3 && ctrl_pts.Size() > 3;
     }
 
     void AddFrontKnotPt(Matrix<_Tp,dim,1> const& pt)
     {
-        Matrix<_Tp,dim,Dynamic> pre_knot_pts = knot_pts;
-        knot_pts.conservativeResize(NoChange, knot_pts.cols()+1);
-        knot_pts.block(0, 1, knot_pts.rows(), knot_pts.cols()-1) = pre_knot_pts;
-        knot_pts.leftCols(1) = pt;
-        CvtKnotToCtrlCubic();
+        if(knot_pts.PushFront(pt))
+            CvtKnotToCtrlCubic();
     }
 
     void AddFrontCtrlPt(Matrix<_Tp,dim,1> const& pt)
     {
-        Matrix<_Tp,dim,Dynamic> pre_ctrl_pts = ctrl_pts;
-        ctrl_pts.conservativeResize(NoChange, ctrl_pts.cols()+1);
-        ctrl_pts.block(0, 1, ctrl_pts.rows(), ctrl_pts.cols()-1) = pre_ctrl_pts;
-        ctrl_pts.leftCols(1) = pt;
-        CvtCtrlToKnotCubic();
+        if(ctrl_pts.PushFront(pt))
+            CvtCtrlToKnotCubic();
     }
 
     void AddBackKnotPt(Matrix<_Tp,dim,1> const& pt)
     {
-        knot_pts.conservativeResize(NoChange, knot_pts.cols()+1);
-        knot_pts.rightCols(1) = pt;
-        CvtKnotToCtrlCubic();
+        if(knot_pts.PushBack(pt))
+            CvtKnotToCtrlCubic();
     }
 
     void AddBackKnotPts(Matrix<_Tp,dim,Dynamic> const& pts)
     {
-        knot_pts = pts;
-        CvtKnotToCtrlCubic();
+        if(knot_pts.Assign(pts))
+            CvtKnotToCtrlCubic();
+    }
+
+    /* Insert a knot before knot p_idx */
+    void InsertKnotPt(size_t const p_idx, Matrix<_Tp,dim,1> const& pt)
+    {
+        if(knot_pts.Insert(p_idx, pt))
+            CvtKnotToCtrlCubic();
+    }
+
+    /* Remove knot p_idx */
+    void RemoveKnotPt(size_t const p_idx)
+    {
+        if(p_idx < (size_t)knot_pts.Size()) {
+            knot_pts.Erase(p_idx);
+            CvtKnotToCtrlCubic();
+        }
     }
 
     void AddCtrlPt(Matrix<_Tp,dim,1> const& pt)
     {
-        ctrl_pts.conservativeResize(NoChange, ctrl_pts.cols()+1);
-        ctrl_pts.rightCols(1) = pt;
-        CvtCtrlToKnotCubic();
+        if(ctrl_pts.PushBack(pt))
+            CvtCtrlToKnotCubic();
     }
 
     void AddCtrlPts(Matrix<_Tp,dim,Dynamic> const& pts)
     {
-        ctrl_pts = pts;
-        CvtCtrlToKnotCubic();
+        if(ctrl_pts.Assign(pts))
+            CvtCtrlToKnotCubic();
     }
 
     void RemoveFrontKnotPt()
     {
-        if(knot_pts.cols() > 0) {
-            Matrix<_Tp,dim,Dynamic> pre_knot_pts = knot_pts.block(0, 1, knot_pts.rows(), knot_pts.cols()-1);
-            knot_pts = pre_knot_pts;
+        if(knot_pts.Size() > 0) {
+            knot_pts.PopFront();
             CvtKnotToCtrlCubic();
         }
     }
 
     void RemoveFrontCtrlPt()
     {
-        if(ctrl_pts.cols() > 0) {
-            Matrix<_Tp,dim,Dynamic> pre_ctrl_pts = ctrl_pts.block(0, 1, ctrl_pts.rows(), ctrl_pts.cols()-1);
-            ctrl_pts = pre_ctrl_pts;
+        if(ctrl_pts.Size() > 0) {
+            ctrl_pts.PopFront();
             CvtCtrlToKnotCubic();
         }
     }
 
     void RemoveBackKnotPt()
     {
-        if(knot_pts.cols() > 0) {
-            knot_pts.conservativeResize(NoChange, knot_pts.cols()-1);
+        if(knot_pts.Size() > 0) {
+            knot_pts.PopBack();
             CvtKnotToCtrlCubic();
         }
     }
 
     void RemoveBackCtrlPt()
     {
-        if(ctrl_pts.cols() > 0) {
-            ctrl_pts.conservativeResize(NoChange, ctrl_pts.cols()-1);
+        if(ctrl_pts.Size() > 0) {
+            ctrl_pts.PopBack();
             CvtCtrlToKnotCubic();
         }
     }
 
     void SetKnotPt(size_t const p_idx, Matrix<_Tp,dim,Dynamic> const& pt)
     {
-        knot_pts.col(GetPtIdx(p_idx)) = pt;
+        knot_pts.Col(GetPtIdx(p_idx)) = pt;
         CvtKnotToCtrlCubic();
     }
 
     void SetCtrlPt(size_t const p_idx, Matrix<_Tp,dim,Dynamic> const& pt)
     {
-        ctrl_pts.col(GetPtIdx(p_idx)) = pt;
+        ctrl_pts.Col(GetPtIdx(p_idx)) = pt;
         CvtCtrlToKnotCubic();
     }
 
     Matrix<_Tp,dim,Dynamic> GetKnotPts() const
     {
-        return knot_pts;
+        return knot_pts.Cols();
     }
 
     Matrix<_Tp,dim,1> GetKnotPt(size_t const p_idx) const
     {
-        return knot_pts.col(GetPtIdx(p_idx));
+        return knot_pts.Col(GetPtIdx(p_idx));
     }
 
     Matrix<_Tp,dim,1> GetFrontKnotPt() const
     {
-        return knot_pts.leftCols(1);
+        return knot_pts.Col(0);
     }
 
     Matrix<_Tp,dim,1> GetBackKnotPt() const
     {
-        return knot_pts.rightCols(1);
+        return knot_pts.Col(knot_pts.Size()-1);
     }
 
     Matrix<_Tp,dim,Dynamic> GetCtrlPts() const
     {
-        return ctrl_pts;
+        return ctrl_pts.Cols();
     }
 
     Matrix<_Tp,dim,1> GetCtrlPt(size_t const p_idx) const
     {
-        return ctrl_pts.col(GetPtIdx(p_idx));
+        return ctrl_pts.Col(GetPtIdx(p_idx));
     }
 
     Matrix<_Tp,dim,1> GetFrontCtrlPt() const
     {
-        return ctrl_pts.leftCols(1);
+        return ctrl_pts.Col(0);
     }
 
     Matrix<_Tp,dim,1> GetBackCtrlPt() const
     {
-        return ctrl_pts.rightCols(1);
+        return ctrl_pts.Col(ctrl_pts.Size()-1);
     }
 
-    size_t GetNumKnotPts() const { return knot_pts.cols(); }
-    size_t GetNumCtrlPts() const { return ctrl_pts.cols(); }
+    size_t GetNumKnotPts() const { return knot_pts.Size(); }
+    size_t GetNumCtrlPts() const { return ctrl_pts.Size(); }
 
     void SetBsplineType(BsplinType const type)
     {
@@ -229,9 +418,240 @@ public:
         return pt;
     }
 
+    /* Incremented by every change of the points, for caches built from them */
+    size_t GetRevision() const { return revision; }
+
     void SetLOD(size_t const lod) { this->lod = lod; }
     size_t GetLOD() const { return lod; }
 
+    /* Curve length, 0 until the spline is ready */
+    _Tp GetLength() const
+    {
+        return num_arc_segs > 0 ? arc_table[num_arc_segs*arc_subdiv] : 0;
+    }
+
+    //! @brief Polyline within tolerance of the curve, from the first to the last knot
+    /*!
+     * A chord over [a, b] strays from the curve by at most (b-a)^2/8 max|C''|
+     * and C'' is linear within a segment, so its largest norm is at a or b.
+     * Chords are bisected until the bound is within tolerance: straight
+     * sections emit one chord per segment, tight bends as many as needed.
+     */
+    template<typename OutputIt>
+    OutputIt SampleAdaptive(_Tp const tolerance, OutputIt out) const
+    {
+        if(!IsReady() || tolerance <= 0)
+            return out;
+
+        Matrix<_Tp,dim,4> poly = SegmentPoly(GetFirstSeg());
+        *out++ = EvalPoly(poly, 0);
+
+        for(int seg_idx = 0; seg_idx < GetNumSegs(); ++seg_idx) {
+            poly = SegmentPoly(GetFirstSeg() + seg_idx);
+            out = Subdivide(poly, 0, 1, EvalPoly(poly, 0, 2).norm(), EvalPoly(poly, 1, 2).norm(), tolerance, 0, out);
+        }
+
+        return out;
+    }
+
+    //! @brief Closest curve point to pt, returns its distance or max_dist when nothing is closer
+    /*!
+     * A segment lies in the convex hull of its four control points, so
+     * segments whose control point box is further than the best distance so
+     * far are skipped; the rest are sampled by arc length and refined by
+     * Newton iteration on (C(t) - pt).C'(t) = 0.
+     */
+    _Tp ClosestPt(Matrix<_Tp,dim,1> const& pt, int& pt_idx, _Tp& t, _Tp const max_dist = numeric_limits<_Tp>::max()) const
+    {
+        _Tp best_dist = max_dist;
+        pt_idx = -1;
+        t = 0;
+
+        if(!IsReady())
+            return best_dist;
+
+        int const num_segs = GetNumSegs();
+        int const first = GetFirstSeg();
+
+        /* Start with the segment whose box is closest, for early culling */
+        int first_seg = 0;
+        _Tp first_bound = numeric_limits<_Tp>::max();
+        for(int seg = 0; seg < num_segs; ++seg) {
+            _Tp const bound = SegmentBoxDist(first + seg, pt);
+            if(bound < first_bound) {
+                first_bound = bound;
+                first_seg = seg;
+            }
+        }
+
+        for(int i = 0; i < num_segs; ++i) {
+            int const seg = (first_seg + i)%num_segs;
+            if(i > 0 && SegmentBoxDist(first + seg, pt) >= best_dist)
+                continue;
+
+            Matrix<_Tp,dim,4> const poly = SegmentPoly(first + seg);
+
+            /* Samples a few units apart, refined from every local minimum as the segment may fold back */
+            _Tp const seg_length = arc_table[(seg+1)*arc_subdiv] - arc_table[seg*arc_subdiv];
+            int const num_samples = max(4, min<int>(256, seg_length/closest_sample_spacing));
+
+            _Tp seg_t = 0;
+            _Tp seg_sq_dist = numeric_limits<_Tp>::max();
+            _Tp prev_sq_dist = numeric_limits<_Tp>::max();
+            _Tp cur_sq_dist = (EvalPoly(poly, 0) - pt).squaredNorm();
+            for(int k = 0; k <= num_samples; ++k) {
+                _Tp const next_sq_dist = k < num_samples ? (EvalPoly(poly, (k+1)/_Tp(num_samples)) - pt).squaredNorm() : numeric_limits<_Tp>::max();
+
+                if(cur_sq_dist <= prev_sq_dist && cur_sq_dist <= next_sq_dist) {
+                    _Tp const local_t = RefineClosestParam(poly, pt, k/_Tp(num_samples));
+                    _Tp const local_sq_dist = min(cur_sq_dist, (EvalPoly(poly, local_t) - pt).squaredNorm());
+                    if(local_sq_dist < seg_sq_dist) {
+                        seg_sq_dist = local_sq_dist;
+                        seg_t = local_sq_dist < cur_sq_dist ? local_t : k/_Tp(num_samples);
+                    }
+                }
+
+                prev_sq_dist = cur_sq_dist;
+                cur_sq_dist = next_sq_dist;
+            }
+
+            if(sqrt(seg_sq_dist) < best_dist) {
+                best_dist = sqrt(seg_sq_dist);
+                pt_idx = first + seg;
+                t = seg_t;
+            }
+        }
+
+        return best_dist;
+    }
+
+    /*
+     * Segments drawn, sampled and searched: an open curve runs from the
+     * first to the last knot over its clamped end segments (-1 to n-1), a
+     * closed one once around from knot 0 back to it (1 to n).
+     */
+    int GetFirstSeg() const { return type == CLOSED ? 1 : -1; }
+    int GetNumSegs() const { return type == CLOSED ? (int)GetNumCtrlPts() : (int)GetNumCtrlPts() + 1; }
+
+    /* Index at which a knot inserted on segment pt_idx keeps the knot order */
+    size_t GetInsertIdx(int const pt_idx) const
+    {
+        int const n = GetNumKnotPts();
+
+        if(type == CLOSED) {
+            int const idx = (pt_idx + n)%n;
+            return idx == 0 ? n : idx;
+        }
+
+        /* Segment k runs from knot k to k+1, the clamped end segments belong to the first and last span */
+        return max(1, min(pt_idx+1, n-1));
+    }
+
+    /* Power basis coefficients of segment pt_idx, the point at t is poly*(1, t, t^2, t^3) */
+    Matrix<_Tp,dim,4> SegmentPoly(int const pt_idx) const
+    {
+        Matrix<_Tp,dim,4> ctrl;
+        for(int k = 0; k < 4; ++k)
+            ctrl.col(k) = ctrl_pts.Col(GetPtIdx(pt_idx-1+k));
+
+        return ctrl*CubicBsplineMatrix.transpose();
+    }
+
+    /* Point or derivative of a segment polynomial, cheaper than CubicIntplt for many samples */
+    static Matrix<_Tp,dim,1> EvalPoly(Matrix<_Tp,dim,4> const& poly, _Tp const t, size_t const d_order = 0)
+    {
+        switch(d_order) {
+        case 0: return poly.col(0) + t*(poly.col(1) + t*(poly.col(2) + t*poly.col(3)));
+        case 1: return poly.col(1) + t*(2*poly.col(2) + 3*t*poly.col(3));
+        case 2: return 2*poly.col(2) + 6*t*poly.col(3);
+        case 3: return 6*poly.col(3);
+        default: return Matrix<_Tp,dim,1>::Zero();
+        }
+    }
+
+    /* Arc length of a segment polynomial between parameters t0 and t1 (5-point Gauss-Legendre) */
+    static _Tp PolyLength(Matrix<_Tp,dim,4> const& poly, _Tp const t0 = 0, _Tp const t1 = 1)
+    {
+        static _Tp const x[5] = {-0.9061798459386640, -0.5384693101056831, 0, 0.5384693101056831, 0.9061798459386640};
+        static _Tp const w[5] = {0.2369268850561891, 0.4786286704993665, 0.5688888888888889, 0.4786286704993665, 0.2369268850561891};
+
+        _Tp const half = (t1 - t0)/2;
+        _Tp const mid = (t1 + t0)/2;
+
+        _Tp len = 0;
+        for(int i = 0; i < 5; ++i)
+            len += w[i]*EvalPoly(poly, mid + half*x[i], 1).norm();
+
+        return len*half;
+    }
+
+    /* Arc length of segment pt_idx between parameters t0 and t1 */
+    _Tp SegmentLength(int const pt_idx, _Tp const t0 = 0, _Tp const t1 = 1) const
+    {
+        return PolyLength(SegmentPoly(pt_idx), t0, t1);
+    }
+
+    /* Segment and parameter at arc length s from the start of the curve */
+    void ArcLengthToParam(_Tp s, int& pt_idx, _Tp& t) const
+    {
+        pt_idx = -1;
+        t = 0;
+        if(num_arc_segs == 0)
+            return;
+
+        Index const num_entries = num_arc_segs*arc_subdiv;
+        s = max<_Tp>(0, min(s, GetLength()));
+
+        /* Table interval holding s, then linear initial guess */
+        Index i = std::upper_bound(arc_table.data(), arc_table.data()+num_entries+1, s) - arc_table.data() - 1;
+        i = max<Index>(0, min<Index>(i, num_entries-1));
+
+        pt_idx = i/arc_subdiv + GetFirstSeg();
+        _Tp const t0 = _Tp(i%arc_subdiv)/arc_subdiv;
+        t = TableParam(i, s);
+
+        /* Newton on the remaining length, speed is the derivative */
+        Matrix<_Tp,dim,4> const poly = SegmentPoly(pt_idx);
+        for(int iter = 0; iter < 2; ++iter) {
+            _Tp const speed = EvalPoly(poly, t, 1).norm();
+            if(speed <= 0)
+                break;
+            t -= (arc_table[i] + PolyLength(poly, t0, t) - s)/speed;
+            t = max(t0, min(t0 + _Tp(1)/arc_subdiv, t));
+        }
+    }
+
+    //! @brief Points every spacing along the curve, from the first to the last knot
+    /*!
+     * The parameter comes from the arc-length table (TableParam), so each
+     * point costs one curve evaluation.
+     */
+    template<typename OutputIt>
+    OutputIt SampleUniform(_Tp const spacing, OutputIt out) const
+    {
+        if(num_arc_segs == 0 || spacing <= 0)
+            return out;
+
+        Index const num_entries = num_arc_segs*arc_subdiv;
+        _Tp const length = GetLength();
+
+        Matrix<_Tp,dim,4> poly;
+        _Tp s = 0;
+        for(Index i = 0; i < num_entries; ++i) {
+            if(i%arc_subdiv == 0)
+                poly = SegmentPoly(i/arc_subdiv + GetFirstSeg());
+
+            for(; s < arc_table[i+1] || (i == num_entries-1 && s <= length); s += spacing)
+                *out++ = EvalPoly(poly, TableParam(i, s));
+        }
+
+        /* Finish on the last knot */
+        if(s - spacing < length)
+            *out++ = EvalPoly(poly, 1);
+
+        return out;
+    }
+
     size_t GetPtIdx(int const pt_idx) const
     {
         size_t num_ctrl_pts = GetNumCtrlPts();
@@ -262,100 +682,251 @@ public:
 private:
     void CvtCtrlToKnotCubic()
     {
-        size_t num_ctrl_pts = GetNumCtrlPts();
+        Index const n = GetNumCtrlPts();
 
-        if(num_ctrl_pts > 3)
+        if(n > 3)
         {
-
-            knot_pts.conservativeResize(NoChange, num_ctrl_pts);
-            knot_pts = Matrix<_Tp,dim,Dynamic>::Zero(dim, num_ctrl_pts);
-
-            Matrix<_Tp,Dynamic,Dynamic> B = Matrix<_Tp,Dynamic,Dynamic>::Zero(num_ctrl_pts, num_ctrl_pts);
+            knot_pts.Resize(n);
 
             if(type == OPEN)
             {
-                B(0, 0) = 1.0;
-                B(num_ctrl_pts-1, num_ctrl_pts-1) = 1.0;
-
-                for(int c = 1; c < num_ctrl_pts-1; ++c)
-                {
-                    B(c, (c-1)%num_ctrl_pts) = 1.0/6.0;
-                    B(c, (c)%num_ctrl_pts) = 2.0/3.0;
-                    B(c, (c+1)%num_ctrl_pts) = 1.0/6.0;
-                }
+                knot_pts.Col(0) = ctrl_pts.Col(0);
+                knot_pts.Col(n-1) = ctrl_pts.Col(n-1);
+
+                for(Index c = 1; c < n-1; ++c)
+                    knot_pts.Col(c) = (ctrl_pts.Col(c-1) + 4.0*ctrl_pts.Col(c) + ctrl_pts.Col(c+1))/6.0;
             }
 
             if(type == CLOSED)
             {
-                for(int c = 0; c < num_ctrl_pts; ++c)
-                {
-                    B(c, c%num_ctrl_pts) = 1.0/6.0;
-                    B(c, (c+1)%num_ctrl_pts) = 2.0/3.0;
-                    B(c, (c+2)%num_ctrl_pts) = 1.0/6.0;
-                }
+                for(Index c = 0; c < n; ++c)
+                    knot_pts.Col(c) = (ctrl_pts.Col(c) + 4.0*ctrl_pts.Col((c+1)%n) + ctrl_pts.Col((c+2)%n))/6.0;
             }
-
-            knot_pts = (B*ctrl_pts.transpose()).transpose();
-
         }
+
+        UpdateArcLengths();
     }
 
     void CvtKnotToCtrlCubic()
     {
-        size_t num_knot_pts = GetNumKnotPts();
-        if(num_knot_pts > 3)
+        Index const n = GetNumKnotPts();
+        if(n > 3)
         {
-            ctrl_pts.conservativeResize(NoChange, num_knot_pts);
-            ctrl_pts = Matrix<_Tp,dim,Dynamic>::Zero(dim, num_knot_pts);
-
-            Matrix<_Tp,Dynamic,Dynamic> B = Matrix<_Tp,Dynamic,Dynamic>::Zero(num_knot_pts, num_knot_pts);
-            Matrix<_Tp,Dynamic,Dynamic> inv_B;
+            ctrl_pts.Resize(n);
 
             if(type == OPEN)
             {
-                B(0, 0) = 1.0;
-                B(num_knot_pts-1, num_knot_pts-1) = 1.0;
-
-                for(int i = 1; i < num_knot_pts-1; ++i)
-                {
-                    B(i, (i-1)%num_knot_pts) = 1.0/6.0;
-                    B(i, (i)%num_knot_pts) = 2.0/3.0;
-                    B(i, (i+1)%num_knot_pts) = 1.0/6.0;
+                /* Thomas algorithm: end rows are (1 0 ...), inner rows (1/6 2/3 1/6) */
+                typename Scratch::SegmentReturnType sup = Sup(n);
+
+                sup[0] = 0;
+                ctrl_pts.Col(0) = knot_pts.Col(0);
+                for(Index i = 1; i < n; ++i) {
+                    bool const last = i == n-1;
+                    _Tp const a = last ? 0 : 1.0/6.0;
+                    _Tp const m = (last ? 1 : 2.0/3.0) - a*sup[i-1];
+                    sup[i] = last ? 0 : (1.0/6.0)/m;
+                    ctrl_pts.Col(i) = (knot_pts.Col(i) - a*ctrl_pts.Col(i-1))/m;
                 }
 
-                inv_B = B.inverse();
-
+                for(Index i = n-2; i >= 0; --i)
+                    ctrl_pts.Col(i) -= sup[i]*ctrl_pts.Col(i+1);
             }
 
             if(type == CLOSED)
             {
-                for(int i = 0; i < num_knot_pts; ++i)
-                {
-                    B(i, i%num_knot_pts) = 1.0/6.0;
-                    B(i, (i+1)%num_knot_pts) = 2.0/3.0;
-                    B(i, (i+2)%num_knot_pts) = 1.0/6.0;
+                /*
+                 * Knot i is (c_i + 4c_{i+1} + c_{i+2})/6, i.e. a cyclic tridiagonal system in x_i = c_{i+1}.
+                 * Sherman-Morrison: solve the tridiagonal part for the knots and for the corner vector u.
+                 */
+                _Tp const a = 1.0/6.0, b = 2.0/3.0, c = 1.0/6.0;
+                _Tp const gamma = -b;
+
+                typename Scratch::SegmentReturnType sup = Sup(n);
+                typename Scratch::SegmentReturnType z = Z(n);
+
+                for(Index i = 0; i < n; ++i) {
+                    _Tp const diag = (i == 0 ? b - gamma : (i == n-1 ? b - c*a/gamma : b));
+                    _Tp const m = diag - (i > 0 ? a*sup[i-1] : 0);
+                    sup[i] = c/m;
+
+                    Matrix<_Tp,dim,1> const rhs = knot_pts.Col(i) - (i > 0 ? Matrix<_Tp,dim,1>(a*ctrl_pts.Col(i-1)) : Matrix<_Tp,dim,1>::Zero());
+                    ctrl_pts.Col(i) = rhs/m;
+
+                    _Tp const u = (i == 0 ? gamma : (i == n-1 ? c : 0));
+                    z[i] = (u - (i > 0 ? a*z[i-1] : 0))/m;
                 }
 
-                inv_B = B.inverse();
+                for(Index i = n-2; i >= 0; --i) {
+                    ctrl_pts.Col(i) -= sup[i]*ctrl_pts.Col(i+1);
+                    z[i] -= sup[i]*z[i+1];
+                }
+
+                Matrix<_Tp,dim,1> const fact = (ctrl_pts.Col(0) + a*ctrl_pts.Col(n-1)/gamma)/(1 + z[0] + a*z[n-1]/gamma);
+                for(Index i = 0; i < n; ++i)
+                    ctrl_pts.Col(i) -= z[i]*fact;
+
+                /* x_i = c_{i+1}: rotate right by one */
+                Matrix<_Tp,dim,1> const back = ctrl_pts.Col(n-1);
+                for(Index i = n-1; i > 0; --i)
+                    ctrl_pts.Col(i) = ctrl_pts.Col(i-1);
+                ctrl_pts.Col(0) = back;
             }
+        }
 
-            ctrl_pts = (inv_B*knot_pts.transpose()).transpose();
+        UpdateArcLengths();
+    }
 
+    /* Newton iteration on (C(t) - pt).C'(t) = 0, clamped to the segment */
+    static _Tp RefineClosestParam(Matrix<_Tp,dim,4> const& poly, Matrix<_Tp,dim,1> const& pt, _Tp t)
+    {
+        for(int iter = 0; iter < 8; ++iter) {
+            Matrix<_Tp,dim,1> const diff = EvalPoly(poly, t) - pt;
+            Matrix<_Tp,dim,1> const d1 = EvalPoly(poly, t, 1);
+            _Tp const dg = d1.squaredNorm() + diff.dot(EvalPoly(poly, t, 2));
+            if(dg <= 0)
+                break;
+
+            _Tp const next_t = max<_Tp>(0, min<_Tp>(1, t - diff.dot(d1)/dg));
+            if(fabs(next_t - t) < 1e-6)
+                return next_t;
+            t = next_t;
         }
+
+        return t;
+    }
+
+    /* Distance from pt to the box of the control points of segment pt_idx, a lower bound for the segment */
+    _Tp SegmentBoxDist(int const pt_idx, Matrix<_Tp,dim,1> const& pt) const
+    {
+        Matrix<_Tp,dim,1> lo = ctrl_pts.Col(GetPtIdx(pt_idx-1));
+        Matrix<_Tp,dim,1> hi = lo;
+        for(int k = 0; k < 3; ++k) {
+            lo = lo.cwiseMin(ctrl_pts.Col(GetPtIdx(pt_idx+k)));
+            hi = hi.cwiseMax(ctrl_pts.Col(GetPtIdx(pt_idx+k)));
+        }
+
+        return (lo - pt).cwiseMax(pt - hi).cwiseMax(Matrix<_Tp,dim,1>::Zero()).norm();
+    }
+
+    /* Bisect [a, b] until the chord error bound is within tolerance, emitting the end of each accepted chord */
+    template<typename OutputIt>
+    static OutputIt Subdivide(Matrix<_Tp,dim,4> const& poly, _Tp const a, _Tp const b, _Tp const acc_a, _Tp const acc_b,
+                              _Tp const tolerance, int const depth, OutputIt out)
+    {
+        _Tp const h = b - a;
+        if(h*h*max(acc_a, acc_b)/8 <= tolerance || depth >= max_subdiv_depth) {
+            *out++ = EvalPoly(poly, b);
+            return out;
+        }
+
+        _Tp const m = (a + b)/2;
+        _Tp const acc_m = EvalPoly(poly, m, 2).norm();
+
+        out = Subdivide(poly, a, m, acc_a, acc_m, tolerance, depth+1, out);
+        return Subdivide(poly, m, b, acc_m, acc_b, tolerance, depth+1, out);
+    }
+
+    /*
+     * Parameter at arc length s within table interval i. Arc length over the
+     * interval is modelled as the cubic Hermite of its ends (length and speed),
+     * which stays accurate where the speed vanishes at clamped ends, and
+     * inverted with a few Newton steps.
+     */
+    _Tp TableParam(Index const i, _Tp const s) const
+    {
+        _Tp const len = arc_table[i+1] - arc_table[i];
+        _Tp const m0 = speed_table[i]/arc_subdiv;
+        _Tp const m1 = speed_table[i+1]/arc_subdiv;
+        _Tp const target = s - arc_table[i];
+
+        _Tp u = len > 0 ? max<_Tp>(0, min<_Tp>(1, target/len)) : 0;
+        for(int iter = 0; len > 0 && iter < 4; ++iter) {
+            _Tp const u2 = u*u;
+            _Tp const u3 = u2*u;
+            _Tp const f = (u3 - 2*u2 + u)*m0 + (-2*u3 + 3*u2)*len + (u3 - u2)*m1 - target;
+            _Tp const df = (3*u2 - 4*u + 1)*m0 + (-6*u2 + 6*u)*len + (3*u2 - 2*u)*m1;
+            if(df <= 0)
+                break;
+            u = max<_Tp>(0, min<_Tp>(1, u - f/df));
+            if(fabs(f) < 1e-3*len)
+                break;
+        }
+
+        return (i%arc_subdiv + u)/arc_subdiv;
+    }
+
+    /* Cumulative arc length at arc_subdiv intervals of every segment drawn, from GetFirstSeg() */
+    void UpdateArcLengths()
+    {
+        ++revision;
+
+        if(!IsReady()) {
+            num_arc_segs = 0;
+            return;
+        }
+
+        num_arc_segs = GetNumSegs();
+        Index const num_entries = num_arc_segs*arc_subdiv + 1;
+        if(arc_table.rows() < num_entries) {
+            arc_table.resize(max_pts == Dynamic ? max<Index>(num_entries, 2*arc_table.rows()) : num_entries);
+            speed_table.resize(arc_table.rows());
+        }
+
+        Matrix<_Tp,dim,4> poly;
+        arc_table[0] = 0;
+        for(Index seg = 0; seg < num_arc_segs; ++seg) {
+            poly = SegmentPoly(GetFirstSeg() + seg);
+            for(Index j = 0; j < arc_subdiv; ++j) {
+                Index const i = seg*arc_subdiv + j;
+                arc_table[i+1] = arc_table[i] + PolyLength(poly, _Tp(j)/arc_subdiv, _Tp(j+1)/arc_subdiv);
+                speed_table[i] = EvalPoly(poly, _Tp(j)/arc_subdiv, 1).norm();
+            }
+        }
+        speed_table[num_entries-1] = EvalPoly(poly, 1, 1).norm();
+    }
+
+    /* Solver scratch, on the stack with a fixed max_pts */
+    typedef Matrix<_Tp,(max_pts == Dynamic ? Dynamic : 2*max_pts),1> Scratch;
+
+    typename Scratch::SegmentReturnType Sup(Index const n)
+    {
+        if(scratch.rows() < 2*n)
+            scratch.resize(2*max(n, knot_pts.Capacity()));
+        return scratch.segment(0, n);
+    }
+
+    typename Scratch::SegmentReturnType Z(Index const n)
+    {
+        return scratch.segment(n, n);
     }
 
     /* Cubic Bspline basis matrix */
     Matrix<_Tp,4,4> CubicBsplineMatrix;
 
     /* Knot points */
-    Matrix<_Tp,dim,Dynamic> knot_pts;
+    BsplinePts<_Tp,dim,max_pts> knot_pts;
 
     /* Control points */
-    Matrix<_Tp,dim,Dynamic> ctrl_pts;
+    BsplinePts<_Tp,dim,max_pts> ctrl_pts;
+
+    Scratch scratch;
+
+    /* Arc-length and speed tables, on the stack with a fixed max_pts */
+    enum { arc_subdiv = 8, max_subdiv_depth = 16, closest_sample_spacing = 4 };
+    typedef Matrix<_Tp,Dynamic,1,0,(max_pts == Dynamic ? Dynamic : (max_pts+1)*arc_subdiv+1),1> ArcTable;
+
+    ArcTable arc_table;
+    ArcTable speed_table;
+    Index num_arc_segs;
+
+    size_t revision;
 
     /* Level of details */
     size_t lod;
 
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 #endif // LABEL_CATHETER_BSPLINE_H
@@ -0,0 +1,139 @@
+#ifndef LABEL_CATHETER_DISTANCE_TRANSFORM_H
+#define LABEL_CATHETER_DISTANCE_TRANSFORM_H
+
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <thread>
+#include <vector>
+
+//! @brief Exact 1D squared distance transform of a sampled function
+/*!
+ * Lower envelope of the parabolas rooted at every sample (Felzenszwalb and
+ * Huttenlocher), O(n). d receives min_q (p - q)^2 + f(q) and arg the
+ * minimising q, or -1 where every f is infinite. v and z are scratch of n and
+ * n+1 elements.
+ */
+inline void DistanceTransform1D(float const* f, int const n, float* d, int* arg, int* v, float* z)
+{
+    float const inf = std::numeric_limits<float>::infinity();
+
+    int k = -1;
+    for(int q = 0; q < n; ++q) {
+        if(f[q] == inf)
+            continue;
+
+        float s = -inf;
+        while(k >= 0) {
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k]))/(2.0f*(q - v[k]));
+            if(s > z[k])
+                break;
+            --k;
+        }
+
+        ++k;
+        v[k] = q;
+        z[k] = k == 0 ? -inf : s;
+        z[k+1] = inf;
+    }
+
+    if(k < 0) {
+        for(int p = 0; p < n; ++p) {
+            d[p] = inf;
+            arg[p] = -1;
+        }
+        return;
+    }
+
+    int j = 0;
+    for(int p = 0; p < n; ++p) {
+        while(z[j+1] < p)
+            ++j;
+        d[p] = (p - v[j])*(p - v[j]) + f[v[j]];
+        arg[p] = v[j];
+    }
+}
+
+namespace detail {
+
+/* Call f(first, last) on consecutive ranges covering [0, n), one per thread, the calling thread takes the first */
+template<typename F>
+void ForEachRange(size_t const n, size_t num_threads, F f)
+{
+    if(num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    size_t const num_tasks = std::max<size_t>(1, std::min(num_threads, n));
+    size_t const chunk = (n + num_tasks - 1)/num_tasks;
+
+    std::vector<std::future<void> > tasks;
+    for(size_t first = chunk; first < n; first += chunk)
+        tasks.push_back(std::async(std::launch::async, [&f, first, chunk, n]() { f(first, std::min(n, first+chunk)); }));
+    f(0, std::min(n, chunk));
+
+    for(auto& task : tasks)
+        task.get();
+}
+
+} // namespace detail
+
+//! @brief Squared Euclidean distance to, and index of, the nearest feature pixel
+/*!
+ * is_feature(x, y) marks the features of a w x h grid. sq_dist and nearest
+ * are row-major, nearest holding y*w + x of the closest feature or -1 when
+ * there is none. Separable: a column pass then a row pass of the 1D
+ * transform, O(w*h) whatever the feature density. Columns, then rows, are
+ * independent and split across num_threads threads (0 for all cores), so
+ * is_feature must be safe to call concurrently.
+ */
+template<typename IsFeature>
+void FeatureTransform(size_t const w, size_t const h, IsFeature is_feature, std::vector<float>& sq_dist, std::vector<int>& nearest,
+                      size_t const num_threads = 1)
+{
+    float const inf = std::numeric_limits<float>::infinity();
+    size_t const n = std::max(w, h);
+
+    sq_dist.resize(w*h);
+    nearest.resize(w*h);
+
+    /* Columns: distance to the nearest feature in the same column, nearest holds its row */
+    detail::ForEachRange(w, num_threads, [&](size_t const first, size_t const last) {
+        std::vector<float> f(n), d(n), z(n+1);
+        std::vector<int> arg(n), v(n);
+
+        for(size_t x = first; x < last; ++x) {
+            for(size_t y = 0; y < h; ++y)
+                f[y] = is_feature(x, y) ? 0 : inf;
+
+            DistanceTransform1D(f.data(), h, d.data(), arg.data(), v.data(), z.data());
+
+            for(size_t y = 0; y < h; ++y) {
+                sq_dist[y*w+x] = d[y];
+                nearest[y*w+x] = arg[y];
+            }
+        }
+    });
+
+    /* Rows: combine with the column distances, the feature is in the minimising column */
+    detail::ForEachRange(h, num_threads, [&](size_t const first, size_t const last) {
+        std::vector<float> d(n), z(n+1);
+        std::vector<int> arg(n), v(n), row_of(w);
+
+        for(size_t y = first; y < last; ++y) {
+            float* row = &sq_dist[y*w];
+            int* nearest_row = &nearest[y*w];
+
+            for(size_t x = 0; x < w; ++x)
+                row_of[x] = nearest_row[x];
+
+            DistanceTransform1D(row, w, d.data(), arg.data(), v.data(), z.data());
+
+            for(size_t x = 0; x < w; ++x) {
+                row[x] = d[x];
+                nearest_row[x] = arg[x] >= 0 ? row_of[arg[x]]*w + arg[x] : -1;
+            }
+        }
+    });
+}
+
+#endif // LABEL_CATHETER_DISTANCE_TRANSFORM_H
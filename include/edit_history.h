@@ -0,0 +1,249 @@
+#ifndef LABEL_CATHETER_EDIT_HISTORY_H
+#define LABEL_CATHETER_EDIT_HISTORY_H
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "bspline.h"
+#include "label_data.h"
+
+//! @brief One undoable change of the label in progress, stored as a delta
+/*!
+ * Knot edits keep only the knots they touch: an insert or erase the one
+ * knot, a move the moved knots before and after. Only replacing all knots
+ * (a reset) keeps the whole set. An export keeps the frame and its pixel
+ * chains, never the rest of the label data. Every edit names the curve it
+ * applies to.
+ */
+struct LabelEdit
+{
+    enum Type {INSERT_KNOT = 0, ERASE_KNOT, MOVE_KNOTS, REPLACE_KNOTS, ADD_CURVE, SET_CLASS, EXPORT_FRAME} type;
+
+    /* Curve of a knot edit, the added or relabelled curve */
+    size_t curve_idx;
+    /* Curve selected before a curve was added */
+    size_t from_curve_idx;
+    /* Class of the added curve, or the class before and after a relabel */
+    int class_before;
+    int class_after;
+
+    /* Knot of an insert or erase, knots of a move */
+    std::vector<size_t> knot_idx;
+    /* Knots before and after the edit, empty when there are none */
+    Eigen::Matrix<float,2,Eigen::Dynamic> before;
+    Eigen::Matrix<float,2,Eigen::Dynamic> after;
+
+    /* Exported frame and its pixel chains */
+    size_t frame_idx;
+    FrameLabel frame;
+
+    static LabelEdit InsertKnot(size_t const idx, Eigen::Vector2f const& pt)
+    {
+        LabelEdit edit(INSERT_KNOT);
+        edit.knot_idx.push_back(idx);
+        edit.after = pt;
+        return edit;
+    }
+
+    static LabelEdit EraseKnot(size_t const idx, Eigen::Vector2f const& pt)
+    {
+        LabelEdit edit(ERASE_KNOT);
+        edit.knot_idx.push_back(idx);
+        edit.before = pt;
+        return edit;
+    }
+
+    /* Only the knots that differ between before and after, which must have as many knots */
+    static LabelEdit MoveKnots(Eigen::Matrix<float,2,Eigen::Dynamic> const& before, Eigen::Matrix<float,2,Eigen::Dynamic> const& after)
+    {
+        LabelEdit edit(MOVE_KNOTS);
+        for(Eigen::Index k = 0; k < before.cols(); ++k)
+            if(before.col(k) != after.col(k))
+                edit.knot_idx.push_back(k);
+
+        edit.before.resize(2, edit.knot_idx.size());
+        edit.after.resize(2, edit.knot_idx.size());
+        for(size_t i = 0; i < edit.knot_idx.size(); ++i) {
+            edit.before.col(i) = before.col(edit.knot_idx[i]);
+            edit.after.col(i) = after.col(edit.knot_idx[i]);
+        }
+        return edit;
+    }
+
+    static LabelEdit MoveKnot(size_t const idx, Eigen::Vector2f const& from, Eigen::Vector2f const& to)
+    {
+        LabelEdit edit(MOVE_KNOTS);
+        if(from != to) {
+            edit.knot_idx.push_back(idx);
+            edit.before = from;
+            edit.after = to;
+        }
+        return edit;
+    }
+
+    static LabelEdit ReplaceKnots(Eigen::Matrix<float,2,Eigen::Dynamic> const& before, Eigen::Matrix<float,2,Eigen::Dynamic> const& after)
+    {
+        LabelEdit edit(REPLACE_KNOTS);
+        edit.before = before;
+        edit.after = after;
+        return edit;
+    }
+
+    static LabelEdit AddCurve(size_t const curve_idx, size_t const from_curve_idx, int const class_id)
+    {
+        LabelEdit edit(ADD_CURVE);
+        edit.curve_idx = curve_idx;
+        edit.from_curve_idx = from_curve_idx;
+        edit.class_after = class_id;
+        return edit;
+    }
+
+    static LabelEdit SetClass(size_t const curve_idx, int const before, int const after)
+    {
+        LabelEdit edit(SET_CLASS);
+        edit.curve_idx = curve_idx;
+        edit.class_before = before;
+        edit.class_after = after;
+        return edit;
+    }
+
+    static LabelEdit ExportFrame(size_t const frame_idx, FrameLabel const& frame)
+    {
+        LabelEdit edit(EXPORT_FRAME);
+        edit.frame_idx = frame_idx;
+        edit.frame = frame;
+        return edit;
+    }
+
+    /* Edits of the knots of curve_idx, the others change the curves or label data and are applied by the caller */
+    bool IsKnotEdit() const { return type <= REPLACE_KNOTS; }
+
+    /* A move that moved nothing, a reset of no knots or a relabel to the same class */
+    bool IsEmpty() const
+    {
+        return (type == MOVE_KNOTS && knot_idx.empty()) || (type == REPLACE_KNOTS && before.cols() == 0 && after.cols() == 0) ||
+               (type == SET_CLASS && class_before == class_after);
+    }
+
+    //! @brief Redo (forward) or undo the knot edit on bspline
+    template<int max_pts>
+    void Apply(Bspline<float,2,max_pts>& bspline, bool const forward) const
+    {
+        Eigen::Matrix<float,2,Eigen::Dynamic> const& to = forward ? after : before;
+
+        switch(type) {
+        case INSERT_KNOT:
+        case ERASE_KNOT:
+            if((type == INSERT_KNOT) == forward)
+                bspline.InsertKnotPt(knot_idx[0], to.col(0));
+            else
+                bspline.RemoveKnotPt(knot_idx[0]);
+            break;
+        case MOVE_KNOTS:
+            for(size_t i = 0; i < knot_idx.size(); ++i)
+                if(knot_idx[i] < bspline.GetNumKnotPts())
+                    bspline.SetKnotPt(knot_idx[i], to.col(i));
+            break;
+        case REPLACE_KNOTS:
+            bspline.Reset();
+            if(to.cols() > 0)
+                bspline.AddBackKnotPts(to);
+            break;
+        default:
+            break;
+        }
+    }
+
+    size_t MemoryBytes() const
+    {
+        return sizeof(LabelEdit) + knot_idx.size()*sizeof(size_t) + (before.size() + after.size())*sizeof(float) + frame.GetNumPts()*sizeof(Eigen::Vector2i) + frame.GetNumCurves()*(sizeof(size_t) + sizeof(int));
+    }
+
+private:
+    explicit LabelEdit(Type const type)
+        : type(type), curve_idx(0), from_curve_idx(0), class_before(0), class_after(0), frame_idx(0)
+    {}
+};
+
+//! @brief Undo and redo stacks of label edits
+/*!
+ * Edits are deltas, so the memory held grows with the number and size of
+ * the edits, not with the number of knots or labelled frames. Recording an
+ * edit clears the redo stack; beyond max_edits the oldest edit is dropped.
+ * Undo() and Redo() move an edit between the stacks and return it for the
+ * caller to apply: knot edits with LabelEdit::Apply() on their curve, the
+ * others to its own curves and label data.
+ */
+class EditHistory
+{
+public:
+    explicit EditHistory(size_t const max_edits = 1000)
+        : max_edits(max_edits), memory_bytes(0)
+    {}
+
+    void Record(LabelEdit const& edit)
+    {
+        if(edit.IsEmpty())
+            return;
+
+        for(auto const& redo_edit : redo_edits)
+            memory_bytes -= redo_edit.MemoryBytes();
+        redo_edits.clear();
+
+        undo_edits.push_back(edit);
+        memory_bytes += edit.MemoryBytes();
+
+        if(undo_edits.size() > max_edits) {
+            memory_bytes -= undo_edits.front().MemoryBytes();
+            undo_edits.pop_front();
+        }
+    }
+
+    bool CanUndo() const { return !undo_edits.empty(); }
+    bool CanRedo() const { return !redo_edits.empty(); }
+
+    /* Edit to revert, NULL when there is none; valid until the next change of the history */
+    LabelEdit const* Undo()
+    {
+        if(undo_edits.empty())
+            return NULL;
+
+        redo_edits.push_back(std::move(undo_edits.back()));
+        undo_edits.pop_back();
+        return &redo_edits.back();
+    }
+
+    /* Edit to apply again, NULL when there is none; valid until the next change of the history */
+    LabelEdit const* Redo()
+    {
+        if(redo_edits.empty())
+            return NULL;
+
+        undo_edits.push_back(std::move(redo_edits.back()));
+        redo_edits.pop_back();
+        return &undo_edits.back();
+    }
+
+    void Clear()
+    {
+        undo_edits.clear();
+        redo_edits.clear();
+        memory_bytes = 0;
+    }
+
+    size_t GetNumUndo() const { return undo_edits.size(); }
+    size_t GetNumRedo() const { return redo_edits.size(); }
+    size_t GetMemoryBytes() const { return memory_bytes; }
+
+private:
+    size_t max_edits;
+    size_t memory_bytes;
+
+    std::deque<LabelEdit> undo_edits;
+    std::deque<LabelEdit> redo_edits;
+};
+
+#endif // LABEL_CATHETER_EDIT_HISTORY_H
@@ -0,0 +1,252 @@
+#ifndef LABEL_CATHETER_ENHANCE_H
+#define LABEL_CATHETER_ENHANCE_H
+
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/gil/gil_all.hpp>
+
+//! @brief Settings of the display enhancement, applied in the order declared
+struct EnhanceParams
+{
+    EnhanceParams()
+        : median(true), black(0), white(255), clahe(true), clahe_tiles(8), clahe_clip(2.5)
+    {}
+
+    bool operator==(EnhanceParams const& other) const
+    {
+        return median == other.median && black == other.black && white == other.white &&
+               clahe == other.clahe && clahe_tiles == other.clahe_tiles && clahe_clip == other.clahe_clip;
+    }
+
+    bool operator!=(EnhanceParams const& other) const { return !(*this == other); }
+
+    /* 3x3 median against quantum noise */
+    bool median;
+    /* Window, gray levels mapped to 0 and 255 */
+    int black;
+    int white;
+    /* Contrast limited adaptive histogram equalisation over a tiles x tiles grid */
+    bool clahe;
+    int clahe_tiles;
+    float clahe_clip;
+};
+
+//! @brief Contrast enhancement of grayscale frames for display
+/*!
+ * Every stage is a pass over contiguous rows without data-dependent
+ * branches (the median is made of min/max of sorted columns, window/level a lookup
+ * table, CLAHE bilinearly blends per-tile lookup tables), which the compiler
+ * vectorises. Buffers are reused between frames, so an enhancer is meant to
+ * be owned by one thread at a time, e.g. the frame prefetcher.
+ */
+class FrameEnhancer
+{
+public:
+    FrameEnhancer()
+        : w(0), h(0)
+    {}
+
+    //! @brief Enhance src into a tightly packed RGB buffer, which may be write-only mapped memory
+    void Apply(boost::gil::gray8c_view_t const& src, EnhanceParams const& params, unsigned char* rgb_dst)
+    {
+        w = src.width();
+        h = src.height();
+        buf.resize(w*h);
+        tmp.resize(w*h);
+
+        if(params.median)
+            Median3x3(src, buf.data());
+        else
+            for(size_t y = 0; y < h; ++y)
+                memcpy(&buf[y*w], &src(0, y), w);
+
+        WindowLevel(params.black, params.white, buf.data());
+
+        if(params.clahe) {
+            Clahe(buf.data(), std::max(1, params.clahe_tiles), params.clahe_clip, tmp.data());
+            buf.swap(tmp);
+        }
+
+        /* Gray to RGB a row at a time, so mapped memory only sees sequential writes */
+        std::vector<unsigned char> row(3*w);
+        for(size_t y = 0; y < h; ++y) {
+            unsigned char const* in = &buf[y*w];
+            for(size_t x = 0; x < w; ++x)
+                row[3*x] = row[3*x+1] = row[3*x+2] = in[x];
+            memcpy(rgb_dst + y*3*w, row.data(), 3*w);
+        }
+    }
+
+    /* Grayscale result of the last Apply() */
+    boost::gil::gray8c_view_t GetResult() const
+    {
+        return boost::gil::interleaved_view(w, h, (boost::gil::gray8c_pixel_t const*)buf.data(), w);
+    }
+
+private:
+
+    static inline unsigned char Median3(unsigned char const a, unsigned char const b, unsigned char const c)
+    {
+        return std::max(std::min(a, b), std::min(std::max(a, b), c));
+    }
+
+    /* Columns of each 3x3 window are sorted first, the median is then the
+     * median of the largest low, the median middle and the smallest high */
+    void Median3x3(boost::gil::gray8c_view_t const& src, unsigned char* dst)
+    {
+        size_t const stride = w+2;
+        pad.resize(3*stride);
+        cols.resize(4*stride*h + 2);
+
+        unsigned char* lo = &cols[0];
+        unsigned char* mid = &cols[stride*h];
+        unsigned char* hi = &cols[2*stride*h];
+        unsigned char* med = &cols[3*stride*h];
+
+        /* Sorted columns over edge-replicated rows, one flat array per rank */
+        for(size_t y = 0; y < h; ++y) {
+            for(int i = 0; i < 3; ++i) {
+                unsigned char* row = &pad[i*stride];
+                memcpy(row+1, &src(0, std::max(0, std::min<int>(h-1, int(y)+i-1))), w);
+                row[0] = row[1];
+                row[w+1] = row[w];
+            }
+
+            SortColumns(&pad[0], &pad[stride], &pad[2*stride], stride, lo + y*stride, mid + y*stride, hi + y*stride);
+        }
+
+        /* Horizontal pass over the whole image at once, the two last outputs of each row straddle rows and are dropped */
+        MedianRows(lo, mid, hi, stride*h - 2, med);
+
+        for(size_t y = 0; y < h; ++y)
+            memcpy(dst + y*w, med + y*stride, w);
+    }
+
+    static void SortColumns(unsigned char const* r0, unsigned char const* r1, unsigned char const* r2, size_t const n,
+                            unsigned char* lo, unsigned char* mid, unsigned char* hi)
+    {
+        /* Two loops keep the run-time alias checks few enough for the vectoriser */
+        for(size_t x = 0; x < n; ++x) {
+            lo[x] = std::min(std::min(r0[x], r1[x]), r2[x]);
+            hi[x] = std::max(std::max(r0[x], r1[x]), r2[x]);
+        }
+
+        for(size_t x = 0; x < n; ++x)
+            mid[x] = Median3(r0[x], r1[x], r2[x]);
+    }
+
+    static void MedianRows(unsigned char const* lo, unsigned char const* mid, unsigned char const* hi, size_t const n, unsigned char* out)
+    {
+        for(size_t x = 0; x < n; ++x) {
+            unsigned char const max_lo = std::max(std::max(lo[x], lo[x+1]), lo[x+2]);
+            unsigned char const min_hi = std::min(std::min(hi[x], hi[x+1]), hi[x+2]);
+            out[x] = Median3(max_lo, Median3(mid[x], mid[x+1], mid[x+2]), min_hi);
+        }
+    }
+
+    void WindowLevel(int const black, int const white, unsigned char* img) const
+    {
+        if(black <= 0 && white >= 255)
+            return;
+
+        unsigned char lut[256];
+        float const scale = 255.0f/std::max(1, white - black);
+        for(int i = 0; i < 256; ++i)
+            lut[i] = std::max(0, std::min(255, int((i - black)*scale + 0.5f)));
+
+        for(size_t i = 0; i < w*h; ++i)
+            img[i] = lut[img[i]];
+    }
+
+    void Clahe(unsigned char const* img, int const tiles, float const clip, unsigned char* dst)
+    {
+        int const tiles_x = std::min<int>(tiles, w);
+        int const tiles_y = std::min<int>(tiles, h);
+        size_t const tile_w = (w + tiles_x - 1)/tiles_x;
+        size_t const tile_h = (h + tiles_y - 1)/tiles_y;
+
+        /* Clipped, equalised lookup table per tile */
+        luts.resize(tiles_x*tiles_y*256);
+        for(int ty = 0; ty < tiles_y; ++ty) {
+            for(int tx = 0; tx < tiles_x; ++tx) {
+                size_t const x0 = tx*tile_w, x1 = std::min(w, x0 + tile_w);
+                size_t const y0 = ty*tile_h, y1 = std::min(h, y0 + tile_h);
+                size_t const num_px = (x1 - x0)*(y1 - y0);
+
+                unsigned hist[256] = {0};
+                for(size_t y = y0; y < y1; ++y)
+                    for(size_t x = x0; x < x1; ++x)
+                        hist[img[y*w+x]]++;
+
+                /* Clip and spread the excess evenly */
+                unsigned const limit = std::max<unsigned>(1, clip*num_px/256);
+                unsigned excess = 0;
+                for(int i = 0; i < 256; ++i) {
+                    if(hist[i] > limit) {
+                        excess += hist[i] - limit;
+                        hist[i] = limit;
+                    }
+                }
+                for(int i = 0; i < 256; ++i)
+                    hist[i] += excess/256 + (unsigned(i) < excess%256 ? 1 : 0);
+
+                unsigned char* lut = &luts[(ty*tiles_x + tx)*256];
+                unsigned cdf = 0;
+                for(int i = 0; i < 256; ++i) {
+                    cdf += hist[i];
+                    lut[i] = std::min<unsigned>(255, (255*cdf + num_px/2)/std::max<size_t>(1, num_px));
+                }
+            }
+        }
+
+        /* Bilinear blend of the four closest tile centres, column weights shared by all rows */
+        col_tile0.resize(w);
+        col_tile1.resize(w);
+        col_weight.resize(w);
+        for(size_t x = 0; x < w; ++x) {
+            float const fx = (x + 0.5f)/tile_w - 0.5f;
+            int const t0 = std::max(0, std::min(tiles_x-1, int(floor(fx))));
+            col_tile0[x] = t0*256;
+            col_tile1[x] = std::min(tiles_x-1, t0+1)*256;
+            col_weight[x] = std::max(0.0f, std::min(1.0f, fx - t0));
+        }
+
+        for(size_t y = 0; y < h; ++y) {
+            float const fy = (y + 0.5f)/tile_h - 0.5f;
+            int const t0 = std::max(0, std::min(tiles_y-1, int(floor(fy))));
+            int const t1 = std::min(tiles_y-1, t0+1);
+            float const wy = std::max(0.0f, std::min(1.0f, fy - t0));
+
+            unsigned char const* lut0 = &luts[t0*tiles_x*256];
+            unsigned char const* lut1 = &luts[t1*tiles_x*256];
+            unsigned char const* in = img + y*w;
+            unsigned char* out = dst + y*w;
+
+            for(size_t x = 0; x < w; ++x) {
+                int const v = in[x];
+                float const top = (1 - col_weight[x])*lut0[col_tile0[x] + v] + col_weight[x]*lut0[col_tile1[x] + v];
+                float const bottom = (1 - col_weight[x])*lut1[col_tile0[x] + v] + col_weight[x]*lut1[col_tile1[x] + v];
+                out[x] = (unsigned char)((1 - wy)*top + wy*bottom + 0.5f);
+            }
+        }
+    }
+
+    size_t w, h;
+
+    std::vector<unsigned char> buf;
+    std::vector<unsigned char> tmp;
+
+    std::vector<unsigned char> pad;
+    std::vector<unsigned char> cols;
+
+    std::vector<unsigned char> luts;
+    std::vector<int> col_tile0;
+    std::vector<int> col_tile1;
+    std::vector<float> col_weight;
+};
+
+#endif // LABEL_CATHETER_ENHANCE_H
@@ -1,41 +1,151 @@
 #ifndef LABEL_CATHETERE_PANGO_DRAWER
 #define LABEL_CATHETERE_PANGO_DRAWER
 
+#include <deque>
 #include <queue>
 
 #include <pangolin/pangolin.h>
 #include <pangolin/gl.h>
 #include <pangolin/glsl.h>
 
+#include "../biplane.h"
 #include "../bspline.h"
+#include "../label_data.h"
 
 using namespace Eigen;
 using namespace pangolin;
 
+//! @brief Zoom and pan of an image view, shared by the handler and the drawers
+/*!
+ * The view shows the image around centre, magnified by zoom (1 fits the
+ * whole image to the viewport). Image coordinates are pixel centres with a
+ * top-left origin, so pixel (x, y) covers [x-0.5, x+0.5] x [y-0.5, y+0.5].
+ * Drawing and picking both go through this transform, which keeps overlays
+ * aligned with the texture at any zoom.
+ */
+class ViewTransform2D
+{
+public:
+    ViewTransform2D(size_t const w, size_t const h)
+        : w(w), h(h), max_zoom(64)
+    {
+        Reset();
+    }
+
+    size_t GetWidth() const { return w; }
+    size_t GetHeight() const { return h; }
+    float GetZoom() const { return zoom; }
+    Vector2f GetCentre() const { return centre; }
+
+    /* Show the whole image */
+    void Reset()
+    {
+        zoom = 1;
+        centre = Vector2f(w/2.0f, h/2.0f);
+    }
+
+    Vector2f ImageToNDC(Vector2f const& img_pt) const
+    {
+        return Vector2f(2*zoom*(img_pt[0] + 0.5f - centre[0])/w, -2*zoom*(img_pt[1] + 0.5f - centre[1])/h);
+    }
+
+    Vector2f NDCToImage(Vector2f const& ndc_pt) const
+    {
+        return Vector2f(centre[0] + ndc_pt[0]*w/(2*zoom) - 0.5f, centre[1] - ndc_pt[1]*h/(2*zoom) - 0.5f);
+    }
+
+    static Vector2f WindowToNDC(Viewport const& v, float const wx, float const wy)
+    {
+        return Vector2f(2*(wx - v.l)/v.w - 1, 2*(wy - v.b)/v.h - 1);
+    }
+
+    /* Size of a window pixel in image pixels */
+    float ImagePerWindowPx(Viewport const& v) const
+    {
+        return w/(zoom*v.w);
+    }
+
+    /* Multiply the zoom, keeping the image point under ndc_pt in place */
+    void ZoomAt(Vector2f const& ndc_pt, float const factor)
+    {
+        Vector2f const pt = NDCToImage(ndc_pt);
+        zoom = std::max(1.0f, std::min(max_zoom, zoom*factor));
+        centre += pt - NDCToImage(ndc_pt);
+        ClampCentre();
+    }
+
+    /* Multiply the current GL matrix by ImageToNDC(), so vertex arrays can stay in image coordinates */
+    void MultImageToNDC() const
+    {
+        glScalef(2*zoom/w, -2*zoom/h, 1);
+        glTranslatef(0.5f - centre[0], 0.5f - centre[1], 0);
+    }
+
+    /* Move the image by a displacement in normalised device coordinates */
+    void Pan(Vector2f const& ndc_delta)
+    {
+        centre -= Vector2f(ndc_delta[0]*w/(2*zoom), -ndc_delta[1]*h/(2*zoom));
+        ClampCentre();
+    }
+
+private:
+
+    /* The view never leaves the image */
+    void ClampCentre()
+    {
+        float const half_w = w/(2*zoom);
+        float const half_h = h/(2*zoom);
+        centre[0] = std::max(half_w, std::min(w - half_w, centre[0]));
+        centre[1] = std::max(half_h, std::min(h - half_h, centre[1]));
+    }
+
+    size_t w, h;
+
+    float zoom;
+    float max_zoom;
+    Vector2f centre;
+};
+
 /* Flip Y from the handler! */
 class Handler2D : public Handler
 {
 public:
-    Handler2D(size_t const w, size_t const h)
-        : w(w), h(h)
+    //! @brief Left button press, drag or release in image coordinates
+    struct PointerEvent
+    {
+        enum Type {PRESS = 0, DRAG, RELEASE} type;
+        Vector2f pt;
+    };
+
+    /* Wheel zooms at the pointer, right or middle drag pans, 'f' fits the image */
+    Handler2D(ViewTransform2D& view_transform)
+        : view_transform(view_transform), w(view_transform.GetWidth()), h(view_transform.GetHeight()), zoom_step(1.25)
     {
         has_picked_pt = false;
         has_selected_roi = false;
+        has_hover_pt = false;
+        is_dragging = false;
+        is_panning = false;
 
         selected_roi = Vector4f::Zero();
         picked_pt = Vector2f::Zero();
+        hover_pt = Vector2f::Zero();
+        pan_pt = Vector2f::Zero();
+        image_per_window_px = 1;
     }
 
     void WindowToImage(const Viewport& v, int wx, int wy, float& ix, float& iy) const
     {
-        ix = w * (wx - v.l) /(float)v.w - 0.5;
-        iy = h * (wy - v.b) /(float)v.h - 0.5;
-        ix = std::max(0.0f,std::min(ix, w-1.0f));
-        iy = h - std::max(0.0f,std::min(iy, h-1.0f)) - 1.0;
+        Vector2f const pt = view_transform.NDCToImage(ViewTransform2D::WindowToNDC(v, wx, wy));
+        ix = std::max(0.0f,std::min(pt[0], w-1.0f));
+        iy = std::max(0.0f,std::min(pt[1], h-1.0f));
     }
 
     virtual void Keyboard(View&, unsigned char key, int /*x*/, int /*y*/, bool /*pressed*/)
     {
+        if(key == 'f')
+            view_transform.Reset();
+
         if(key == 'r') {
             has_picked_pt = false;
             picked_pt = Vector2f::Zero();
@@ -48,19 +158,77 @@ public:
     virtual void Mouse(View& view, MouseButton button, int x, int y, bool pressed, int /*button_state*/)
     {
 
-        if(pressed && button == MouseButtonLeft) {
-            WindowToImage(view.v, x, y, picked_pt[0], picked_pt[1]);
-            has_picked_pt = true;
+        if(button == MouseWheelUp || button == MouseWheelDown) {
+            if(pressed)
+                view_transform.ZoomAt(ViewTransform2D::WindowToNDC(view.v, x, y), button == MouseWheelUp ? zoom_step : 1/zoom_step);
+            image_per_window_px = view_transform.ImagePerWindowPx(view.v);
+        }
+
+        if(button == MouseButtonRight || button == MouseButtonMiddle) {
+            is_panning = pressed;
+            pan_pt = ViewTransform2D::WindowToNDC(view.v, x, y);
+        }
+
+        if(button == MouseButtonLeft) {
+            Vector2f pt;
+            WindowToImage(view.v, x, y, pt[0], pt[1]);
+            image_per_window_px = view_transform.ImagePerWindowPx(view.v);
+
+            if(pressed) {
+                picked_pt = pt;
+                has_picked_pt = true;
+                is_dragging = true;
+                PushEvent(PointerEvent::PRESS, pt);
+            } else if(is_dragging) {
+                is_dragging = false;
+                PushEvent(PointerEvent::RELEASE, pt);
+            }
         }
 
     }
 
     virtual void MouseMotion(View& view, int x, int y, int /*button_state*/)
     {
+        if(is_panning) {
+            Vector2f const ndc_pt = ViewTransform2D::WindowToNDC(view.v, x, y);
+            view_transform.Pan(ndc_pt - pan_pt);
+            pan_pt = ndc_pt;
+        }
+
         if(has_selected_roi)
             WindowToImage(view.v, x, y, selected_roi[2], selected_roi[3]);
+
+        if(is_dragging) {
+            WindowToImage(view.v, x, y, hover_pt[0], hover_pt[1]);
+            has_hover_pt = true;
+            PushEvent(PointerEvent::DRAG, hover_pt);
+        }
+    }
+
+    virtual void PassiveMouseMotion(View& view, int x, int y, int /*button_state*/)
+    {
+        WindowToImage(view.v, x, y, hover_pt[0], hover_pt[1]);
+        image_per_window_px = view_transform.ImagePerWindowPx(view.v);
+        has_hover_pt = true;
     }
 
+    /* Oldest pending pointer event, consecutive drags are merged */
+    bool PopEvent(PointerEvent& event)
+    {
+        if(events.empty())
+            return false;
+
+        event = events.front();
+        events.pop_front();
+        return true;
+    }
+
+    bool HasHoverPt() const { return has_hover_pt; }
+    Vector2f GetHoverPt() const { return hover_pt; }
+
+    /* Size of a window pixel in image pixels, to express pick radii on screen */
+    float GetImagePerWindowPx() const { return image_per_window_px; }
+
 
     Vector4f GetSelectedROI()
     {
@@ -89,7 +257,22 @@ public:
 
 private:    
 
+    void PushEvent(PointerEvent::Type const type, Vector2f const& pt)
+    {
+        if(type == PointerEvent::DRAG && !events.empty() && events.back().type == PointerEvent::DRAG) {
+            events.back().pt = pt;
+            return;
+        }
+
+        PointerEvent event;
+        event.type = type;
+        event.pt = pt;
+        events.push_back(event);
+    }
+
+    ViewTransform2D& view_transform;
     size_t w, h;
+    float zoom_step;
 
     bool has_selected_roi;
     Vector4f selected_roi;
@@ -97,15 +280,32 @@ private:
     bool has_picked_pt;
     Vector2f picked_pt;
 
+    bool has_hover_pt;
+    Vector2f hover_pt;
+
+    bool is_dragging;
+    bool is_panning;
+    Vector2f pan_pt;
+    float image_per_window_px;
+    deque<PointerEvent> events;
+
 };
 
 float colour_knot_pt[3] = {1.0, 0.0, 0.0};
+float colour_selected_knot_pt[3] = {1.0, 1.0, 0.0};
 float colour_ctrl_pt[3] = {0.0, 1.0, 1.0};
 float colour_spline[3] = {1.0, 1.0, 1.0};
 float colour_pipe_contour[3] = {0.0, 1.0, 0.0};
 float colour_pipe_contour_pts[3] = {1.0, 1.0, 0.0};
 float colour_tip_pts[3] = {1.0, 0.0, 1.0};
 float colour_tip_traj[3] = {1.0, 1.0, 0.0};
+float colour_epipolar[3] = {0.0, 1.0, 1.0};
+
+/* Curves by class id, cycling past the last */
+float colour_classes[8][3] = {{0.0, 1.0, 0.0}, {1.0, 0.5, 0.0}, {0.2, 0.6, 1.0}, {1.0, 0.0, 1.0},
+                              {1.0, 1.0, 0.0}, {0.0, 1.0, 1.0}, {1.0, 0.3, 0.3}, {0.7, 0.7, 0.7}};
+
+inline float const* ClassColour(int const class_id) { return colour_classes[(class_id > 0 ? class_id - 1 : 0) % 8]; }
 
 inline void glVertex( const Eigen::Vector2f& p ) { glVertex2fv(p.data()); }
 inline void glVertex( const Eigen::Vector2d& p ) { glVertex2dv(p.data()); }
@@ -130,8 +330,14 @@ public:
 class DrawTexture
 {
 public:
-    DrawTexture(GlTexture const& tex)
-        : tex(tex){}
+    DrawTexture(ViewTransform2D const& view_transform, GlTexture const& tex, GlTexture const* alt_tex = NULL)
+        : view_transform(view_transform), tex(tex), alt_tex(alt_tex), show_alt(false), pixel_zoom(4) {}
+
+    /* Draw the alternative (e.g. enhanced) texture instead, when there is one */
+    void ShowAlt(bool const show) { show_alt = show; }
+
+    /* Window pixels per image pixel above which pixels are drawn as flat squares rather than interpolated */
+    void SetPixelZoom(float const zoom) { pixel_zoom = zoom; }
 
     void operator()(pangolin::View& view) {
 
@@ -142,41 +348,81 @@ public:
 
         view.Activate();
 
-        tex.RenderToViewportFlipY();
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+
+        GlTexture const& shown_tex = show_alt && alt_tex ? *alt_tex : tex;
+
+        /* Only the visible part is rasterised, minified views sample the mipmaps when the texture has them */
+        Vector2f const tl = view_transform.ImageToNDC(Vector2f(-0.5, -0.5));
+        Vector2f const br = view_transform.ImageToNDC(Vector2f(view_transform.GetWidth()-0.5, view_transform.GetHeight()-0.5));
+
+        glEnable(GL_TEXTURE_2D);
+        shown_tex.Bind();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, 1/view_transform.ImagePerWindowPx(view.v) >= pixel_zoom ? GL_NEAREST : GL_LINEAR);
+
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2f(tl[0], tl[1]);
+        glTexCoord2f(1, 0); glVertex2f(br[0], tl[1]);
+        glTexCoord2f(1, 1); glVertex2f(br[0], br[1]);
+        glTexCoord2f(0, 1); glVertex2f(tl[0], br[1]);
+        glEnd();
+
+        shown_tex.Unbind();
 
         glPopAttrib();
     }
 
 private:
+    ViewTransform2D const& view_transform;
     GlTexture const& tex;
+    GlTexture const* alt_tex;
+    bool show_alt;
+    float pixel_zoom;
 };
 
 template<typename _Tp, int dim>
 class DrawBSpline
 {
 public:
-    DrawBSpline(size_t const w, size_t const h, Bspline<_Tp,dim> const& bspline)
-        : w(w), h(h), bspline(bspline), show_ctrl_pts(true), show_knot_pts(true), show_bspline(true)
+    DrawBSpline(ViewTransform2D const& view_transform, Bspline<_Tp,dim> const& bspline)
+        : view_transform(view_transform), bspline(&bspline), show_ctrl_pts(true), show_knot_pts(true), show_bspline(true), spacing(2), tolerance(0), selected_knot(-1)
     {}
 
     Vector2f ImageToNDC(Vector2f const img_pt) const {
-        return Vector2f((img_pt[0]+0.5) * 2.0 / w - 1, ((h-img_pt[1])+0.5) * 2.0 / h - 1);
+        return view_transform.ImageToNDC(img_pt);
     }
 
+    /* Draw another spline, e.g. when the selected curve changes */
+    void SetBspline(Bspline<_Tp,dim> const& bspline) { this->bspline = &bspline; }
+
     void ShowCtrlPts(bool const show) { show_ctrl_pts = show; }
     void ShowKnotPts(bool const show) { show_knot_pts = show; }
     void ShowBspline(bool const show) { show_bspline = show; }
 
+    /* Distance between drawn curve vertices in image pixels at zoom 1, finer when zoomed in */
+    void SetSpacing(float const spacing) { this->spacing = spacing; }
+
+    /* Maximum distance of the drawn polyline from the curve in image pixels at zoom 1, 0 for even spacing */
+    void SetTolerance(float const tolerance) { this->tolerance = tolerance; }
+
+    size_t GetNumCurvePts() const { return curve_pts.size(); }
+
+    /* Highlight a hovered or dragged knot, -1 for none */
+    void SetSelectedKnotPt(int const knot_idx) { selected_knot = knot_idx; }
+
     void SetOffset(Vector2f const& offset) {
         this->offset = offset;
     }
 
     void DrawCtrlPts()
     {
-        for(size_t k = 0; k < bspline.GetNumCtrlPts(); ++k)
+        for(size_t k = 0; k < bspline->GetNumCtrlPts(); ++k)
         {
 
-            Vector2f pt = bspline.GetCtrlPt(k);
+            Vector2f pt = bspline->GetCtrlPt(k);
             pt = ImageToNDC(Vector2f(pt[0], pt[1]));
 
             glColor3fv(colour_ctrl_pt);
@@ -186,33 +432,36 @@ public:
 
     void DrawKnotsPts()
     {
-        for(size_t k = 0; k < bspline.GetNumKnotPts(); ++k)
+        for(size_t k = 0; k < bspline->GetNumKnotPts(); ++k)
         {
-            Vector2f pt = bspline.GetKnotPt(k);
+            Vector2f pt = bspline->GetKnotPt(k);
 
             pt = ImageToNDC(Vector2f(pt[0], pt[1]));
 
-            glColor3fv(colour_knot_pt);
-            glDrawCircle(pt[0], pt[1], 0.005);
+            if((int)k == selected_knot) {
+                glColor3fv(colour_selected_knot_pt);
+                glDrawCircle(pt[0], pt[1], 0.008);
+            } else {
+                glColor3fv(colour_knot_pt);
+                glDrawCircle(pt[0], pt[1], 0.005);
+            }
         }
     }
 
     void DrawBspline()
     {
-        for(int pt_idx = -1, seg_idx = 0; seg_idx <= bspline.GetNumCtrlPts(); ++pt_idx, ++seg_idx)
-        {
-            for(int d = 0; d < bspline.GetLOD(); ++d)
-            {
-                Vector2f pt1 = bspline.CubicIntplt(pt_idx, d/float(bspline.GetLOD()));
-                Vector2f pt2 = bspline.CubicIntplt(pt_idx, (d+1)/float(bspline.GetLOD()));
-
-                glColor3fv(colour_spline);
-                glBegin(GL_LINES);
-                glVertex(ImageToNDC(Vector2f(pt1[0], pt1[1])));
-                glVertex(ImageToNDC(Vector2f(pt2[0], pt2[1])));
-                glEnd();
-            }
-        }
+        /* Adaptive chords within tolerance, or evenly spaced vertices */
+        curve_pts.clear();
+        if(tolerance > 0)
+            bspline->SampleAdaptive(tolerance/view_transform.GetZoom(), back_inserter(curve_pts));
+        else
+            bspline->SampleUniform(spacing/view_transform.GetZoom(), back_inserter(curve_pts));
+
+        glColor3fv(colour_spline);
+        glBegin(GL_LINE_STRIP);
+        for(auto const& pt : curve_pts)
+            glVertex(ImageToNDC(Vector2f(pt[0], pt[1])));
+        glEnd();
     }
 
     void operator()(pangolin::View& view) {
@@ -228,7 +477,7 @@ public:
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
 
-        if(show_bspline) if(bspline.IsReady()) DrawBspline();
+        if(show_bspline) if(bspline->IsReady()) DrawBspline();
         if(show_ctrl_pts) DrawCtrlPts();
         if(show_knot_pts) DrawKnotsPts();
 
@@ -237,74 +486,303 @@ public:
 
 private:
 
-    size_t w, h;
+    ViewTransform2D const& view_transform;
 
-    Bspline<_Tp,dim> const& bspline;
+    Bspline<_Tp,dim> const* bspline;
 
     bool show_ctrl_pts;
     bool show_knot_pts;
     bool show_bspline;
-};
 
+    float spacing;
+    float tolerance;
+    vector<Matrix<_Tp,dim,1> > curve_pts;
 
-typedef list<Vector2i> Pts;
-typedef list<Pts> LabelData;
+    int selected_knot;
+};
 
-class DrawTip
+//! @brief The curves of the frame, coloured by class, in a single draw call
+/*!
+ * Each curve is resampled only when its knots or class or the zoom
+ * changed. The polylines of all curves are kept back to back in one vertex
+ * and colour array in image coordinates, panning only changes the matrix,
+ * and all of them are drawn with one glMultiDrawArrays().
+ */
+class DrawCurves
 {
 public:
-    DrawTip(size_t const w, size_t const h, LabelData const& label_data)
-        : w(w), h(h), label_data(label_data), show_tip_traj(true)
+    DrawCurves(ViewTransform2D const& view_transform, std::deque<LabelCurve> const& curves)
+        : view_transform(view_transform), curves(curves), show_curves(true), spacing(2), tolerance(0), cached_zoom(0), cached_tolerance(0)
     {}
 
-    Vector2f ImageToNDC(Vector2f const img_pt) const {
-        return Vector2f((img_pt[0]+0.5) * 2.0 / w - 1, ((h-img_pt[1])+0.5) * 2.0 / h - 1);
-    }
+    void ShowCurves(bool const show) { show_curves = show; }
 
-    void ShowTipPts(bool const show) { show_tip_pts = show; }
-    void ShowTipTraj(bool const show) { show_tip_traj = show; }
+    /* As for DrawBSpline, in image pixels at zoom 1 */
+    void SetSpacing(float const spacing) { this->spacing = spacing; }
+    void SetTolerance(float const tolerance) { this->tolerance = tolerance; }
+
+    size_t GetNumCurvePts() const { return vertices.size(); }
+
+    void operator()(pangolin::View& view) {
+
+        if(!show_curves)
+            return;
+        Update();
+        if(vertices.empty())
+            return;
+
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_LIGHTING);
+
+        view.Activate();
 
-    void DrawTipPts() {
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        view_transform.MultImageToNDC();
+
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 0, vertices.data());
+        glColorPointer(3, GL_FLOAT, 0, colours.data());
+        glMultiDrawArrays(GL_LINE_STRIP, firsts.data(), counts.data(), counts.size());
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+
+        glLoadIdentity();
+        glPopAttrib();
+    }
 
-        for(auto label : label_data) {
-            if(label.size() > 0) {
-                Vector2f pt = ImageToNDC(Vector2f(label.back()[0], label.back()[1]));
-                glColor3fv(colour_tip_pts);
-                glDrawCircle(pt[0], pt[1], 0.002);
+private:
+
+    struct CachedCurve
+    {
+        size_t revision;
+        size_t num_knots;
+        int class_id;
+        vector<Vector2f> pts;
+    };
+
+    /* Resample what changed, and rebuild the arrays if anything did */
+    void Update()
+    {
+        bool const resample_all = view_transform.GetZoom() != cached_zoom || tolerance != cached_tolerance;
+        bool changed = resample_all || cached.size() != curves.size();
+        cached.resize(curves.size());
+
+        for(size_t c = 0; c < curves.size(); ++c) {
+            Bspline<float,2> const& bspline = curves[c].bspline;
+            CachedCurve& cache = cached[c];
+            if(!resample_all && cache.revision == bspline.GetRevision() && cache.num_knots == bspline.GetNumKnotPts() && cache.class_id == curves[c].class_id)
+                continue;
+
+            cache.revision = bspline.GetRevision();
+            cache.num_knots = bspline.GetNumKnotPts();
+            cache.class_id = curves[c].class_id;
+            cache.pts.clear();
+            if(bspline.IsReady()) {
+                if(tolerance > 0)
+                    bspline.SampleAdaptive(tolerance/view_transform.GetZoom(), back_inserter(cache.pts));
+                else
+                    bspline.SampleUniform(spacing/view_transform.GetZoom(), back_inserter(cache.pts));
             }
+            changed = true;
         }
 
+        cached_zoom = view_transform.GetZoom();
+        cached_tolerance = tolerance;
+        if(!changed)
+            return;
+
+        vertices.clear();
+        colours.clear();
+        firsts.clear();
+        counts.clear();
+        for(auto const& cache : cached) {
+            if(cache.pts.empty())
+                continue;
+            firsts.push_back(vertices.size());
+            counts.push_back(cache.pts.size());
+            vertices.insert(vertices.end(), cache.pts.begin(), cache.pts.end());
+            colours.resize(vertices.size(), Vector3f(ClassColour(cache.class_id)));
+        }
     }
 
-    void DrawTipTraj() {
+    ViewTransform2D const& view_transform;
+
+    std::deque<LabelCurve> const& curves;
+
+    bool show_curves;
+    float spacing;
+    float tolerance;
+
+    float cached_zoom;
+    float cached_tolerance;
+    vector<CachedCurve> cached;
+
+    vector<Vector2f> vertices;
+    vector<Vector3f> colours;
+    vector<GLint> firsts;
+    vector<GLsizei> counts;
+};
+
+//! @brief Projection of a 3D B-spline into one view of a biplane system
+/*!
+ * The curve is sampled in 3D, within a tolerance scaled by the pixels per
+ * world unit of the projection so the drawn polyline stays within the
+ * pixel tolerance, and projected into a vertex array in image coordinates.
+ * It is only resampled when the knots or the zoom changed. Knots are drawn
+ * at their projections. The epipolar line of a point picked in the other
+ * view, and a marker on a point picked in this one, can be shown as well.
+ */
+class DrawProjectedCurve
+{
+public:
+    DrawProjectedCurve(ViewTransform2D const& view_transform, Bspline<float,3> const& bspline, ProjMatrix const& proj)
+        : view_transform(view_transform), bspline(bspline), proj(proj), show_knot_pts(true), show_bspline(true), tolerance(0.25),
+          selected_knot(-1), show_line(false), show_marker(false), cached_revision(0), cached_zoom(0)
+    {}
+
+    void ShowKnotPts(bool const show) { show_knot_pts = show; }
+    void ShowBspline(bool const show) { show_bspline = show; }
+
+    /* Largest distance of the drawn polyline from the projected curve in image pixels at zoom 1 */
+    void SetTolerance(float const tolerance) { this->tolerance = std::max(0.01f, tolerance); }
+
+    size_t GetNumCurvePts() const { return curve_pts.size(); }
+
+    /* Highlight a hovered or dragged knot, -1 for none */
+    void SetSelectedKnotPt(int const knot_idx) { selected_knot = knot_idx; }
+
+    void SetEpipolarLine(Vector3f const& line) { this->line = line; show_line = true; }
+    void ClearEpipolarLine() { show_line = false; }
 
-        queue<Vector2i> pts;
+    void SetMarker(Vector2f const& pt) { marker = pt; show_marker = true; }
+    void ClearMarker() { show_marker = false; }
+
+    void operator()(pangolin::View& view) {
+
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_LIGHTING);
 
-        for(auto label : label_data) {
+        view.Activate();
 
-            if(label.size() != 0) {
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
 
-                pts.push(label.back());
+        if(show_bspline && bspline.IsReady()) {
+            Update();
+
+            glPushMatrix();
+            view_transform.MultImageToNDC();
+            glColor3fv(colour_spline);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glVertexPointer(2, GL_FLOAT, 0, curve_pts.data());
+            glDrawArrays(GL_LINE_STRIP, 0, curve_pts.size());
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glPopMatrix();
+        }
 
-                if(pts.size() == 2) {
+        if(show_line) {
+            /* Long enough to cross the whole image from its closest point to the centre */
+            float const reach = view_transform.GetWidth() + view_transform.GetHeight();
+            Vector2f const mid = ClosestOnLine(line, Vector2f(view_transform.GetWidth()/2.0f, view_transform.GetHeight()/2.0f));
+            Vector2f const dir(-line[1], line[0]);
+
+            glColor3fv(colour_epipolar);
+            glBegin(GL_LINES);
+            glVertex(view_transform.ImageToNDC(mid - reach*dir));
+            glVertex(view_transform.ImageToNDC(mid + reach*dir));
+            glEnd();
+        }
 
-                    glColor3fv(colour_tip_traj);
-                    glBegin(GL_LINES);
-                    glVertex(ImageToNDC(Vector2f(pts.front()[0], pts.front()[1])));
-                    glVertex(ImageToNDC(Vector2f(pts.back()[0], pts.back()[1])));
-                    glEnd();
+        if(show_marker) {
+            Vector2f const pt = view_transform.ImageToNDC(marker);
+            glColor3fv(colour_epipolar);
+            glDrawCircle(pt[0], pt[1], 0.008);
+        }
 
-                    pts.pop();
-                }
+        if(show_knot_pts) {
+            for(size_t k = 0; k < bspline.GetNumKnotPts(); ++k) {
+                Vector2f const pt = view_transform.ImageToNDC(Project(proj, bspline.GetKnotPt(k)));
+                glColor3fv((int)k == selected_knot ? colour_selected_knot_pt : colour_knot_pt);
+                glDrawCircle(pt[0], pt[1], (int)k == selected_knot ? 0.008 : 0.005);
             }
         }
 
+        glPopAttrib();
+    }
+
+private:
+
+    void Update()
+    {
+        if(cached_revision == bspline.GetRevision() && cached_zoom == view_transform.GetZoom() && !curve_pts.empty())
+            return;
+
+        /* Pixel scale at the first knot, the depth varies little along a catheter */
+        float const ppu = std::max(1e-6f, PixelsPerUnit(proj, bspline.GetKnotPt(0)));
+
+        sample_pts.clear();
+        bspline.SampleAdaptive(tolerance/(view_transform.GetZoom()*ppu), back_inserter(sample_pts));
+
+        curve_pts.resize(sample_pts.size());
+        for(size_t i = 0; i < sample_pts.size(); ++i)
+            curve_pts[i] = Project(proj, sample_pts[i]);
+
+        cached_revision = bspline.GetRevision();
+        cached_zoom = view_transform.GetZoom();
     }
 
+    ViewTransform2D const& view_transform;
+
+    Bspline<float,3> const& bspline;
+    ProjMatrix const& proj;
+
+    bool show_knot_pts;
+    bool show_bspline;
+    float tolerance;
+    int selected_knot;
+
+    bool show_line;
+    Vector3f line;
+    bool show_marker;
+    Vector2f marker;
+
+    size_t cached_revision;
+    float cached_zoom;
+    vector<Vector3f> sample_pts;
+    vector<Vector2f> curve_pts;
+};
+
+//! @brief Tips of the labelled frames, the tip of the first curve of each
+/*!
+ * Tips are gathered incrementally as frames are labelled, so drawing does
+ * not walk the pixel chains of every labelled frame, and are drawn with a
+ * single call for the points and one for the trajectory.
+ */
+class DrawTip
+{
+public:
+    DrawTip(ViewTransform2D const& view_transform, LabelData const& label_data)
+        : view_transform(view_transform), label_data(label_data), show_tip_pts(false), show_tip_traj(true), num_cached_frames(0)
+    {}
+
+    void ShowTipPts(bool const show) { show_tip_pts = show; }
+    void ShowTipTraj(bool const show) { show_tip_traj = show; }
 
     void operator()(pangolin::View& view) {
 
-        glPushAttrib(GL_ENABLE_BIT);
+        Update();
+        if(tips.empty() || (!show_tip_pts && !show_tip_traj))
+            return;
+
+        glPushAttrib(GL_ENABLE_BIT | GL_POINT_BIT);
         glDisable(GL_DEPTH_TEST);
         glDisable(GL_LIGHTING);
 
@@ -314,25 +792,66 @@ public:
         glLoadIdentity();
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
+        view_transform.MultImageToNDC();
 
-        if(label_data.size() > 0) {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 0, tips.data());
 
-            if(show_tip_pts) DrawTipPts();
-            if(show_tip_traj) DrawTipTraj();
+        if(show_tip_traj) {
+            glColor3fv(colour_tip_traj);
+            glDrawArrays(GL_LINE_STRIP, 0, tips.size());
         }
 
+        if(show_tip_pts) {
+            glPointSize(3);
+            glColor3fv(colour_tip_pts);
+            glDrawArrays(GL_POINTS, 0, tips.size());
+        }
+
+        glDisableClientState(GL_VERTEX_ARRAY);
+
+        glLoadIdentity();
         glPopAttrib();
     }
 
 private:
 
-    size_t w, h;
+    /* Frames are only added or removed at the end; the last one is redone in case it was replaced */
+    void Update()
+    {
+        num_cached_frames = std::min(num_cached_frames, label_data.size());
+        if(num_cached_frames > 0)
+            --num_cached_frames;
+
+        while(!tip_frames.empty() && tip_frames.back() >= num_cached_frames) {
+            tips.pop_back();
+            tip_frames.pop_back();
+        }
+
+        for(; num_cached_frames < label_data.size(); ++num_cached_frames) {
+            if(label_data[num_cached_frames].GetNumCurves() == 0)
+                continue;
+            tips.push_back(Tip(label_data[num_cached_frames]));
+            tip_frames.push_back(num_cached_frames);
+        }
+    }
+
+    static Vector2f Tip(FrameLabel const& frame)
+    {
+        Vector2i const tip = *(frame.CurveEnd(0)-1);
+        return Vector2f(tip[0], tip[1]);
+    }
+
+    ViewTransform2D const& view_transform;
 
     LabelData const& label_data;
 
     bool show_tip_pts;
     bool show_tip_traj;
 
+    size_t num_cached_frames;
+    vector<Vector2f> tips;
+    vector<size_t> tip_frames;
 };
 
 #endif // LABEL_CATHETERE_PANGO_DRAWER
@@ -0,0 +1,283 @@
+#ifndef LABEL_CATHETERE_PANGO_PBO
+#define LABEL_CATHETERE_PANGO_PBO
+
+#include <vector>
+#include <functional>
+
+#include <pangolin/pangolin.h>
+#include <pangolin/gl.h>
+
+using namespace pangolin;
+
+/* Rebuild the mip chain of tex and sample it trilinearly when minified, false without driver support */
+inline bool GenerateMipmaps(GlTexture const& tex)
+{
+    if(!(GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object))
+        return false;
+
+    tex.Bind();
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    tex.Unbind();
+    return true;
+}
+
+//! @brief Double-buffered pixel-unpack buffer streaming into a GlTexture
+/*!
+ * Map() hands out write-only memory of the back buffer on the GL thread; it
+ * may then be filled from any thread (e.g. a decoder) while the render loop
+ * keeps drawing. Upload() unmaps it on the GL thread and sources the texture
+ * from the buffer, so glTexSubImage2D returns without copying client memory.
+ * Falls back to a client-side buffer when PBOs are not supported. With
+ * mipmaps enabled the mip chain is regenerated on the GPU after each upload,
+ * so large frames stay alias-free and cheap to draw when zoomed out.
+ */
+class PboUploader
+{
+public:
+    PboUploader(GlTexture& tex, GLenum data_layout, GLenum data_type, size_t size_bytes)
+        : tex(tex), data_layout(data_layout), data_type(data_type), size_bytes(size_bytes), back(0), mapped(NULL), mipmaps(false)
+    {
+        use_pbo = GLEW_ARB_pixel_buffer_object || GLEW_VERSION_2_1;
+
+        if(use_pbo) {
+            glGenBuffers(2, pbo);
+            for(int i = 0; i < 2; ++i) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, size_bytes, NULL, GL_STREAM_DRAW);
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+
+    ~PboUploader()
+    {
+        Cancel();
+        if(use_pbo)
+            glDeleteBuffers(2, pbo);
+    }
+
+    /* Keep a mip chain of the texture, built at once for the current contents */
+    void SetMipmaps(bool const on)
+    {
+        mipmaps = on && GenerateMipmaps(tex);
+    }
+
+    /* Map the back buffer for writing, must be called on the GL thread */
+    unsigned char* Map()
+    {
+        if(mapped)
+            return mapped;
+
+        if(use_pbo) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[back]);
+            /* Orphan the old storage so mapping never waits on a pending upload */
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size_bytes, NULL, GL_STREAM_DRAW);
+            mapped = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+            if(mapped)
+                return mapped;
+
+            cerr << "Unable to map pixel buffer, falling back to client memory." << endl;
+            use_pbo = false;
+            glDeleteBuffers(2, pbo);
+        }
+
+        client_buf.resize(size_bytes);
+        mapped = client_buf.data();
+        return mapped;
+    }
+
+    /* Unmap the back buffer and update the texture from it, must be called on the GL thread */
+    void Upload()
+    {
+        if(!mapped)
+            return;
+
+        if(use_pbo) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[back]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            tex.Upload(0, data_layout, data_type);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            back = 1 - back;
+        } else {
+            tex.Upload(mapped, data_layout, data_type);
+        }
+
+        if(mipmaps)
+            GenerateMipmaps(tex);
+
+        mapped = NULL;
+    }
+
+    /* Unmap the back buffer without touching the texture */
+    void Cancel()
+    {
+        if(!mapped)
+            return;
+
+        if(use_pbo) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[back]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+
+        mapped = NULL;
+    }
+
+    bool IsMapped() const { return mapped != NULL; }
+    bool UsePbo() const { return use_pbo; }
+    size_t SizeBytes() const { return size_bytes; }
+
+private:
+
+    GlTexture& tex;
+    GLenum data_layout;
+    GLenum data_type;
+    size_t size_bytes;
+
+    bool use_pbo;
+    GLuint pbo[2];
+    int back;
+
+    unsigned char* mapped;
+    std::vector<unsigned char> client_buf;
+
+    bool mipmaps;
+};
+
+//! @brief Ring of pixel-pack buffers reading back viewports without stalling
+/*!
+ * Read() queues glReadPixels into the next buffer of the ring and fences it,
+ * so the readback of frame N overlaps the rendering of frame N+1. Once the
+ * fence has signalled, Poll() maps the buffer and hands the pixels to the
+ * callback given to Read(). Buffers are reused and only reallocated if the
+ * viewport size changes. Falls back to synchronous reads into a reused
+ * client-side buffer when PBOs or sync objects are not supported.
+ */
+class PboReader
+{
+public:
+    typedef std::function<void(unsigned char const* data, Viewport const& viewport)> Callback;
+
+    PboReader(size_t const num_bufs = 3, GLenum data_layout = GL_RGB, GLenum data_type = GL_UNSIGNED_BYTE, size_t const pixel_bytes = 3)
+        : slots(num_bufs), data_layout(data_layout), data_type(data_type), pixel_bytes(pixel_bytes), head(0), num_pending(0)
+    {
+        use_pbo = (GLEW_ARB_pixel_buffer_object || GLEW_VERSION_2_1) && (GLEW_ARB_sync || GLEW_VERSION_3_2);
+
+        if(use_pbo)
+            for(auto& slot : slots)
+                glGenBuffers(1, &slot.pbo);
+    }
+
+    ~PboReader()
+    {
+        Flush();
+        if(use_pbo)
+            for(auto& slot : slots)
+                glDeleteBuffers(1, &slot.pbo);
+    }
+
+    /* Queue a readback of the viewport from the current read buffer */
+    void Read(Viewport const& viewport, Callback const& done)
+    {
+        size_t const size_bytes = viewport.w*viewport.h*pixel_bytes;
+
+        if(!use_pbo) {
+            client_buf.resize(size_bytes);
+            glReadPixels(viewport.l, viewport.b, viewport.w, viewport.h, data_layout, data_type, client_buf.data());
+            done(client_buf.data(), viewport);
+            return;
+        }
+
+        /* The ring is full, wait for the oldest readback */
+        if(num_pending == slots.size())
+            Retire(true);
+
+        Slot& slot = slots[head];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        if(slot.size_bytes != size_bytes) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, size_bytes, NULL, GL_STREAM_READ);
+            slot.size_bytes = size_bytes;
+        }
+        glReadPixels(viewport.l, viewport.b, viewport.w, viewport.h, data_layout, data_type, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.viewport = viewport;
+        slot.done = done;
+
+        head = (head+1)%slots.size();
+        ++num_pending;
+    }
+
+    /* Hand over every finished readback in submission order */
+    void Poll()
+    {
+        while(num_pending > 0 && Retire(false));
+    }
+
+    /* Wait for and hand over all pending readbacks */
+    void Flush()
+    {
+        while(num_pending > 0)
+            Retire(true);
+    }
+
+    size_t NumPending() const { return num_pending; }
+
+private:
+
+    struct Slot
+    {
+        Slot() : pbo(0), size_bytes(0), fence(0) {}
+
+        GLuint pbo;
+        size_t size_bytes;
+        GLsync fence;
+        Viewport viewport;
+        Callback done;
+    };
+
+    bool Retire(bool const wait)
+    {
+        Slot& slot = slots[(head+slots.size()-num_pending)%slots.size()];
+
+        GLuint64 const timeout = wait ? GL_TIMEOUT_IGNORED : 0;
+        GLenum const status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if(status == GL_TIMEOUT_EXPIRED)
+            return false;
+
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        unsigned char const* data = (unsigned char const*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if(data) {
+            slot.done(data, slot.viewport);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            cerr << "Unable to map pixel buffer, readback dropped." << endl;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        slot.done = Callback();
+        --num_pending;
+
+        return true;
+    }
+
+    std::vector<Slot> slots;
+    GLenum data_layout;
+    GLenum data_type;
+    size_t pixel_bytes;
+
+    bool use_pbo;
+    size_t head;
+    size_t num_pending;
+
+    std::vector<unsigned char> client_buf;
+};
+
+#endif // LABEL_CATHETERE_PANGO_PBO
@@ -0,0 +1,113 @@
+#ifndef LABEL_CATHETER_IMAGE_POOL_H
+#define LABEL_CATHETER_IMAGE_POOL_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+//! @brief Pool recycling fixed-size images between frames
+/*!
+ * Acquire() hands out an image of the requested size, reusing a released one
+ * whenever possible, so steady-state paths working on same-sized frames do
+ * not hit the heap. Handles return their image to the pool when destroyed
+ * and may be released from any thread. The pool must outlive its handles.
+ */
+template<typename Image>
+class ImagePool
+{
+public:
+
+    struct Releaser
+    {
+        Releaser(ImagePool* pool = NULL) : pool(pool) {}
+
+        void operator()(Image* img) const
+        {
+            if(pool)
+                pool->Release(img);
+            else
+                delete img;
+        }
+
+        ImagePool* pool;
+    };
+
+    typedef std::unique_ptr<Image, Releaser> Handle;
+
+    explicit ImagePool(size_t const max_free = 8)
+        : max_free(max_free), num_hits(0), num_misses(0)
+    {
+        free_imgs.reserve(max_free);
+    }
+
+    ~ImagePool()
+    {
+        for(auto img : free_imgs)
+            delete img;
+    }
+
+    Handle Acquire(size_t const w, size_t const h)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for(auto itr = free_imgs.begin(); itr != free_imgs.end(); ++itr) {
+                if((size_t)(*itr)->width() == w && (size_t)(*itr)->height() == h) {
+                    Image* img = *itr;
+                    free_imgs.erase(itr);
+                    ++num_hits;
+                    return Handle(img, Releaser(this));
+                }
+            }
+
+            ++num_misses;
+        }
+
+        return Handle(new Image(w, h), Releaser(this));
+    }
+
+    size_t GetNumHits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_hits;
+    }
+
+    size_t GetNumMisses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_misses;
+    }
+
+    size_t GetNumFree() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return free_imgs.size();
+    }
+
+private:
+
+    void Release(Image* img)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(free_imgs.size() < max_free) {
+                free_imgs.push_back(img);
+                return;
+            }
+        }
+
+        delete img;
+    }
+
+    mutable std::mutex mutex;
+
+    /* Released images ready for reuse */
+    std::vector<Image*> free_imgs;
+    size_t max_free;
+
+    size_t num_hits;
+    size_t num_misses;
+
+};
+
+#endif // LABEL_CATHETER_IMAGE_POOL_H
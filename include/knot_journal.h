@@ -0,0 +1,412 @@
+#ifndef LABEL_CATHETER_KNOT_JOURNAL_H
+#define LABEL_CATHETER_KNOT_JOURNAL_H
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <Eigen/Core>
+
+#include "bspline.h"
+#include "label_data.h"
+
+//! @brief Append-only, crash-safe log of the knot edits of the label in progress
+/*!
+ * Every edit is one text line. Knot records apply to the current curve:
+ *
+ *     N c          add an empty curve of class c and make it current
+ *     D            remove the last curve, the current one if it was
+ *     C i          make curve i current
+ *     L c          set the class of the current curve
+ *     T t          make the current curve closed (1) or open (0)
+ *     A x y        append a knot
+ *     I i x y      insert a knot before knot i
+ *     S i x y      move knot i
+ *     B            remove the last knot
+ *     R            remove all knots
+ *     K n x y ...  replace all knots
+ *     E f          frame f was exported
+ *
+ * Recording an edit only appends to an in-memory buffer. A writer thread
+ * commits whatever has accumulated with a single write and fsync, so edits
+ * arriving while a commit is in progress are grouped into the next one, and
+ * the render loop never waits on the disk. Consecutive moves of the same
+ * knot that have not been committed yet are merged, so a drag adds little.
+ * Replay() rebuilds the curves from the file, ignoring a torn last line.
+ * Rewrite() compacts the journal to a single snapshot.
+ */
+class KnotJournal
+{
+public:
+    KnotJournal()
+        : fout(NULL), last_set_idx(-1), last_set_pos(0), is_committing(false), stop(false), failed(false), num_records(0), num_commits(0)
+    {}
+
+    ~KnotJournal()
+    {
+        Close();
+    }
+
+    /* Append to file, creating it if needed */
+    bool Open(std::string const& file)
+    {
+        Close();
+
+        fout = fopen(file.c_str(), "a");
+        if(!fout)
+            return false;
+
+        stop = false;
+        failed = false;
+        writer = std::thread(&KnotJournal::Run, this);
+        return true;
+    }
+
+    /* Commit what is pending and stop the writer */
+    void Close()
+    {
+        if(!fout)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        record_ready.notify_one();
+        writer.join();
+
+        fclose(fout);
+        fout = NULL;
+    }
+
+    bool IsOpen() const { return fout != NULL; }
+
+    void AddCurve(int const class_id)
+    {
+        std::ostringstream oss;
+        oss << "N " << class_id << "\n";
+        Append(oss.str());
+    }
+
+    void RemoveLastCurve() { Append("D\n"); }
+
+    void SelectCurve(size_t const curve_idx)
+    {
+        std::ostringstream oss;
+        oss << "C " << curve_idx << "\n";
+        Append(oss.str());
+    }
+
+    void SetClass(int const class_id)
+    {
+        std::ostringstream oss;
+        oss << "L " << class_id << "\n";
+        Append(oss.str());
+    }
+
+    void SetClosed(bool const closed) { Append(closed ? "T 1\n" : "T 0\n"); }
+
+    void AddBack(Eigen::Vector2f const& pt)
+    {
+        std::ostringstream oss;
+        oss << "A " << pt[0] << " " << pt[1] << "\n";
+        Append(oss.str());
+    }
+
+    void Insert(size_t const knot_idx, Eigen::Vector2f const& pt)
+    {
+        std::ostringstream oss;
+        oss << "I " << knot_idx << " " << pt[0] << " " << pt[1] << "\n";
+        Append(oss.str());
+    }
+
+    void Set(size_t const knot_idx, Eigen::Vector2f const& pt)
+    {
+        std::ostringstream oss;
+        oss << "S " << knot_idx << " " << pt[0] << " " << pt[1] << "\n";
+        Append(oss.str(), knot_idx);
+    }
+
+    void RemoveBack() { Append("B\n"); }
+
+    void Reset() { Append("R\n"); }
+
+    template<typename Derived>
+    void Assign(Eigen::MatrixBase<Derived> const& pts)
+    {
+        Append(SnapshotRecord(pts));
+    }
+
+    void Export(size_t const frame_idx)
+    {
+        std::ostringstream oss;
+        oss << "E " << frame_idx << "\n";
+        Append(oss.str());
+    }
+
+    /* Block until every record so far has been committed, false if a commit failed */
+    bool Flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        committed.wait(lock, [this]() { return !fout || (pending.empty() && !is_committing); });
+        return !failed;
+    }
+
+    size_t GetNumRecords() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_records;
+    }
+
+    size_t GetNumCommits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_commits;
+    }
+
+    //! @brief Apply the edits of a journal file to curves, returns the number of records applied
+    /*!
+     * curves starts with a single empty curve of class 1 when it is empty.
+     * current_curve receives the curve made current last, last_export the
+     * frame of the last E record or -1. Replay stops at the first line that
+     * cannot be parsed, e.g. one torn by a crash.
+     */
+    static size_t Replay(std::string const& file, std::deque<LabelCurve>& curves, size_t* current_curve = NULL, int* last_export = NULL)
+    {
+        if(curves.empty())
+            curves.push_back(LabelCurve());
+        size_t cur = 0;
+
+        if(current_curve)
+            *current_curve = 0;
+        if(last_export)
+            *last_export = -1;
+
+        std::ifstream in(file.c_str());
+        if(!in)
+            return 0;
+
+        size_t num_applied = 0;
+        std::string line;
+        while(std::getline(in, line)) {
+            /* Only complete lines were committed */
+            if(in.eof())
+                break;
+
+            std::istringstream iss(line);
+            char op;
+            if(!(iss >> op))
+                break;
+
+            Bspline<float,2>& bspline = curves[cur].bspline;
+            size_t idx;
+            int class_id;
+            Eigen::Vector2f pt;
+            bool ok = true;
+            switch(op) {
+            case 'N':
+                ok = bool(iss >> class_id);
+                if(ok) {
+                    curves.push_back(LabelCurve(class_id));
+                    cur = curves.size() - 1;
+                }
+                break;
+            case 'D':
+                ok = curves.size() > 1;
+                if(ok) {
+                    curves.pop_back();
+                    cur = std::min(cur, curves.size() - 1);
+                }
+                break;
+            case 'C':
+                ok = iss >> idx && idx < curves.size();
+                if(ok) cur = idx;
+                break;
+            case 'L':
+                ok = bool(iss >> class_id);
+                if(ok) curves[cur].class_id = class_id;
+                break;
+            case 'T':
+                ok = bool(iss >> idx);
+                if(ok) bspline.SetBsplineType(idx ? Bspline<float,2>::CLOSED : Bspline<float,2>::OPEN);
+                break;
+            case 'A':
+                ok = bool(iss >> pt[0] >> pt[1]);
+                if(ok) bspline.AddBackKnotPt(pt);
+                break;
+            case 'I':
+                ok = iss >> idx >> pt[0] >> pt[1] && idx <= bspline.GetNumKnotPts();
+                if(ok) bspline.InsertKnotPt(idx, pt);
+                break;
+            case 'S':
+                ok = iss >> idx >> pt[0] >> pt[1] && idx < bspline.GetNumKnotPts();
+                if(ok) bspline.SetKnotPt(idx, pt);
+                break;
+            case 'B':
+                bspline.RemoveBackKnotPt();
+                break;
+            case 'R':
+                bspline.Reset();
+                break;
+            case 'K': {
+                size_t n;
+                ok = bool(iss >> n);
+                Eigen::Matrix<float,2,Eigen::Dynamic> pts(2, ok ? n : 0);
+                for(size_t k = 0; ok && k < n; ++k)
+                    ok = bool(iss >> pts(0, k) >> pts(1, k));
+                if(ok) {
+                    bspline.Reset();
+                    if(n > 0)
+                        bspline.AddBackKnotPts(pts);
+                }
+                break;
+            }
+            case 'E':
+                ok = bool(iss >> idx);
+                if(ok && last_export) *last_export = idx;
+                break;
+            default:
+                ok = false;
+            }
+
+            if(!ok)
+                break;
+            ++num_applied;
+        }
+
+        if(current_curve)
+            *current_curve = cur;
+        return num_applied;
+    }
+
+    //! @brief Replace file with a single snapshot of curves and keep appending to it
+    /*!
+     * The snapshot is written to a temporary file, synced and renamed over
+     * the journal, so a crash leaves either the old or the new journal.
+     */
+    bool Rewrite(std::string const& file, std::deque<LabelCurve> const& curves, size_t const current_curve)
+    {
+        Close();
+
+        std::string const tmp_file = file + ".tmp";
+        FILE* tmp = fopen(tmp_file.c_str(), "w");
+        if(!tmp)
+            return false;
+
+        /* Replay starts from one open curve of class 1 */
+        std::ostringstream oss;
+        for(size_t c = 0; c < curves.size(); ++c) {
+            if(c > 0)
+                oss << "N " << curves[c].class_id << "\n";
+            else if(curves[c].class_id != 1)
+                oss << "L " << curves[c].class_id << "\n";
+            if(curves[c].bspline.type == Bspline<float,2>::CLOSED)
+                oss << "T 1\n";
+            oss << SnapshotRecord(curves[c].bspline.GetKnotPts());
+        }
+        oss << "C " << current_curve << "\n";
+
+        std::string const snapshot = oss.str();
+        bool const ok = fwrite(snapshot.data(), 1, snapshot.size(), tmp) == snapshot.size() && fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+        if(fclose(tmp) != 0 || !ok || std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+            std::remove(tmp_file.c_str());
+            return false;
+        }
+
+        return Open(file);
+    }
+
+private:
+
+    template<typename Derived>
+    static std::string SnapshotRecord(Eigen::MatrixBase<Derived> const& pts)
+    {
+        std::ostringstream oss;
+        oss << "K " << pts.cols();
+        for(Eigen::Index k = 0; k < pts.cols(); ++k)
+            oss << " " << pts(0, k) << " " << pts(1, k);
+        oss << "\n";
+        return oss.str();
+    }
+
+    /* set_idx >= 0 marks a knot move, which replaces a pending move of the same knot */
+    void Append(std::string const& record, int const set_idx = -1)
+    {
+        if(!fout)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(set_idx >= 0 && set_idx == last_set_idx) {
+                pending.resize(last_set_pos);
+            } else {
+                ++num_records;
+            }
+
+            last_set_idx = set_idx;
+            last_set_pos = pending.size();
+            pending += record;
+        }
+        record_ready.notify_one();
+    }
+
+    /* Group commit: everything pending goes out in one write and fsync */
+    void Run()
+    {
+        std::string batch;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+            record_ready.wait(lock, [this]() { return stop || !pending.empty(); });
+            if(pending.empty())
+                break;
+
+            batch.swap(pending);
+            pending.clear();
+            last_set_idx = -1;
+            is_committing = true;
+
+            lock.unlock();
+            bool const ok = fwrite(batch.data(), 1, batch.size(), fout) == batch.size() && fflush(fout) == 0 && fsync(fileno(fout)) == 0;
+            lock.lock();
+
+            if(!ok && !failed)
+                std::cerr << "Unable to commit the knot journal" << std::endl;
+            failed = failed || !ok;
+            is_committing = false;
+            ++num_commits;
+            committed.notify_all();
+        }
+
+        committed.notify_all();
+    }
+
+    FILE* fout;
+    std::thread writer;
+
+    mutable std::mutex mutex;
+    std::condition_variable record_ready;
+    std::condition_variable committed;
+
+    std::string pending;
+    int last_set_idx;
+    size_t last_set_pos;
+
+    bool is_committing;
+    bool stop;
+    bool failed;
+
+    size_t num_records;
+    size_t num_commits;
+};
+
+#endif // LABEL_CATHETER_KNOT_JOURNAL_H
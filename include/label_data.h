@@ -0,0 +1,427 @@
+#ifndef LABEL_CATHETER_LABEL_DATA_H
+#define LABEL_CATHETER_LABEL_DATA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <Eigen/Core>
+
+#include "bspline.h"
+#include "csv.h"
+
+/* Pixel chain of one curve, base first and tip last */
+typedef list<Vector2i> Pts;
+
+//! @brief All labelled curves of one frame, each with a class id
+/*!
+ * The pixel chains of all curves are stored back to back in one array and
+ * a curve is a range of it, so a frame holds three allocations however
+ * many curves it has. Class ids start at 1, 0 is the mask background.
+ */
+class FrameLabel
+{
+public:
+    FrameLabel()
+        : offsets(1, 0)
+    {}
+
+    /* A frame with a single curve */
+    template<typename InputIt>
+    FrameLabel(InputIt first, InputIt last, int const class_id = 1)
+        : offsets(1, 0)
+    {
+        AddCurve(class_id, first, last);
+    }
+
+    template<typename InputIt>
+    void AddCurve(int const class_id, InputIt first, InputIt last)
+    {
+        pts.insert(pts.end(), first, last);
+        offsets.push_back(pts.size());
+        class_ids.push_back(class_id);
+    }
+
+    void Clear()
+    {
+        pts.clear();
+        offsets.resize(1);
+        class_ids.clear();
+    }
+
+    size_t GetNumCurves() const { return class_ids.size(); }
+    size_t GetNumPts() const { return pts.size(); }
+
+    int GetClassId(size_t const curve_idx) const { return class_ids[curve_idx]; }
+
+    Vector2i const* CurveBegin(size_t const curve_idx) const { return pts.data() + offsets[curve_idx]; }
+    Vector2i const* CurveEnd(size_t const curve_idx) const { return pts.data() + offsets[curve_idx+1]; }
+
+    /* Points of all curves back to back */
+    vector<Vector2i> const& GetPts() const { return pts; }
+
+private:
+    vector<Vector2i> pts;
+    vector<size_t> offsets;
+    vector<int> class_ids;
+};
+
+typedef vector<FrameLabel> LabelData;
+
+//! @brief Curve of the label in progress and its class id
+struct LabelCurve
+{
+    explicit LabelCurve(int const class_id = 1)
+        : class_id(class_id)
+    {}
+
+    int class_id;
+    Bspline<float,2> bspline;
+};
+
+//! @brief Sorted frame_XXXXX.png file names of an image directory
+/*!
+ * Throws boost::filesystem::filesystem_error if dir cannot be listed.
+ */
+inline vector<string> FindFrameFiles(string const& dir)
+{
+    vector<string> img_files;
+
+    boost::filesystem::directory_iterator end_itr;
+    for(boost::filesystem::directory_iterator itr(dir); itr != end_itr; ++itr)
+        if(boost::filesystem::is_regular_file(itr->path()))
+            if(itr->path().extension() == ".png" && itr->path().string().find("frame") != string::npos)
+                img_files.push_back(itr->path().filename().string());
+
+    /* Directory order is unspecified, label.csv rows follow the frame order */
+    sort(img_files.begin(), img_files.end());
+
+    return img_files;
+}
+
+//! @brief Parse "x0 y0 x1 y1 ..." into Vector2i, stops at the first incomplete pair
+template<typename OutputIt>
+OutputIt ParsePts(char const* str, OutputIt out)
+{
+    char* end;
+    while(true) {
+        long const x = strtol(str, &end, 10);
+        if(end == str)
+            break;
+        str = end;
+
+        long const y = strtol(str, &end, 10);
+        if(end == str)
+            break;
+        str = end;
+
+        *out++ = Vector2i(x, y);
+    }
+
+    return out;
+}
+
+//! @brief Call f(frame_idx, class_id, pts) for every row of label.csv, returns the number of frames
+/*!
+ * A frame has a row per curve, or a single row without points when it has
+ * none. Files written before class ids were stored have one row per frame
+ * and every curve gets class 1. pts is a std::vector<Vector2i> reused
+ * between rows, so parsing a whole file allocates only as much as its
+ * longest row. has_class_id_column, when given, receives whether the file has
+ * the class_id column.
+ */
+template<typename F>
+size_t ForEachCSVRow(string const& csv_file, F f, bool* has_class_id_column = NULL)
+{
+    if(has_class_id_column)
+        *has_class_id_column = false;
+
+    if(!boost::filesystem::exists(csv_file))
+        return 0;
+
+    io::CSVReader<3> in(csv_file);
+    in.read_header(io::ignore_extra_column | io::ignore_missing_column, "frame_idx", "body_xy", "class_id");
+    bool const has_class_id = in.has_column("class_id");
+    if(has_class_id_column)
+        *has_class_id_column = has_class_id;
+
+    char* frame_idx_str;
+    char* body_xy;
+    char* class_id_str = NULL;
+    vector<Vector2i> pts;
+    size_t num_frames = 0;
+    while(in.read_row(frame_idx_str, body_xy, class_id_str)) {
+        char* end;
+        long const frame_idx = strtol(frame_idx_str, &end, 10);
+        if(end == frame_idx_str || frame_idx < 0)
+            continue;
+
+        long class_id = has_class_id ? strtol(class_id_str, &end, 10) : 1;
+        if(has_class_id && end == class_id_str)
+            class_id = 1;
+
+        pts.clear();
+        ParsePts(body_xy, back_inserter(pts));
+        f(size_t(frame_idx), int(class_id), static_cast<vector<Vector2i> const&>(pts));
+        num_frames = max(num_frames, size_t(frame_idx) + 1);
+    }
+
+    return num_frames;
+}
+
+//! @brief Call f(frame_idx, frame) once per frame of label.csv with all its curves, returns the number of frames
+/*!
+ * Rows of a frame are consecutive. frame is reused between frames.
+ */
+template<typename F>
+size_t ForEachCSVFrame(string const& csv_file, F f, bool* has_class_id_column = NULL)
+{
+    FrameLabel frame;
+    long cur_frame_idx = -1;
+
+    size_t const num_frames = ForEachCSVRow(csv_file, [&](size_t const frame_idx, int const class_id, vector<Vector2i> const& pts) {
+        if((long)frame_idx != cur_frame_idx) {
+            if(cur_frame_idx >= 0)
+                f(size_t(cur_frame_idx), static_cast<FrameLabel const&>(frame));
+            frame.Clear();
+            cur_frame_idx = frame_idx;
+        }
+        if(!pts.empty())
+            frame.AddCurve(class_id, pts.begin(), pts.end());
+    }, has_class_id_column);
+
+    if(cur_frame_idx >= 0)
+        f(size_t(cur_frame_idx), static_cast<FrameLabel const&>(frame));
+
+    return num_frames;
+}
+
+/* Read the curves of every labelled frame from label.csv, frames without a row are empty */
+inline LabelData ParseCSVFile(string const& csv_file, bool* has_class_id_column = NULL)
+{
+    LabelData label_data;
+    ForEachCSVFrame(csv_file, [&label_data](size_t const frame_idx, FrameLabel const& frame) {
+        if(frame_idx >= label_data.size())
+            label_data.resize(frame_idx + 1);
+        label_data[frame_idx] = frame;
+    }, has_class_id_column);
+
+    return label_data;
+}
+
+//! @brief Output iterator turning curve samples into a connected pixel chain
+/*!
+ * Samples are rounded to the nearest pixel, whose centre is at integer
+ * coordinates as on screen; repeated pixels are dropped and pixel gaps
+ * between consecutive samples are filled with a straight line.
+ */
+template<typename OutputIt>
+class PixelChainWriter
+{
+public:
+    explicit PixelChainWriter(OutputIt out)
+        : out(out), empty(true)
+    {}
+
+    PixelChainWriter& operator*() { return *this; }
+    PixelChainWriter& operator++() { return *this; }
+    PixelChainWriter& operator++(int) { return *this; }
+
+    template<typename Derived>
+    PixelChainWriter& operator=(MatrixBase<Derived> const& pt)
+    {
+        Vector2i int_pt(int(floor(pt[0] + 0.5f)), int(floor(pt[1] + 0.5f)));
+
+        if(empty) {
+            *out++ = last_pt = int_pt;
+            empty = false;
+        } else if(last_pt == int_pt) {
+            return *this;
+        } else if(abs(int_pt[0] - last_pt[0]) <= 1 && abs(int_pt[1] - last_pt[1]) <= 1) {
+            /* Neighbouring pixel, the common case at sub-pixel sample spacing */
+            *out++ = last_pt = int_pt;
+        } else {
+            int x0 = last_pt[0];
+            int y0 = last_pt[1];
+            int x1 = int_pt[0];
+            int y1 = int_pt[1];
+
+            int d_x = x1 - x0;
+            int d_y = y1 - y0;
+
+            /* Step along the major axis only, so the line never doubles back */
+            if(abs(d_x) >= abs(d_y)) {
+                for(int i = 1; i <= abs(d_x); ++i) {
+                    int inter_x = x0 + (d_x < 0 ? -i : i);
+                    int inter_y = y0 + round(d_y*(float(inter_x-x0)/float(d_x)));
+                    *out++ = last_pt = Vector2i(inter_x, inter_y);
+                }
+            } else {
+                for(int i = 1; i <= abs(d_y); ++i) {
+                    int inter_y = y0 + (d_y < 0 ? -i : i);
+                    int inter_x = x0 + round(d_x*(float(inter_y-y0)/float(d_y)));
+                    *out++ = last_pt = Vector2i(inter_x, inter_y);
+                }
+            }
+        }
+
+        return *this;
+    }
+
+    OutputIt Base() const { return out; }
+
+private:
+    OutputIt out;
+
+    bool empty;
+    Vector2i last_pt;
+};
+
+//! @brief Write the connected pixel chain along the B-spline, returns the end of the output
+/*!
+ * By default the curve is sampled at sub-pixel arc-length spacing, so every
+ * sample moves at most one pixel. With a tolerance (in pixels) the curve is
+ * instead split adaptively into chords within tolerance of it and the
+ * chords are rasterised as lines, which needs far fewer curve evaluations
+ * on straight sections. The chain is not clipped to the frame: knots
+ * placed or tracked near the border can take it outside, and it is kept
+ * whole (connected) in label.csv and the .lcm masks, while the writers of
+ * mask pixels skip the pixels outside.
+ */
+template<int max_pts, typename OutputIt>
+OutputIt RasterisePts(Bspline<float,2,max_pts> const& bspline, OutputIt out, float const tolerance = 0)
+{
+    if(!bspline.IsReady())
+        return out;
+
+    if(tolerance > 0)
+        return bspline.SampleAdaptive(tolerance, PixelChainWriter<OutputIt>(out)).Base();
+
+    return bspline.SampleUniform(0.9f, PixelChainWriter<OutputIt>(out)).Base();
+}
+
+/* Connected pixel chain along the B-spline */
+inline list<Vector2i> GetContinuousPts(Bspline<float,2> const& bspline, float const tolerance = 0)
+{
+    list<Vector2i> continuous_pts;
+    RasterisePts(bspline, back_inserter(continuous_pts), tolerance);
+    return continuous_pts;
+}
+
+//! @brief Write one label.csv row from a bidirectional range of Vector2i, base first
+template<typename BidirIt>
+void WriteCSVRow(FILE* fout, size_t const frame_idx, BidirIt first, BidirIt last, int const class_id = 1)
+{
+    fprintf(fout, "%d", (int)frame_idx); // Frame idx
+
+    if(first != last) {
+
+        Vector2i const tip = *std::prev(last);
+        Vector2i const base = *first;
+        fprintf(fout, ",\t%d %d", tip[0], tip[1]); // Tip point
+        fprintf(fout, ",\t%d %d", base[0], base[1]); // Base point
+
+        fprintf(fout, ",\t%d", (int)std::distance(first, last)); // Num of body points
+
+        fprintf(fout, ",\t"); // Body point
+        for(; first != last; ++first)
+            fprintf(fout, "%d %d ", (*first)[0], (*first)[1]);
+
+        fprintf(fout, ",\t%d", class_id); // Class id
+
+        fprintf(fout, "\n");
+    } else {
+
+        fprintf(fout, ",\t"); // Tip point
+        fprintf(fout, ",\t"); // Base point
+
+        fprintf(fout, ",\t"); // Num of body points
+
+        fprintf(fout, ",\t"); // Body point
+
+        fprintf(fout, ",\t"); // Class id
+
+        fprintf(fout, "\n");
+
+    }
+}
+
+/* A row per curve, or one empty row for a frame without curves */
+inline void WriteCSVFrame(FILE* fout, size_t const frame_idx, FrameLabel const& frame)
+{
+    if(frame.GetNumCurves() == 0)
+        WriteCSVRow(fout, frame_idx, (Vector2i const*)NULL, (Vector2i const*)NULL);
+
+    for(size_t c = 0; c < frame.GetNumCurves(); ++c)
+        WriteCSVRow(fout, frame_idx, frame.CurveBegin(c), frame.CurveEnd(c), frame.GetClassId(c));
+}
+
+inline void WriteCSVHeader(FILE* fout)
+{
+    fprintf(fout, "frame_idx,\ttip_xy,\tbase_xy,\tnum_body_pt,\tbody_xy,\tclass_id\n");
+}
+
+//! @brief Overwrite label.csv with a range of FrameLabel
+/*!
+ * The rows are written to a temporary file, synced and renamed over
+ * csv_file, so a crash or a full disk leaves either the old or the new file.
+ */
+template<typename FrameIt>
+bool WriteCSVFile(string const& csv_file, FrameIt first, FrameIt last)
+{
+    string const tmp_file = csv_file + ".tmp";
+    FILE* fout = fopen(tmp_file.c_str(), "w");
+    if(!fout)
+        return false;
+
+    WriteCSVHeader(fout);
+    for(size_t frame_idx = 0; first != last; ++first, ++frame_idx)
+        WriteCSVFrame(fout, frame_idx, *first);
+
+    bool const ok = !ferror(fout) && fflush(fout) == 0 && fsync(fileno(fout)) == 0;
+    if(fclose(fout) != 0 || !ok || std::rename(tmp_file.c_str(), csv_file.c_str()) != 0) {
+        std::remove(tmp_file.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/* Overwrite label.csv with all label data */
+inline bool WriteCSVFile(string const& csv_file, LabelData const& label_data)
+{
+    return WriteCSVFile(csv_file, label_data.begin(), label_data.end());
+}
+
+//! @brief Append the rows of one frame to label.csv, creating it with a header if needed
+/*!
+ * The cost of an export does not grow with the number of frames already
+ * labelled. The file must already be in the current format, with the
+ * class_id column; rewrite older files once with WriteCSVFile().
+ */
+inline bool AppendCSVFrame(string const& csv_file, size_t const frame_idx, FrameLabel const& frame)
+{
+    FILE* fout = fopen(csv_file.c_str(), "a");
+    if(!fout)
+        return false;
+
+    fseek(fout, 0, SEEK_END);
+    if(ftell(fout) == 0)
+        WriteCSVHeader(fout);
+    WriteCSVFrame(fout, frame_idx, frame);
+
+    return fclose(fout) == 0;
+}
+
+#endif // LABEL_CATHETER_LABEL_DATA_H
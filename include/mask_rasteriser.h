@@ -0,0 +1,150 @@
+#ifndef LABEL_CATHETER_MASK_RASTERISER_H
+#define LABEL_CATHETER_MASK_RASTERISER_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include <boost/gil/gil_all.hpp>
+#include <Eigen/Core>
+
+#include "bspline.h"
+
+//! @brief Thick, anti-aliased or distance-graded masks straight from a B-spline
+/*!
+ * Pixels within radius of the curve get the full value, which then falls
+ * off linearly to 0 over falloff pixels: falloff 0 gives a hard tube of
+ * the catheter width, falloff 1 anti-aliased edges, and radius 0 with a
+ * large falloff a distance-graded (soft) mask. Pixel (x, y) has its centre
+ * at (x, y), as on screen and for the rounded pixel chain of label.csv, so
+ * the tube is centred on the same pixels.
+ *
+ * The curve is approximated by an adaptive polyline, cut into pieces no
+ * longer than the reach (radius + falloff), and only the pixels of each
+ * piece's box are visited. The cost is O(curve length x width) and does not
+ * depend on the image size. Distance to the piece is squared and turned
+ * into a value by a precomputed table, so no square root is taken per pixel.
+ * Values are combined with max, so overlapping pieces and curves never darken each
+ * other and the mask is not cleared.
+ */
+class MaskRasteriser
+{
+public:
+    MaskRasteriser()
+        : radius(0.5), falloff(0), tolerance(0.1)
+    {}
+
+    /* Tube diameter in pixels, the catheter width */
+    void SetWidth(float const width) { radius = std::max(0.0f, 0.5f*width); }
+    /* Distance in pixels over which values fade out beyond the tube */
+    void SetFalloff(float const falloff) { this->falloff = std::max(0.0f, falloff); }
+    /* Largest distance of the polyline from the curve in pixels */
+    void SetTolerance(float const tolerance) { this->tolerance = std::max(0.01f, tolerance); }
+
+    float GetReach() const { return radius + falloff; }
+
+    //! @brief Draw the curve into mask with value at its centre, returns the number of pixels visited
+    template<int max_pts>
+    size_t Rasterise(Bspline<float,2,max_pts> const& bspline, boost::gil::gray8_view_t const& mask, unsigned char const value = 255)
+    {
+        if(!bspline.IsReady())
+            return 0;
+
+        poly_pts.clear();
+        bspline.SampleAdaptive(tolerance, std::back_inserter(poly_pts));
+
+        return Rasterise(poly_pts.begin(), poly_pts.end(), mask, value);
+    }
+
+    //! @brief Draw a polyline of Vector2f in image coordinates
+    template<typename InputIt>
+    size_t Rasterise(InputIt first, InputIt last, boost::gil::gray8_view_t const& mask, unsigned char const value = 255)
+    {
+        if(first == last)
+            return 0;
+
+        float const reach = std::max(0.5f, GetReach());
+        float const max_piece = std::max(1.0f, reach);
+        UpdateProfile(reach, value);
+
+        size_t num_visited = 0;
+        Eigen::Vector2f a = *first;
+        num_visited += DrawPiece(a, a, reach, mask);
+
+        for(++first; first != last; ++first) {
+            Eigen::Vector2f const b = *first;
+            int const num_pieces = std::max(1, int(ceil((b - a).norm()/max_piece)));
+            for(int i = 0; i < num_pieces; ++i)
+                num_visited += DrawPiece(a + (b - a)*(float(i)/num_pieces), a + (b - a)*(float(i+1)/num_pieces), reach, mask);
+            a = b;
+        }
+
+        return num_visited;
+    }
+
+private:
+
+    enum { profile_size = 1024 };
+
+    /* Value per squared distance bin, the last bin is outside the reach */
+    void UpdateProfile(float const reach, unsigned char const value)
+    {
+        profile_scale = (profile_size - 1)/(reach*reach);
+        profile.resize(profile_size);
+
+        for(int i = 0; i < profile_size - 1; ++i) {
+            float const d = sqrt(i/profile_scale);
+            float const weight = falloff > 0 ? std::max(0.0f, std::min(1.0f, (radius + falloff - d)/falloff)) : (d <= radius ? 1.0f : 0.0f);
+            profile[i] = (unsigned char)(value*weight + 0.5f);
+        }
+        profile[profile_size - 1] = 0;
+    }
+
+    /* Max of the profile of the distance to segment ab over the box around it */
+    size_t DrawPiece(Eigen::Vector2f const& a, Eigen::Vector2f const& b, float const reach, boost::gil::gray8_view_t const& mask) const
+    {
+        int const x0 = std::max(0, int(floor(std::min(a[0], b[0]) - reach)));
+        int const x1 = std::min<int>(mask.width() - 1, int(ceil(std::max(a[0], b[0]) + reach)));
+        int const y0 = std::max(0, int(floor(std::min(a[1], b[1]) - reach)));
+        int const y1 = std::min<int>(mask.height() - 1, int(ceil(std::max(a[1], b[1]) + reach)));
+        if(x0 > x1 || y0 > y1)
+            return 0;
+
+        float const dx = b[0] - a[0];
+        float const dy = b[1] - a[1];
+        float const len2 = dx*dx + dy*dy;
+        float const inv_len2 = len2 > 1e-6f ? 1/len2 : 0;
+        float const scale = profile_scale;
+        int const last_bin = profile_size - 1;
+        unsigned char const* lut = profile.data();
+
+        for(int y = y0; y <= y1; ++y) {
+            boost::gil::gray8_view_t::x_iterator row = mask.row_begin(y);
+            float const py = y - a[1];
+
+            for(int x = x0; x <= x1; ++x) {
+                float const px = x - a[0];
+                float const t = std::max(0.0f, std::min(1.0f, (px*dx + py*dy)*inv_len2));
+                float const ex = px - t*dx;
+                float const ey = py - t*dy;
+                unsigned char const v = lut[std::min(last_bin, int((ex*ex + ey*ey)*scale))];
+                if(v > row[x])
+                    row[x] = v;
+            }
+        }
+
+        return size_t(x1 - x0 + 1)*(y1 - y0 + 1);
+    }
+
+    float radius;
+    float falloff;
+    float tolerance;
+
+    float profile_scale;
+    std::vector<unsigned char> profile;
+    std::vector<Eigen::Vector2f> poly_pts;
+};
+
+#endif // LABEL_CATHETER_MASK_RASTERISER_H
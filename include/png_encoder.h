@@ -0,0 +1,358 @@
+#ifndef LABEL_CATHETER_PNG_ENCODER_H
+#define LABEL_CATHETER_PNG_ENCODER_H
+
+#include <stdio.h>
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <png.h>
+#include <zlib.h>
+
+#include <boost/gil/gil_all.hpp>
+
+#include "stage_timer.h"
+
+//! @brief zlib and libpng settings used to encode a PNG
+struct PngParams
+{
+    PngParams(int const level = Z_DEFAULT_COMPRESSION, int const strategy = Z_DEFAULT_STRATEGY, int const filters = PNG_ALL_FILTERS)
+        : level(level), strategy(strategy), filters(filters)
+    {}
+
+    /* Binary masks are long runs of zeros, run-length matching beats filtering */
+    static PngParams Mask() { return PngParams(Z_BEST_SPEED, Z_RLE, PNG_FILTER_NONE); }
+
+    /* Fluoroscopy frames are smooth, a single cheap predictor is good enough */
+    static PngParams Frame(int const level = 3) { return PngParams(level, Z_FILTERED, PNG_FILTER_SUB); }
+
+    std::string Name() const
+    {
+        std::ostringstream oss;
+        oss << "level " << level;
+
+        switch(strategy) {
+        case Z_FILTERED: oss << ", filtered"; break;
+        case Z_HUFFMAN_ONLY: oss << ", huffman"; break;
+        case Z_RLE: oss << ", rle"; break;
+        case Z_FIXED: oss << ", fixed"; break;
+        default: oss << ", default"; break;
+        }
+
+        switch(filters) {
+        case PNG_FILTER_NONE: oss << ", none"; break;
+        case PNG_FILTER_SUB: oss << ", sub"; break;
+        case PNG_FILTER_UP: oss << ", up"; break;
+        case PNG_FILTER_AVG: oss << ", avg"; break;
+        case PNG_FILTER_PAETH: oss << ", paeth"; break;
+        case PNG_ALL_FILTERS: oss << ", all"; break;
+        default: oss << ", mixed"; break;
+        }
+
+        return oss.str();
+    }
+
+    int level;
+    int strategy;
+    int filters;
+};
+
+namespace detail {
+
+inline void PngWriteVector(png_structp png, png_bytep data, png_size_t length)
+{
+    std::vector<unsigned char>* out = (std::vector<unsigned char>*)png_get_io_ptr(png);
+    out->insert(out->end(), data, data+length);
+}
+
+inline void PngWriteFile(png_structp png, png_bytep data, png_size_t length)
+{
+    if(fwrite(data, 1, length, (FILE*)png_get_io_ptr(png)) != length)
+        png_error(png, "write failed");
+}
+
+inline void PngFlushFile(png_structp png)
+{
+    fflush((FILE*)png_get_io_ptr(png));
+}
+
+/* Rows are evenly spaced by row_step bytes, which is negative for flipped views */
+inline bool EncodePngRows(png_rw_ptr write_fn, png_flush_ptr flush_fn, void* io,
+                          unsigned char const* row0, std::ptrdiff_t const row_step,
+                          size_t const w, size_t const h, int const channels, int const bit_depth,
+                          PngParams const& params)
+{
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!png)
+        return false;
+
+    png_infop info = png_create_info_struct(png);
+    if(!info) {
+        png_destroy_write_struct(&png, NULL);
+        return false;
+    }
+
+    if(setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    int color_type = PNG_COLOR_TYPE_GRAY;
+    switch(channels) {
+    case 2: color_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+    case 3: color_type = PNG_COLOR_TYPE_RGB; break;
+    case 4: color_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
+    }
+
+    png_set_write_fn(png, io, write_fn, flush_fn);
+    png_set_IHDR(png, info, w, h, bit_depth, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, params.level);
+    png_set_compression_strategy(png, params.strategy);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, params.filters);
+    png_write_info(png, info);
+
+    /* PNG stores 16 bit samples big-endian */
+    if(bit_depth == 16) {
+        unsigned short const endian_test = 1;
+        if(*(unsigned char const*)&endian_test == 1)
+            png_set_swap(png);
+    }
+
+    for(size_t y = 0; y < h; ++y)
+        png_write_row(png, (png_bytep)(row0 + (std::ptrdiff_t)y*row_step));
+
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+
+    return true;
+}
+
+template<typename View>
+bool EncodePngView(png_rw_ptr write_fn, png_flush_ptr flush_fn, void* io, View const& v, PngParams const& params)
+{
+    typedef typename boost::gil::channel_type<View>::type Channel;
+
+    if(v.width() == 0 || v.height() == 0)
+        return false;
+
+    unsigned char const* row0 = (unsigned char const*)&v(0, 0);
+    std::ptrdiff_t const row_step = v.height() > 1 ? (unsigned char const*)&v(0, 1) - row0 : 0;
+
+    return EncodePngRows(write_fn, flush_fn, io, row0, row_step, v.width(), v.height(),
+                         boost::gil::num_channels<View>::value, sizeof(Channel)*8, params);
+}
+
+} // namespace detail
+
+//! @brief Encode an 8 or 16 bit interleaved view into memory
+template<typename View>
+bool EncodePng(View const& v, PngParams const& params, std::vector<unsigned char>& out)
+{
+    out.clear();
+    return detail::EncodePngView(detail::PngWriteVector, NULL, &out, v, params);
+}
+
+//! @brief Encode an 8 or 16 bit interleaved view into a file
+template<typename View>
+bool WritePng(std::string const& file, View const& v, PngParams const& params)
+{
+    FILE* fout = fopen(file.c_str(), "wb");
+    if(!fout)
+        return false;
+
+    bool const ok = detail::EncodePngView(detail::PngWriteFile, detail::PngFlushFile, fout, v, params);
+    return fclose(fout) == 0 && ok;
+}
+
+//! @brief Write a memory buffer to a file
+inline bool WriteBytes(std::string const& file, std::vector<unsigned char> const& bytes)
+{
+    FILE* fout = fopen(file.c_str(), "wb");
+    if(!fout)
+        return false;
+
+    bool const ok = fwrite(bytes.data(), 1, bytes.size(), fout) == bytes.size();
+    return fclose(fout) == 0 && ok;
+}
+
+//! @brief Background PNG encoding threads fed by a bounded job queue
+/*!
+ * Write() takes ownership of the image (e.g. an ImagePool handle), so the
+ * caller can move on immediately; the image is released once written. When
+ * max_pending jobs are queued Write() blocks, bounding the memory held.
+ * Each worker encodes into its own reused buffer before writing the file, so
+ * with a profiler given the "encode" and "fs write" stages are timed apart.
+ */
+class PngEncoder
+{
+public:
+    explicit PngEncoder(size_t num_threads = 0, size_t const max_pending = 8, StageProfiler* profiler = NULL)
+        : max_pending(max_pending), num_running(0), num_written(0), num_failed(0), num_bytes(0), num_bytes_out(0), stop(false)
+    {
+        encode_stats = profiler ? &(*profiler)["encode"] : NULL;
+        write_stats = profiler ? &(*profiler)["fs write"] : NULL;
+
+        if(num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency()/2);
+
+        for(size_t i = 0; i < num_threads; ++i)
+            workers.push_back(std::thread(&PngEncoder::Run, this));
+    }
+
+    ~PngEncoder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        job_ready.notify_all();
+
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    /* Encode and write an owned image in the background */
+    template<typename ImagePtr>
+    void Write(std::string const& file, ImagePtr img, PngParams const& params, bool const flip_y = false)
+    {
+        std::shared_ptr<typename ImagePtr::element_type> shared_img(std::move(img));
+
+        Push([this, file, shared_img, params, flip_y](std::vector<unsigned char>& buf) {
+
+            bool ok;
+            {
+                std::unique_ptr<ScopedTimer> timer(encode_stats ? new ScopedTimer(*encode_stats) : NULL);
+                ok = flip_y ?
+                            EncodePng(boost::gil::flipped_up_down_view(boost::gil::const_view(*shared_img)), params, buf) :
+                            EncodePng(boost::gil::const_view(*shared_img), params, buf);
+            }
+
+            if(ok) {
+                std::unique_ptr<ScopedTimer> timer(write_stats ? new ScopedTimer(*write_stats) : NULL);
+                ok = WriteBytes(file, buf);
+            }
+
+            if(!ok)
+                std::cerr << "Unable to write " << file << std::endl;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if(ok) {
+                ++num_written;
+                num_bytes += shared_img->width()*shared_img->height()*sizeof(typename ImagePtr::element_type::value_type);
+                num_bytes_out += buf.size();
+            } else {
+                ++num_failed;
+            }
+        });
+    }
+
+    /* Block until every queued image has been written */
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [this]() { return jobs.empty() && num_running == 0; });
+    }
+
+    size_t GetNumThreads() const { return workers.size(); }
+
+    size_t GetNumPending() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size() + num_running;
+    }
+
+    size_t GetNumWritten() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_written;
+    }
+
+    size_t GetNumFailed() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_failed;
+    }
+
+    /* Uncompressed bytes encoded so far */
+    size_t GetNumBytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_bytes;
+    }
+
+    /* Compressed bytes written so far */
+    size_t GetNumBytesOut() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_bytes_out;
+    }
+
+private:
+
+    typedef std::function<void(std::vector<unsigned char>&)> Job;
+
+    void Push(Job const& job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [this]() { return jobs.size() < max_pending; });
+        jobs.push_back(job);
+        job_ready.notify_one();
+    }
+
+    void Run()
+    {
+        std::vector<unsigned char> buf;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+
+            job_ready.wait(lock, [this]() { return stop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+
+            Job job = jobs.front();
+            jobs.pop_front();
+            ++num_running;
+
+            lock.unlock();
+            job(buf);
+            /* Release the image before reporting the job as done */
+            job = Job();
+            lock.lock();
+
+            --num_running;
+            job_done.notify_all();
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+
+    std::deque<Job> jobs;
+    std::vector<std::thread> workers;
+
+    size_t max_pending;
+    size_t num_running;
+
+    size_t num_written;
+    size_t num_failed;
+    size_t num_bytes;
+    size_t num_bytes_out;
+
+    StageStats* encode_stats;
+    StageStats* write_stats;
+
+    bool stop;
+};
+
+#endif // LABEL_CATHETER_PNG_ENCODER_H
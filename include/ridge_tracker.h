@@ -0,0 +1,170 @@
+#ifndef LABEL_CATHETER_RIDGE_TRACKER_H
+#define LABEL_CATHETER_RIDGE_TRACKER_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <boost/gil/gil_all.hpp>
+#include <Eigen/Core>
+
+#include "bspline.h"
+
+//! @brief Moves the knots of a carried-forward label onto the catheter of the new frame
+/*!
+ * Each knot searches along the curve normal, within the search radius, for
+ * the strongest thin line: the centre of the profile darker (or brighter) than
+ * both sides at the given line half-width, averaged over a short stretch
+ * along the tangent to suppress noise. Displacement is slightly penalised so
+ * knots stay put on a static wire and do not hop to a neighbouring one, and
+ * knots without enough contrast are left where they were. Knots are
+ * independent and split across threads.
+ */
+class RidgeTracker
+{
+public:
+    explicit RidgeTracker(size_t const num_threads = 0)
+        : num_threads(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())),
+          search_radius(6), half_width(2), min_contrast(6), move_penalty(0.5), dark_ridge(true)
+    {}
+
+    /* Largest knot displacement per frame in pixels */
+    void SetSearchRadius(float const radius) { search_radius = radius; }
+    /* Distance from the line centre to the background it is compared with */
+    void SetHalfWidth(float const width) { half_width = width; }
+    /* Smallest centre to side difference in gray levels for a knot to move */
+    void SetMinContrast(float const contrast) { min_contrast = contrast; }
+    /* Catheters are dark in fluoroscopy, bright in inverted sequences */
+    void SetDarkRidge(bool const dark) { dark_ridge = dark; }
+
+    //! @brief Refine the knots of bspline on img, returns the number of knots moved
+    template<int max_pts>
+    size_t Track(boost::gil::gray8c_view_t const& img, Bspline<float,2,max_pts>& bspline) const
+    {
+        size_t const n = bspline.GetNumKnotPts();
+        if(n < 2 || img.width() == 0 || img.height() == 0)
+            return 0;
+
+        Eigen::Matrix<float,2,Eigen::Dynamic> const knots = bspline.GetKnotPts();
+        Eigen::Matrix<float,2,Eigen::Dynamic> tracked = knots;
+        std::vector<char> moved(n, 0);
+
+        /* A handful of knots is not worth a thread */
+        size_t const num_tasks = std::min(num_threads, (n + min_knots_per_task - 1)/min_knots_per_task);
+        size_t const chunk = (n + num_tasks - 1)/num_tasks;
+
+        std::vector<std::future<void> > tasks;
+        for(size_t first = chunk; first < n; first += chunk)
+            tasks.push_back(std::async(std::launch::async, [&, first]() { TrackRange(img, knots, first, std::min(n, first+chunk), tracked, moved); }));
+        TrackRange(img, knots, 0, std::min(n, chunk), tracked, moved);
+
+        for(auto& task : tasks)
+            task.get();
+
+        size_t const num_moved = std::count(moved.begin(), moved.end(), 1);
+        if(num_moved > 0)
+            bspline.AddBackKnotPts(tracked);
+
+        return num_moved;
+    }
+
+private:
+
+    enum { min_knots_per_task = 16, tangent_samples = 2 };
+
+    void TrackRange(boost::gil::gray8c_view_t const& img, Eigen::Matrix<float,2,Eigen::Dynamic> const& knots,
+                    size_t const first, size_t const last, Eigen::Matrix<float,2,Eigen::Dynamic>& tracked, std::vector<char>& moved) const
+    {
+        size_t const n = knots.cols();
+
+        for(size_t k = first; k < last; ++k) {
+
+            /* Tangent from the neighbouring knots */
+            Eigen::Vector2f tangent = knots.col(std::min(k+1, n-1)) - knots.col(k > 0 ? k-1 : 0);
+            if(tangent.norm() < 1e-3)
+                continue;
+            tangent.normalize();
+            Eigen::Vector2f const normal(-tangent[1], tangent[0]);
+
+            /* Ridge response along the normal at half pixel steps */
+            int const num_steps = std::max(1, int(2*search_radius));
+            std::vector<float> response(2*num_steps+1);
+            for(int i = -num_steps; i <= num_steps; ++i)
+                response[i+num_steps] = Response(img, knots.col(k) + 0.5f*i*normal, normal, tangent);
+
+            int best = num_steps;
+            float best_score = response[num_steps];
+            for(int i = 0; i < (int)response.size(); ++i) {
+                float const score = response[i] - move_penalty*0.5f*abs(i - num_steps);
+                if(score > best_score) {
+                    best_score = score;
+                    best = i;
+                }
+            }
+
+            if(response[best] < min_contrast)
+                continue;
+
+            /* Sub-sample peak from a parabola through the neighbours */
+            float offset = 0;
+            if(best > 0 && best < (int)response.size()-1) {
+                float const denom = response[best-1] - 2*response[best] + response[best+1];
+                if(denom < 0)
+                    offset = std::max(-0.5f, std::min(0.5f, 0.5f*(response[best-1] - response[best+1])/denom));
+            }
+
+            float const s = 0.5f*(best - num_steps + offset);
+            if(fabs(s) < 0.25f)
+                continue;
+
+            tracked.col(k) = knots.col(k) + s*normal;
+            tracked(0, k) = std::max(0.0f, std::min(img.width()-1.0f, tracked(0, k)));
+            tracked(1, k) = std::max(0.0f, std::min(img.height()-1.0f, tracked(1, k)));
+            moved[k] = 1;
+        }
+    }
+
+    /* Side minus centre intensity (or the reverse), averaged along the tangent */
+    float Response(boost::gil::gray8c_view_t const& img, Eigen::Vector2f const& pt, Eigen::Vector2f const& normal, Eigen::Vector2f const& tangent) const
+    {
+        float sum = 0;
+        for(int j = -tangent_samples; j <= tangent_samples; ++j) {
+            Eigen::Vector2f const c = pt + float(j)*tangent;
+            sum += 0.5f*(Sample(img, c - half_width*normal) + Sample(img, c + half_width*normal)) - Sample(img, c);
+        }
+
+        sum /= 2*tangent_samples + 1;
+        return dark_ridge ? sum : -sum;
+    }
+
+    /* Bilinear lookup, clamped to the image */
+    static float Sample(boost::gil::gray8c_view_t const& img, Eigen::Vector2f const& pt)
+    {
+        float const x = std::max(0.0f, std::min(img.width()-1.001f, pt[0]));
+        float const y = std::max(0.0f, std::min(img.height()-1.001f, pt[1]));
+        int const x0 = x;
+        int const y0 = y;
+        float const fx = x - x0;
+        float const fy = y - y0;
+
+        boost::gil::gray8c_view_t::x_iterator r0 = img.row_begin(y0);
+        boost::gil::gray8c_view_t::x_iterator r1 = img.row_begin(std::min<int>(y0+1, img.height()-1));
+        int const x1 = std::min<int>(x0+1, img.width()-1);
+
+        return (1-fy)*((1-fx)*r0[x0] + fx*r0[x1]) + fy*((1-fx)*r1[x0] + fx*r1[x1]);
+    }
+
+    size_t num_threads;
+
+    float search_radius;
+    float half_width;
+    float min_contrast;
+    float move_penalty;
+    bool dark_ridge;
+};
+
+#endif // LABEL_CATHETER_RIDGE_TRACKER_H
@@ -0,0 +1,316 @@
+#ifndef LABEL_CATHETER_SPARSE_MASK_H
+#define LABEL_CATHETER_SPARSE_MASK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+//! @brief Chain-coded label mask, storage and decoding are O(curve length)
+/*!
+ * A mask is a list of pixel chains, each with a pixel value. A chain stores
+ * its first pixel and one 4 bit code per following pixel: codes 0-7 step to
+ * one of the 8 neighbours, code 8 takes an arbitrary (dx, dy) from a side
+ * stream of escapes, which covers gaps and repeated pixels. Chains are
+ * stored as given, including pixels outside the w x h frame, which only
+ * Rasterise() leaves out.
+ *
+ * File layout (.lcm, little-endian):
+ *   "LCSM" u16 version u32 w u32 h u32 num_chains
+ *   per chain: u8 value u32 num_pts i32 x0 i32 y0 u32 num_code_bytes u32 num_escapes
+ *              codes (two per byte, low nibble first) escapes (i16 dx, i16 dy)
+ */
+class SparseMask
+{
+public:
+    SparseMask(size_t const w = 0, size_t const h = 0)
+        : w(w), h(h)
+    {}
+
+    void Clear()
+    {
+        chains.clear();
+        codes.clear();
+        escapes.clear();
+    }
+
+    void Reset(size_t const w, size_t const h)
+    {
+        this->w = w;
+        this->h = h;
+        Clear();
+    }
+
+    /* Append a chain from a range of Vector2i pixels */
+    template<typename InputIt>
+    void AddChain(InputIt first, InputIt last, unsigned char const value = 255)
+    {
+        if(first == last)
+            return;
+
+        Chain chain;
+        chain.value = value;
+        chain.num_pts = 1;
+        chain.x0 = (*first)[0];
+        chain.y0 = (*first)[1];
+        chain.code_begin = codes.size();
+        chain.escape_begin = escapes.size();
+
+        int x = chain.x0;
+        int y = chain.y0;
+        size_t code_idx = 0;
+
+        for(++first; first != last; ++first, ++code_idx, ++chain.num_pts) {
+
+            int const dx = (*first)[0] - x;
+            int const dy = (*first)[1] - y;
+            x += dx;
+            y += dy;
+
+            int code = DirCode(dx, dy);
+            if(code < 0) {
+                code = escape_code;
+                escapes.push_back(dx);
+                escapes.push_back(dy);
+            }
+
+            if(code_idx%2 == 0)
+                codes.push_back(code);
+            else
+                codes.back() |= code << 4;
+        }
+
+        chain.num_code_bytes = codes.size() - chain.code_begin;
+        chain.num_escapes = (escapes.size() - chain.escape_begin)/2;
+        chains.push_back(chain);
+    }
+
+    /* Decode all pixels of a chain as Vector2i */
+    template<typename OutputIt>
+    OutputIt DecodeChain(size_t const chain_idx, OutputIt out) const
+    {
+        Chain const& chain = chains[chain_idx];
+
+        unsigned char const* code = codes.data() + chain.code_begin;
+        int16_t const* escape = escapes.data() + chain.escape_begin;
+
+        int x = chain.x0;
+        int y = chain.y0;
+        *out++ = Eigen::Vector2i(x, y);
+
+        for(size_t i = 0; i + 1 < chain.num_pts; ++i) {
+
+            int const c = (code[i/2] >> (4*(i%2))) & 0xf;
+            if(c == escape_code) {
+                x += escape[0];
+                y += escape[1];
+                escape += 2;
+            } else {
+                x += DirDx(c);
+                y += DirDy(c);
+            }
+
+            *out++ = Eigen::Vector2i(x, y);
+        }
+
+        return out;
+    }
+
+    /* Set the chain pixels of an already cleared view, pixels outside are skipped */
+    template<typename View>
+    void Rasterise(View const& v) const
+    {
+        for(size_t c = 0; c < chains.size(); ++c) {
+            RasteriseIterator<View> itr(v, chains[c].value);
+            DecodeChain(c, itr);
+        }
+    }
+
+    bool Write(std::string const& file) const
+    {
+        FILE* fout = fopen(file.c_str(), "wb");
+        if(!fout)
+            return false;
+
+        std::vector<unsigned char> buf;
+        buf.reserve(header_size + chains.size()*chain_header_size + codes.size() + escapes.size()*2);
+
+        buf.insert(buf.end(), Magic(), Magic()+4);
+        PutU16(buf, version);
+        PutU32(buf, w);
+        PutU32(buf, h);
+        PutU32(buf, chains.size());
+
+        for(auto const& chain : chains) {
+            buf.push_back(chain.value);
+            PutU32(buf, chain.num_pts);
+            PutU32(buf, chain.x0);
+            PutU32(buf, chain.y0);
+            PutU32(buf, chain.num_code_bytes);
+            PutU32(buf, chain.num_escapes);
+            buf.insert(buf.end(), codes.begin()+chain.code_begin, codes.begin()+chain.code_begin+chain.num_code_bytes);
+            for(size_t e = 0; e < 2*chain.num_escapes; ++e)
+                PutU16(buf, escapes[chain.escape_begin+e]);
+        }
+
+        bool const ok = fwrite(buf.data(), 1, buf.size(), fout) == buf.size();
+        return fclose(fout) == 0 && ok;
+    }
+
+    bool Read(std::string const& file)
+    {
+        FILE* fin = fopen(file.c_str(), "rb");
+        if(!fin)
+            return false;
+
+        std::vector<unsigned char> buf;
+        unsigned char block[4096];
+        for(size_t n; (n = fread(block, 1, sizeof(block), fin)) > 0; )
+            buf.insert(buf.end(), block, block+n);
+        fclose(fin);
+
+        Clear();
+
+        size_t pos = 0;
+        if(buf.size() < header_size || memcmp(buf.data(), Magic(), 4) != 0 || GetU16(buf, 4) != version)
+            return false;
+
+        w = GetU32(buf, 6);
+        h = GetU32(buf, 10);
+        size_t const num_chains = GetU32(buf, 14);
+        pos = header_size;
+
+        for(size_t c = 0; c < num_chains; ++c) {
+
+            if(pos + chain_header_size > buf.size())
+                return false;
+
+            Chain chain;
+            chain.value = buf[pos];
+            chain.num_pts = GetU32(buf, pos+1);
+            chain.x0 = (int32_t)GetU32(buf, pos+5);
+            chain.y0 = (int32_t)GetU32(buf, pos+9);
+            chain.num_code_bytes = GetU32(buf, pos+13);
+            chain.num_escapes = GetU32(buf, pos+17);
+            chain.code_begin = codes.size();
+            chain.escape_begin = escapes.size();
+            pos += chain_header_size;
+
+            if(pos + chain.num_code_bytes + 4*chain.num_escapes > buf.size() || chain.num_pts == 0 || chain.num_code_bytes < chain.num_pts/2)
+                return false;
+
+            /* Decoding trusts the codes, so each escape code must have its escape and no code may be out of range */
+            size_t num_escape_codes = 0;
+            for(size_t i = 0; i + 1 < chain.num_pts; ++i) {
+                int const code = (buf[pos + i/2] >> (4*(i%2))) & 0xf;
+                if(code > escape_code)
+                    return false;
+                num_escape_codes += code == escape_code;
+            }
+            if(num_escape_codes != chain.num_escapes)
+                return false;
+
+            codes.insert(codes.end(), buf.begin()+pos, buf.begin()+pos+chain.num_code_bytes);
+            pos += chain.num_code_bytes;
+
+            for(size_t e = 0; e < 2*chain.num_escapes; ++e, pos += 2)
+                escapes.push_back((int16_t)GetU16(buf, pos));
+
+            chains.push_back(chain);
+        }
+
+        return true;
+    }
+
+    size_t Width() const { return w; }
+    size_t Height() const { return h; }
+    size_t GetNumChains() const { return chains.size(); }
+    size_t GetNumPts(size_t const chain_idx) const { return chains[chain_idx].num_pts; }
+    unsigned char GetValue(size_t const chain_idx) const { return chains[chain_idx].value; }
+
+private:
+
+    struct Chain
+    {
+        unsigned char value;
+        uint32_t num_pts;
+        int32_t x0, y0;
+        uint32_t num_code_bytes;
+        uint32_t num_escapes;
+
+        /* Offsets into the shared code and escape streams */
+        size_t code_begin;
+        size_t escape_begin;
+    };
+
+    /* Output iterator setting pixels of a view */
+    template<typename View>
+    struct RasteriseIterator
+    {
+        RasteriseIterator(View const& v, unsigned char const value) : v(v), value(value) {}
+
+        RasteriseIterator& operator*() { return *this; }
+        RasteriseIterator& operator++() { return *this; }
+        RasteriseIterator operator++(int) { return *this; }
+
+        void operator=(Eigen::Vector2i const& pt)
+        {
+            if(pt[0] >= 0 && pt[1] >= 0 && pt[0] < v.width() && pt[1] < v.height())
+                v(pt[0], pt[1]) = value;
+        }
+
+        View v;
+        unsigned char value;
+    };
+
+    static int DirCode(int const dx, int const dy)
+    {
+        for(int c = 0; c < 8; ++c)
+            if(DirDx(c) == dx && DirDy(c) == dy)
+                return c;
+
+        return -1;
+    }
+
+    static void PutU16(std::vector<unsigned char>& buf, uint16_t const v)
+    {
+        buf.push_back(v & 0xff);
+        buf.push_back(v >> 8);
+    }
+
+    static void PutU32(std::vector<unsigned char>& buf, uint32_t const v)
+    {
+        for(int b = 0; b < 4; ++b)
+            buf.push_back((v >> (8*b)) & 0xff);
+    }
+
+    static uint16_t GetU16(std::vector<unsigned char> const& buf, size_t const pos)
+    {
+        return buf[pos] | (buf[pos+1] << 8);
+    }
+
+    static uint32_t GetU32(std::vector<unsigned char> const& buf, size_t const pos)
+    {
+        return buf[pos] | (buf[pos+1] << 8) | (buf[pos+2] << 16) | ((uint32_t)buf[pos+3] << 24);
+    }
+
+    enum { version = 1, header_size = 18, chain_header_size = 21, escape_code = 8 };
+
+    static char const* Magic() { return "LCSM"; }
+
+    /* E, NE, N, NW, W, SW, S, SE in image coordinates */
+    static int DirDx(int const c) { static const int dx[8] = {1, 1, 0, -1, -1, -1, 0, 1}; return dx[c]; }
+    static int DirDy(int const c) { static const int dy[8] = {0, -1, -1, -1, 0, 1, 1, 1}; return dy[c]; }
+
+    size_t w, h;
+
+    std::vector<Chain> chains;
+    std::vector<unsigned char> codes;
+    std::vector<int16_t> escapes;
+};
+
+#endif // LABEL_CATHETER_SPARSE_MASK_H
@@ -0,0 +1,170 @@
+#ifndef LABEL_CATHETER_SPATIAL_GRID_H
+#define LABEL_CATHETER_SPATIAL_GRID_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <Eigen/Core>
+
+//! @brief Uniform grid over 2D points for nearest-point and radius queries
+/*!
+ * Build() buckets the points by cell with a counting sort into two flat
+ * arrays, so a rebuild is O(n) without per-cell allocations and a query only
+ * visits the cells overlapping its radius: O(1) for the evenly spread knots
+ * and curve samples of a label, independent of the spline length.
+ */
+class SpatialGrid
+{
+public:
+    explicit SpatialGrid(float const cell_size = 16)
+        : cell_size(cell_size), nx(0), ny(0)
+    {}
+
+    /* Index the columns of a 2 x n matrix, point ids are column indices */
+    template<typename Derived>
+    void Build(Eigen::MatrixBase<Derived> const& pts)
+    {
+        size_t const n = pts.cols();
+
+        this->pts.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            this->pts[i] = Eigen::Vector2f(pts(0, i), pts(1, i));
+
+        Build();
+    }
+
+    /* Index a range of points convertible to Vector2f */
+    template<typename InputIt>
+    void Build(InputIt first, InputIt last)
+    {
+        pts.clear();
+        for(; first != last; ++first)
+            pts.push_back(Eigen::Vector2f((*first)[0], (*first)[1]));
+
+        Build();
+    }
+
+    void Clear()
+    {
+        pts.clear();
+        cell_start.clear();
+        ids.clear();
+        nx = ny = 0;
+    }
+
+    size_t Size() const { return pts.size(); }
+    Eigen::Vector2f const& GetPt(int const id) const { return pts[id]; }
+
+    /* Id of the closest point within radius, -1 if there is none */
+    int Nearest(Eigen::Vector2f const& pt, float const radius) const
+    {
+        int best_id = -1;
+        float best_sq_dist = radius*radius;
+
+        int cx0, cy0, cx1, cy1;
+        if(!CellRange(pt, radius, cx0, cy0, cx1, cy1))
+            return -1;
+
+        for(int cy = cy0; cy <= cy1; ++cy)
+            for(int cx = cx0; cx <= cx1; ++cx)
+                for(int c = cell_start[cy*nx+cx]; c < cell_start[cy*nx+cx+1]; ++c) {
+                    float const sq_dist = (pts[ids[c]] - pt).squaredNorm();
+                    if(sq_dist <= best_sq_dist) {
+                        best_sq_dist = sq_dist;
+                        best_id = ids[c];
+                    }
+                }
+
+        return best_id;
+    }
+
+    /* Ids of all points within radius, in no particular order */
+    template<typename OutputIt>
+    OutputIt Within(Eigen::Vector2f const& pt, float const radius, OutputIt out) const
+    {
+        int cx0, cy0, cx1, cy1;
+        if(!CellRange(pt, radius, cx0, cy0, cx1, cy1))
+            return out;
+
+        for(int cy = cy0; cy <= cy1; ++cy)
+            for(int cx = cx0; cx <= cx1; ++cx)
+                for(int c = cell_start[cy*nx+cx]; c < cell_start[cy*nx+cx+1]; ++c)
+                    if((pts[ids[c]] - pt).squaredNorm() <= radius*radius)
+                        *out++ = ids[c];
+
+        return out;
+    }
+
+private:
+
+    enum { max_cells_per_axis = 1024 };
+
+    void Build()
+    {
+        if(pts.empty()) {
+            Clear();
+            return;
+        }
+
+        min_pt = max_pt = pts[0];
+        for(auto const& pt : pts) {
+            min_pt = min_pt.cwiseMin(pt);
+            max_pt = max_pt.cwiseMax(pt);
+        }
+
+        /* Coarsen the cells rather than allocate a huge grid for far apart points */
+        Eigen::Vector2f const extent = max_pt - min_pt;
+        cur_cell_size = std::max(cell_size, extent.maxCoeff()/(max_cells_per_axis-1));
+
+        nx = int(extent[0]/cur_cell_size) + 1;
+        ny = int(extent[1]/cur_cell_size) + 1;
+
+        /* Counting sort of point ids by cell */
+        cell_start.assign(nx*ny+1, 0);
+        for(auto const& pt : pts)
+            cell_start[Cell(pt)+1]++;
+        for(size_t c = 1; c < cell_start.size(); ++c)
+            cell_start[c] += cell_start[c-1];
+
+        ids.resize(pts.size());
+        std::vector<int> fill(cell_start.begin(), cell_start.end()-1);
+        for(size_t i = 0; i < pts.size(); ++i)
+            ids[fill[Cell(pts[i])]++] = i;
+    }
+
+    int Cell(Eigen::Vector2f const& pt) const
+    {
+        int const cx = std::min(nx-1, int((pt[0] - min_pt[0])/cur_cell_size));
+        int const cy = std::min(ny-1, int((pt[1] - min_pt[1])/cur_cell_size));
+        return cy*nx + cx;
+    }
+
+    bool CellRange(Eigen::Vector2f const& pt, float const radius, int& cx0, int& cy0, int& cx1, int& cy1) const
+    {
+        if(pts.empty() || radius < 0)
+            return false;
+
+        if(pt[0] + radius < min_pt[0] || pt[1] + radius < min_pt[1] || pt[0] - radius > max_pt[0] || pt[1] - radius > max_pt[1])
+            return false;
+
+        cx0 = std::max(0, int(floor((pt[0] - radius - min_pt[0])/cur_cell_size)));
+        cy0 = std::max(0, int(floor((pt[1] - radius - min_pt[1])/cur_cell_size)));
+        cx1 = std::min(nx-1, int(floor((pt[0] + radius - min_pt[0])/cur_cell_size)));
+        cy1 = std::min(ny-1, int(floor((pt[1] + radius - min_pt[1])/cur_cell_size)));
+        return true;
+    }
+
+    float cell_size;
+    float cur_cell_size;
+
+    Eigen::Vector2f min_pt, max_pt;
+    int nx, ny;
+
+    std::vector<Eigen::Vector2f> pts;
+    std::vector<int> cell_start;
+    std::vector<int> ids;
+};
+
+#endif // LABEL_CATHETER_SPATIAL_GRID_H
@@ -0,0 +1,222 @@
+#ifndef LABEL_CATHETER_STAGE_TIMER_H
+#define LABEL_CATHETER_STAGE_TIMER_H
+
+#include <stdint.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//! @brief Lock-free latency histogram of one processing stage
+/*!
+ * Samples go into log-spaced buckets (8 per octave from 1us), so percentiles
+ * are accurate to ~9% while Add() stays a couple of atomic increments and can
+ * be called from any thread.
+ */
+class StageStats
+{
+public:
+    StageStats()
+        : count(0), total_ns(0), max_ns(0)
+    {
+        for(int b = 0; b < num_buckets; ++b)
+            buckets[b] = 0;
+    }
+
+    void Add(double const sec)
+    {
+        uint64_t const ns = sec > 0 ? uint64_t(sec*1e9) : 0;
+
+        buckets[Bucket(ns)]++;
+        count++;
+        total_ns += ns;
+
+        uint64_t cur_max = max_ns;
+        while(ns > cur_max && !max_ns.compare_exchange_weak(cur_max, ns));
+    }
+
+    void Reset()
+    {
+        for(int b = 0; b < num_buckets; ++b)
+            buckets[b] = 0;
+        count = 0;
+        total_ns = 0;
+        max_ns = 0;
+    }
+
+    /* Latency in seconds below which a fraction p of the samples fall */
+    double Percentile(double const p) const
+    {
+        uint64_t const n = count;
+        if(n == 0)
+            return 0;
+
+        uint64_t const rank = std::max<uint64_t>(1, ceil(p*n));
+        uint64_t seen = 0;
+        for(int b = 0; b < num_buckets; ++b) {
+            seen += buckets[b];
+            if(seen >= rank)
+                return std::min(BucketUpper(b), GetMax());
+        }
+
+        return GetMax();
+    }
+
+    size_t GetCount() const { return count; }
+    double GetTotal() const { return total_ns*1e-9; }
+    double GetMean() const { return count > 0 ? GetTotal()/count : 0; }
+    double GetMax() const { return max_ns*1e-9; }
+
+private:
+
+    enum { buckets_per_octave = 8, num_octaves = 36, num_buckets = buckets_per_octave*num_octaves };
+
+    static int Bucket(uint64_t const ns)
+    {
+        if(ns <= 1000)
+            return 0;
+
+        int const b = ceil(log2(ns*1e-3)*buckets_per_octave);
+        return std::min<int>(b, num_buckets-1);
+    }
+
+    static double BucketUpper(int const b)
+    {
+        return 1e-6*pow(2.0, double(b)/buckets_per_octave);
+    }
+
+    std::atomic<uint64_t> buckets[num_buckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+//! @brief Adds the lifetime of the scope to a StageStats
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(StageStats& stats)
+        : stats(stats), start(std::chrono::steady_clock::now())
+    {}
+
+    ~ScopedTimer()
+    {
+        stats.Add(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    StageStats& stats;
+    std::chrono::steady_clock::time_point start;
+};
+
+//! @brief Named stage histograms, kept in the order they were first used
+class StageProfiler
+{
+public:
+
+    StageStats& operator[](std::string const& name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto itr = stages.find(name);
+        if(itr != stages.end())
+            return *itr->second;
+
+        order.push_back(name);
+        return *(stages[name] = std::unique_ptr<StageStats>(new StageStats()));
+    }
+
+    std::vector<std::string> GetStageNames() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return order;
+    }
+
+    /* Short "p50/p99" summary in milliseconds for the ui panel */
+    std::string Summary(std::string const& name)
+    {
+        StageStats& stats = (*this)[name];
+
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(2) << stats.Percentile(0.5)*1e3 << "/" << stats.Percentile(0.99)*1e3 << " ms";
+        return oss.str();
+    }
+
+    void Dump(std::ostream& out)
+    {
+        out << std::left << std::setw(16) << "stage" << std::right << std::setw(10) << "count"
+            << std::setw(12) << "mean ms" << std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "max ms" << std::endl;
+
+        for(auto const& name : GetStageNames()) {
+            StageStats& stats = (*this)[name];
+            out << std::left << std::setw(16) << name << std::right << std::setw(10) << stats.GetCount() << std::fixed << std::setprecision(3)
+                << std::setw(12) << stats.GetMean()*1e3 << std::setw(12) << stats.Percentile(0.5)*1e3
+                << std::setw(12) << stats.Percentile(0.99)*1e3 << std::setw(12) << stats.GetMax()*1e3 << std::endl;
+            out.unsetf(std::ios_base::floatfield);
+        }
+    }
+
+    bool Dump(std::string const& file)
+    {
+        std::ofstream fout(file.c_str());
+        if(!fout)
+            return false;
+
+        Dump(fout);
+        return bool(fout);
+    }
+
+    /* Stages as a JSON object keyed by stage name, times in milliseconds */
+    void WriteJson(std::ostream& out, std::string const& indent = "")
+    {
+        std::vector<std::string> const names = GetStageNames();
+
+        out << "{" << std::endl;
+        for(size_t i = 0; i < names.size(); ++i) {
+            StageStats& stats = (*this)[names[i]];
+            out << indent << "  " << JsonQuote(names[i]) << ": {\"count\": " << stats.GetCount()
+                << ", \"total_ms\": " << stats.GetTotal()*1e3 << ", \"mean_ms\": " << stats.GetMean()*1e3
+                << ", \"p50_ms\": " << stats.Percentile(0.5)*1e3 << ", \"p99_ms\": " << stats.Percentile(0.99)*1e3
+                << ", \"max_ms\": " << stats.GetMax()*1e3 << "}" << (i+1 < names.size() ? "," : "") << std::endl;
+        }
+        out << indent << "}";
+    }
+
+    static std::string JsonQuote(std::string const& str)
+    {
+        std::ostringstream oss;
+        oss << '"';
+        for(auto c : str) {
+            switch(c) {
+            case '"': oss << "\\\""; break;
+            case '\\': oss << "\\\\"; break;
+            case '\n': oss << "\\n"; break;
+            case '\t': oss << "\\t"; break;
+            default:
+                if((unsigned char)c < 0x20)
+                    oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+                else
+                    oss << c;
+            }
+        }
+        oss << '"';
+        return oss.str();
+    }
+
+private:
+    mutable std::mutex mutex;
+
+    std::map<std::string, std::unique_ptr<StageStats> > stages;
+    std::vector<std::string> order;
+};
+
+#endif // LABEL_CATHETER_STAGE_TIMER_H
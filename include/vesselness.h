@@ -0,0 +1,221 @@
+#ifndef LABEL_CATHETER_VESSELNESS_H
+#define LABEL_CATHETER_VESSELNESS_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/gil/gil_all.hpp>
+#include <Eigen/Core>
+
+#include "distance_transform.h"
+
+//! @brief Sampled Gaussian (d_order 0) or its first or second derivative, 3 sigma wide
+inline std::vector<float> GaussianKernel(float const sigma, int const d_order)
+{
+    int const r = std::max(1, int(ceil(3*sigma)));
+    std::vector<float> kernel(2*r+1);
+
+    float sum = 0;
+    for(int x = -r; x <= r; ++x)
+        sum += exp(-x*x/(2*sigma*sigma));
+
+    for(int x = -r; x <= r; ++x) {
+        float const g = exp(-x*x/(2*sigma*sigma))/sum;
+        switch(d_order) {
+        case 0: kernel[x+r] = g; break;
+        case 1: kernel[x+r] = -x/(sigma*sigma)*g; break;
+        default: kernel[x+r] = (x*x/(sigma*sigma) - 1)/(sigma*sigma)*g; break;
+        }
+    }
+
+    return kernel;
+}
+
+//! @brief Ridge (thin line) response of a frame and the nearest ridge point of every pixel
+/*!
+ * The Hessian comes from separable Gaussian derivative filters: a row pass
+ * then a column pass, each an inner loop over contiguous pixels per tap that
+ * the compiler vectorises. The response is sigma^2 (l1 - |l2|) for the
+ * dominant eigenvalue l1 across a dark line, zero for blobs and edges. Ridge
+ * points are its maxima across the line above min_response, refined to
+ * sub-pixel, and a feature transform stores the nearest of them for every
+ * pixel, so Snap() is a constant-time lookup. Compute() is meant to run off
+ * the GL thread, once per frame.
+ */
+class VesselnessMap
+{
+public:
+    explicit VesselnessMap(float const sigma = 1.5, float const min_response = 4)
+        : sigma(sigma), min_response(min_response), dark_ridge(true), w(0), h(0)
+    {}
+
+    void SetSigma(float const sigma) { this->sigma = sigma; }
+    void SetMinResponse(float const min_response) { this->min_response = min_response; }
+    void SetDarkRidge(bool const dark) { dark_ridge = dark; }
+
+    void Compute(boost::gil::gray8c_view_t const& img)
+    {
+        w = img.width();
+        h = img.height();
+
+        Hessian(img);
+        Response();
+        Ridges();
+    }
+
+    bool IsValid() const { return w > 0 && h > 0; }
+    size_t GetNumRidgePts() const { return ridge_pts.size(); }
+    std::vector<Eigen::Vector2f> const& GetRidgePts() const { return ridge_pts; }
+    float GetResponse(size_t const x, size_t const y) const { return response[y*w+x]; }
+
+    /* Closest ridge point to pt if it is within radius */
+    bool Snap(Eigen::Vector2f const& pt, float const radius, Eigen::Vector2f& snapped_pt) const
+    {
+        if(!IsValid())
+            return false;
+
+        int const x = std::max(0, std::min<int>(w-1, floor(pt[0] + 0.5f)));
+        int const y = std::max(0, std::min<int>(h-1, floor(pt[1] + 0.5f)));
+        int const id = nearest_ridge[y*w+x];
+        if(id < 0 || (ridge_pts[id] - pt).squaredNorm() > radius*radius)
+            return false;
+
+        snapped_pt = ridge_pts[id];
+        return true;
+    }
+
+private:
+
+    /* Hessian entries xx, xy and yy of the Gaussian-smoothed image */
+    void Hessian(boost::gil::gray8c_view_t const& img)
+    {
+        std::vector<float> const g[3] = {GaussianKernel(sigma, 0), GaussianKernel(sigma, 1), GaussianKernel(sigma, 2)};
+        int const r = g[0].size()/2;
+
+        for(int i = 0; i < 3; ++i) {
+            rows[i].assign(w*h, 0);
+            hess[i].assign(w*h, 0);
+        }
+
+        /* Row pass over an edge-replicated copy of each row */
+        std::vector<float> pad(w + 2*r);
+        for(size_t y = 0; y < h; ++y) {
+            boost::gil::gray8c_view_t::x_iterator src = img.row_begin(y);
+            for(int x = 0; x < (int)pad.size(); ++x)
+                pad[x] = src[std::max(0, std::min<int>(w-1, x-r))];
+
+            for(int i = 0; i < 3; ++i) {
+                float* out = &rows[i][y*w];
+                for(int k = 0; k <= 2*r; ++k) {
+                    float const c = g[i][k];
+                    float const* in = &pad[k];
+                    for(size_t x = 0; x < w; ++x)
+                        out[x] += c*in[x];
+                }
+            }
+        }
+
+        /* Column pass, whole rows at a time: xx = g0(y)*g2(x), xy = g1(y)*g1(x), yy = g2(y)*g0(x) */
+        int const row_in[3] = {2, 1, 0};
+        for(size_t y = 0; y < h; ++y) {
+            for(int i = 0; i < 3; ++i) {
+                float* out = &hess[i][y*w];
+                for(int k = 0; k <= 2*r; ++k) {
+                    float const c = g[i][k];
+                    float const* in = &rows[row_in[i]][std::max(0, std::min<int>(h-1, int(y)+k-r))*w];
+                    for(size_t x = 0; x < w; ++x)
+                        out[x] += c*in[x];
+                }
+            }
+        }
+    }
+
+    /* Line response per pixel */
+    void Response()
+    {
+        response.resize(w*h);
+
+        float const scale = dark_ridge ? sigma*sigma : -sigma*sigma;
+        for(size_t i = 0; i < w*h; ++i) {
+            float const a = scale*hess[0][i];
+            float const b = scale*hess[1][i];
+            float const c = scale*hess[2][i];
+
+            float const mean = 0.5f*(a + c);
+            float const dev = sqrt(0.25f*(a - c)*(a - c) + b*b);
+            float const l1 = mean + dev;
+            float const l2 = mean - dev;
+
+            response[i] = std::max(0.0f, l1 - fabs(l2));
+        }
+    }
+
+    /* Eigenvector of the dominant eigenvalue, the line normal, quantised to one of 4 neighbour directions */
+    int NormalDir(size_t const i) const
+    {
+        float const a = hess[0][i];
+        float const b = hess[1][i];
+        float const c = hess[2][i];
+
+        /* Angle of the eigenvector is half that of (a - c, 2b) */
+        float const angle = 0.5f*atan2(2*b, a - c) + (dark_ridge ? 0 : M_PI/2);
+        return int(floor(angle/(M_PI/4) + 0.5f) + 8)%4;
+    }
+
+    /* Non-maximum suppression across the line, then the nearest ridge point map */
+    void Ridges()
+    {
+        static int const dx[4] = {1, 1, 0, -1};
+        static int const dy[4] = {0, 1, 1, 1};
+
+        ridge_pts.clear();
+        nearest_ridge.assign(w*h, -1);
+
+        for(size_t y = 1; y+1 < h; ++y) {
+            for(size_t x = 1; x+1 < w; ++x) {
+                size_t const i = y*w+x;
+                float const r0 = response[i];
+                if(r0 < min_response)
+                    continue;
+
+                int const d = NormalDir(i);
+                float const r_minus = response[i - dy[d]*w - dx[d]];
+                float const r_plus = response[i + dy[d]*w + dx[d]];
+                if(r0 < r_minus || r0 <= r_plus)
+                    continue;
+
+                /* Parabola through the profile across the line */
+                float const denom = r_minus - 2*r0 + r_plus;
+                float const s = denom < 0 ? std::max(-0.5f, std::min(0.5f, 0.5f*(r_minus - r_plus)/denom)) : 0;
+
+                nearest_ridge[i] = ridge_pts.size();
+                ridge_pts.push_back(Eigen::Vector2f(x + s*dx[d], y + s*dy[d]));
+            }
+        }
+
+        std::vector<int> const ridge_id = nearest_ridge;
+        FeatureTransform(w, h, [&ridge_id, this](size_t x, size_t y) { return ridge_id[y*w+x] >= 0; }, sq_dist, nearest_ridge);
+
+        for(auto& id : nearest_ridge)
+            if(id >= 0)
+                id = ridge_id[id];
+    }
+
+    float sigma;
+    float min_response;
+    bool dark_ridge;
+
+    size_t w, h;
+
+    std::vector<float> rows[3];
+    std::vector<float> hess[3];
+    std::vector<float> response;
+    std::vector<float> sq_dist;
+
+    std::vector<Eigen::Vector2f> ridge_pts;
+    std::vector<int> nearest_ridge;
+};
+
+#endif // LABEL_CATHETER_VESSELNESS_H
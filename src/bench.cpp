@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <random>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include <bspline.h>
+#include <enhance.h>
+#include <label_data.h>
+#include <mask_rasteriser.h>
+#include <ridge_tracker.h>
+#include <spatial_grid.h>
+#include <vesselness.h>
+
+using namespace boost::filesystem;
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+/* Keep the compiler from optimising away a benchmarked result */
+template<typename T>
+inline void DoNotOptimize(T const& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile char const* sink;
+    sink = (char const*)&value;
+#endif
+}
+
+/* Run f until at least min_time has passed and report the time per call */
+template<typename F>
+void Bench(string const& name, F f, double const items = 0, string const& item_unit = "", double const min_time = 0.25)
+{
+    f();
+
+    size_t iters = 1;
+    double sec = 0;
+    while(true) {
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < iters; ++i)
+            f();
+        sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if(sec >= min_time || iters >= (1u << 30))
+            break;
+        iters = sec > 0 ? max(iters*2, size_t(iters*min_time*1.2/sec)) : iters*100;
+    }
+
+    double const per_call = sec/iters;
+
+    cout << "    " << setw(36) << left << name << right << setw(12) << iters << fixed << setprecision(3) << setw(14);
+    if(per_call >= 1e-3)
+        cout << per_call*1e3 << " ms";
+    else
+        cout << per_call*1e6 << " us";
+
+    if(items > 0) {
+        double const rate = items/per_call;
+        cout << setprecision(1) << setw(14);
+        if(rate >= 1e6)
+            cout << rate/1e6 << " M" << item_unit << "/s";
+        else
+            cout << rate/1e3 << " k" << item_unit << "/s";
+    }
+
+    cout << endl;
+    cout.unsetf(ios_base::floatfield);
+}
+
+/* Smooth random wiggle of num_knots knots spanning roughly length pixels */
+Matrix<float,2,Dynamic> SynthKnots(size_t const num_knots, float const length, unsigned const seed = 0)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> turn(-0.5, 0.5);
+
+    Matrix<float,2,Dynamic> knots(2, num_knots);
+    float const step = length/max<size_t>(1, num_knots-1);
+    float heading = 0;
+    Vector2f pt(50, 50);
+
+    for(size_t k = 0; k < num_knots; ++k) {
+        knots.col(k) = pt;
+        heading += turn(rng);
+        pt += step*Vector2f(cos(heading), sin(heading));
+    }
+
+    return knots;
+}
+
+////////////////////////////////////////////////////////////////////////////
+//  Main function
+////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+
+    cout << "    " << setw(36) << left << "benchmark" << right << setw(12) << "iterations" << setw(17) << "time/call" << setw(20) << "throughput" << endl;
+
+    /* Knot to control point conversion */
+    cout << "Bspline knot to control point conversion" << endl;
+    size_t const knot_counts[] = {4, 8, 16, 32, 64, 128, 256};
+    for(auto num_knots : knot_counts) {
+        Matrix<float,2,Dynamic> knots = SynthKnots(num_knots, 10.0*num_knots);
+        Bspline<float,2> bspline;
+
+        ostringstream oss;
+        oss << "AddBackKnotPts/" << num_knots;
+        Bench(oss.str(), [&]() { bspline.AddBackKnotPts(knots); DoNotOptimize(bspline); }, num_knots, "knots");
+    }
+
+    /* Incremental knot appending, as when clicking */
+    for(auto num_knots : knot_counts) {
+        Matrix<float,2,Dynamic> knots = SynthKnots(num_knots, 10.0*num_knots);
+        Bspline<float,2> bspline;
+
+        ostringstream oss;
+        oss << "AddBackKnotPt x" << num_knots;
+        Bench(oss.str(), [&]() {
+            bspline.Reset();
+            for(size_t k = 0; k < num_knots; ++k)
+                bspline.AddBackKnotPt(knots.col(k));
+            DoNotOptimize(bspline);
+        }, num_knots, "knots");
+    }
+
+    /* Same with fixed-capacity stack storage, alternating ends */
+    for(auto num_knots : knot_counts) {
+        Matrix<float,2,Dynamic> knots = SynthKnots(num_knots, 10.0*num_knots);
+        Bspline<float,2,256> bspline;
+
+        ostringstream oss;
+        oss << "AddFront/BackKnotPt<256> x" << num_knots;
+        Bench(oss.str(), [&]() {
+            bspline.Reset();
+            for(size_t k = 0; k < num_knots; ++k) {
+                if(k%2 == 0)
+                    bspline.AddBackKnotPt(knots.col(k));
+                else
+                    bspline.AddFrontKnotPt(knots.col(k));
+            }
+            DoNotOptimize(bspline);
+        }, num_knots, "knots");
+    }
+
+    /* Curve evaluation */
+    cout << "Bspline curve evaluation (16 knots)" << endl;
+    size_t const lods[] = {5, 10, 30, 100};
+    for(auto lod : lods) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(16, 800));
+        bspline.SetLOD(lod);
+
+        size_t const num_samples = (bspline.GetNumCtrlPts()+1)*(lod+1);
+
+        ostringstream oss;
+        oss << "CubicIntplt/lod " << lod;
+        Bench(oss.str(), [&]() {
+            Vector2f sum = Vector2f::Zero();
+            for(int pt_idx = -1, seg_idx = 0; seg_idx <= (int)bspline.GetNumCtrlPts(); ++pt_idx, ++seg_idx)
+                for(size_t d = 0; d <= bspline.GetLOD(); ++d)
+                    sum += bspline.CubicIntplt(pt_idx, d/float(bspline.GetLOD()));
+            DoNotOptimize(sum);
+        }, num_samples, "pts");
+    }
+
+    /* Arc-length sampling at the drawing spacing */
+    cout << "Bspline sampling (16 knots, 2 px spacing or 0.25 px tolerance)" << endl;
+    float const lengths[] = {100, 500, 2000, 8000};
+    for(auto length : lengths) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(16, length));
+
+        vector<Vector2f> samples;
+        bspline.SampleUniform(2.0f, back_inserter(samples));
+        size_t const num_samples = samples.size();
+
+        ostringstream oss;
+        oss << "SampleUniform/" << length << " px";
+        Bench(oss.str(), [&]() { samples.clear(); bspline.SampleUniform(2.0f, back_inserter(samples)); DoNotOptimize(samples); }, num_samples, "pts");
+
+        samples.clear();
+        bspline.SampleAdaptive(0.25f, back_inserter(samples));
+
+        oss.str("");
+        oss << "SampleAdaptive/" << length << " px (" << samples.size() << " vs " << num_samples << ")";
+        Bench(oss.str(), [&]() { samples.clear(); bspline.SampleAdaptive(0.25f, back_inserter(samples)); DoNotOptimize(samples); }, samples.size(), "pts");
+    }
+
+    /* Knot picking and drag updates */
+    cout << "Knot picking and dragging" << endl;
+    for(auto num_knots : knot_counts) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(num_knots, 10.0*num_knots));
+
+        SpatialGrid knot_grid;
+        knot_grid.Build(bspline.GetKnotPts());
+
+        std::mt19937 rng(0);
+        std::uniform_int_distribution<size_t> pick(0, num_knots-1);
+
+        ostringstream oss;
+        oss << "SpatialGrid::Nearest/" << num_knots;
+        Bench(oss.str(), [&]() { DoNotOptimize(knot_grid.Nearest(bspline.GetKnotPt(pick(rng)) + Vector2f(2, 2), 8)); }, 1, "queries");
+
+        oss.str("");
+        oss << "ClosestPt/" << num_knots;
+        Bench(oss.str(), [&]() {
+            int pt_idx;
+            float t;
+            DoNotOptimize(bspline.ClosestPt(bspline.GetKnotPt(pick(rng)) + Vector2f(3, -2), pt_idx, t));
+        }, 1, "queries");
+
+        oss.str("");
+        oss << "SetKnotPt/" << num_knots;
+        Bench(oss.str(), [&]() { size_t const k = pick(rng); bspline.SetKnotPt(k, bspline.GetKnotPt(k)); DoNotOptimize(bspline); }, 1, "drags");
+    }
+
+    /* Knot tracking on a synthetic frame, knots start a few pixels off the wire */
+    cout << "Ridge tracking (512x512 frame)" << endl;
+    for(auto num_knots : knot_counts) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(num_knots, 400));
+
+        boost::gil::gray8_image_t frame(512, 512);
+        boost::gil::fill_pixels(boost::gil::view(frame), 170);
+        for(auto const& pt : GetContinuousPts(bspline))
+            for(int y = max(0, pt[1]-1); y <= min(511, pt[1]+1); ++y)
+                for(int x = max(0, pt[0]-1); x <= min(511, pt[0]+1); ++x)
+                    boost::gil::view(frame)(x, y) = 60;
+
+        Matrix<float,2,Dynamic> const offset_knots = bspline.GetKnotPts().colwise() + Vector2f(2, -2);
+        RidgeTracker ridge_tracker;
+
+        ostringstream oss;
+        oss << "RidgeTracker::Track/" << num_knots;
+        Bench(oss.str(), [&]() { bspline.AddBackKnotPts(offset_knots); DoNotOptimize(ridge_tracker.Track(boost::gil::const_view(frame), bspline)); }, num_knots, "knots");
+    }
+
+    /* Ridge map computation per frame and snapping per click */
+    cout << "Ridge snapping" << endl;
+    size_t const frame_sizes[] = {256, 512, 1024};
+    for(auto size : frame_sizes) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(16, 0.8*size));
+
+        boost::gil::gray8_image_t frame(size, size);
+        boost::gil::fill_pixels(boost::gil::view(frame), 170);
+        for(auto const& pt : GetContinuousPts(bspline))
+            for(int y = max(0, pt[1]-1); y <= min<int>(size-1, pt[1]+1); ++y)
+                for(int x = max(0, pt[0]-1); x <= min<int>(size-1, pt[0]+1); ++x)
+                    boost::gil::view(frame)(x, y) = 60;
+
+        VesselnessMap ridge_map;
+
+        ostringstream oss;
+        oss << "VesselnessMap::Compute/" << size << "x" << size;
+        Bench(oss.str(), [&]() { ridge_map.Compute(boost::gil::const_view(frame)); DoNotOptimize(ridge_map); }, size*size, "px");
+
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> coord(0, size-1);
+
+        oss.str("");
+        oss << "VesselnessMap::Snap/" << size << "x" << size;
+        Bench(oss.str(), [&]() { Vector2f pt; DoNotOptimize(ridge_map.Snap(Vector2f(coord(rng), coord(rng)), 4, pt)); }, 1, "queries");
+    }
+
+    /* Display enhancement per prefetched frame */
+    cout << "Frame enhancement" << endl;
+    for(auto size : frame_sizes) {
+        boost::gil::gray8_image_t frame(size, size);
+        std::mt19937 rng(0);
+        std::uniform_int_distribution<int> noise(60, 140);
+        for(size_t y = 0; y < size; ++y)
+            for(size_t x = 0; x < size; ++x)
+                boost::gil::view(frame)(x, y) = noise(rng);
+
+        FrameEnhancer enhancer;
+        vector<unsigned char> rgb(3*size*size);
+
+        EnhanceParams params;
+        params.clahe = false;
+        params.black = 40;
+        params.white = 160;
+
+        ostringstream oss;
+        oss << "FrameEnhancer/" << size << "x" << size << " median+window";
+        Bench(oss.str(), [&]() { enhancer.Apply(boost::gil::const_view(frame), params, rgb.data()); DoNotOptimize(rgb); }, size*size, "px");
+
+        params.clahe = true;
+        oss.str("");
+        oss << "FrameEnhancer/" << size << "x" << size << " +clahe";
+        Bench(oss.str(), [&]() { enhancer.Apply(boost::gil::const_view(frame), params, rgb.data()); DoNotOptimize(rgb); }, size*size, "px");
+    }
+
+    /* Pixel chain rasterisation */
+    cout << "Pixel chain rasterisation (16 knots)" << endl;
+    for(auto length : lengths) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(16, length));
+
+        size_t const num_pixels = GetContinuousPts(bspline).size();
+
+        ostringstream oss;
+        oss << "GetContinuousPts/" << length << " px";
+        Bench(oss.str(), [&]() { DoNotOptimize(GetContinuousPts(bspline)); }, num_pixels, "px");
+
+        vector<Vector2i> pts;
+        oss.str("");
+        oss << "RasterisePts/" << length << " px";
+        Bench(oss.str(), [&]() { pts.clear(); RasterisePts(bspline, back_inserter(pts)); DoNotOptimize(pts); }, num_pixels, "px");
+
+        oss.str("");
+        oss << "RasterisePts/" << length << " px adaptive";
+        Bench(oss.str(), [&]() { pts.clear(); RasterisePts(bspline, back_inserter(pts), 0.25f); DoNotOptimize(pts); }, num_pixels, "px");
+    }
+
+    /* Thick and soft masks, against a distance transform of the whole frame */
+    cout << "Mask rasterisation (16 knots, 1024x1024)" << endl;
+    for(auto length : lengths) {
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(SynthKnots(16, length));
+
+        boost::gil::gray8_image_t mask(1024, 1024);
+        MaskRasteriser mask_rasteriser;
+
+        float const widths[] = {4, 12};
+        for(auto width : widths) {
+            mask_rasteriser.SetWidth(width);
+            mask_rasteriser.SetFalloff(0);
+
+            ostringstream oss;
+            oss << "MaskRasteriser/" << length << " px width " << width;
+            Bench(oss.str(), [&]() { DoNotOptimize(mask_rasteriser.Rasterise(bspline, boost::gil::view(mask))); }, bspline.GetLength(), "px");
+
+            mask_rasteriser.SetFalloff(4);
+            oss.str("");
+            oss << "MaskRasteriser/" << length << " px width " << width << " soft";
+            Bench(oss.str(), [&]() { DoNotOptimize(mask_rasteriser.Rasterise(bspline, boost::gil::view(mask))); }, bspline.GetLength(), "px");
+        }
+
+        vector<char> is_chain(1024*1024, 0);
+        for(auto const& pt : GetContinuousPts(bspline))
+            if(pt[0] >= 0 && pt[0] < 1024 && pt[1] >= 0 && pt[1] < 1024)
+                is_chain[pt[1]*1024 + pt[0]] = 1;
+
+        vector<float> sq_dist;
+        vector<int> nearest;
+
+        ostringstream oss;
+        oss << "FeatureTransform/" << length << " px";
+        Bench(oss.str(), [&]() { FeatureTransform(1024, 1024, [&is_chain](size_t x, size_t y) { return is_chain[y*1024+x] != 0; }, sq_dist, nearest); DoNotOptimize(sq_dist); }, bspline.GetLength(), "px");
+
+        oss.str("");
+        oss << "FeatureTransform/" << length << " px all threads";
+        Bench(oss.str(), [&]() { FeatureTransform(1024, 1024, [&is_chain](size_t x, size_t y) { return is_chain[y*1024+x] != 0; }, sq_dist, nearest, 0); DoNotOptimize(sq_dist); }, bspline.GetLength(), "px");
+    }
+
+    /* label.csv parsing */
+    cout << "label.csv parsing" << endl;
+    path const tmp_dir = temp_directory_path() / unique_path("bench_%%%%%%%%");
+    create_directories(tmp_dir);
+
+    size_t const frame_counts[] = {10, 100, 1000};
+    for(auto num_frames : frame_counts) {
+
+        LabelData label_data;
+        for(size_t f = 0; f < num_frames; ++f) {
+            Bspline<float,2> bspline;
+            bspline.AddBackKnotPts(SynthKnots(12, 600, f));
+            Pts const pts = GetContinuousPts(bspline);
+            label_data.push_back(FrameLabel(pts.begin(), pts.end()));
+        }
+
+        string const csv_file = (tmp_dir / "label.csv").string();
+        WriteCSVFile(csv_file, label_data);
+        double const file_kb = file_size(csv_file)/1e3;
+
+        ostringstream oss;
+        oss << "ParseCSVFile/" << num_frames << " frames (" << int(file_kb) << " KB)";
+        Bench(oss.str(), [&]() { DoNotOptimize(ParseCSVFile(csv_file)); }, file_kb*1e3, "B");
+
+        oss.str("");
+        oss << "ForEachCSVRow/" << num_frames << " frames";
+        Bench(oss.str(), [&]() {
+            size_t num_pts = 0;
+            ForEachCSVRow(csv_file, [&num_pts](size_t, int, vector<Vector2i> const& pts) { num_pts += pts.size(); });
+            DoNotOptimize(num_pts);
+        }, file_kb*1e3, "B");
+
+        oss.str("");
+        oss << "WriteCSVFile/" << num_frames << " frames";
+        Bench(oss.str(), [&]() { WriteCSVFile(csv_file, label_data); }, file_kb*1e3, "B");
+
+        /* What an export costs: one frame appended, whatever the file size */
+        oss.str("");
+        oss << "AppendCSVFrame/" << num_frames << " frames";
+        WriteCSVFile(csv_file, label_data);
+        Bench(oss.str(), [&]() { AppendCSVFrame(csv_file, num_frames, label_data.back()); }, 1, "frame");
+    }
+
+    remove_all(tmp_dir);
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/gil/gil_all.hpp>
+#define png_infopp_NULL (png_infopp)NULL
+#define int_p_NULL (int*)NULL
+#include <boost/gil/extension/io/png_io.hpp>
+
+#include <pangolin/pangolin.h>
+
+#include <extra/pango_display.h>
+#include <extra/pango_drawer.h>
+#include <biplane.h>
+#include <bspline.h>
+#include <label_data.h>
+#include <stage_timer.h>
+
+using namespace boost::filesystem;
+using namespace boost::gil;
+
+using namespace pangolin;
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////
+//  Main function
+////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+
+    if(argc < 4) {
+        cerr << "Usage: " << argv[0] << " <images dir A> <images dir B> <calibration file>" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    string const dirs[2] = {string(argv[1]), string(argv[2])};
+
+    /* Frames of the two planes are paired by their sorted order */
+    vector<string> img_files[2];
+    for(int v = 0; v < 2; ++v) {
+        try {
+            img_files[v] = FindFrameFiles(dirs[v]);
+        } catch(filesystem_error& e) {
+            cerr << e.code().message() << ": " << dirs[v] << endl;
+            return 1;
+        }
+    }
+
+    size_t const num_frames = min(img_files[0].size(), img_files[1].size());
+    if(num_frames == 0) {
+        cerr << "No frames to label" << endl;
+        return 1;
+    }
+    if(img_files[0].size() != img_files[1].size())
+        cerr << "Planes have " << img_files[0].size() << " and " << img_files[1].size() << " frames, labelling the first " << num_frames << endl;
+
+    ProjMatrix proj[2];
+    if(!ReadBiplaneCalibration(argv[3], proj)) {
+        cerr << "Unable to read two 3x4 projection matrices from " << argv[3] << endl;
+        return 1;
+    }
+
+    /* The 3D curve, its projections are labelled in both planes */
+    Bspline<float,3> bspline;
+
+    /* Resume after the last labelled frame, from its knots */
+    string const csv3d_file = dirs[0] + "/" + "label3d.csv";
+    size_t const num_labelled = ForEachCSV3DRow(csv3d_file, [&bspline](size_t, bool const closed, Matrix<float,3,Dynamic> const& knots) {
+        bspline.Reset();
+        bspline.SetBsplineType(closed ? Bspline<float,3>::CLOSED : Bspline<float,3>::OPEN);
+        if(knots.cols() > 0)
+            bspline.AddBackKnotPts(knots);
+    });
+
+    size_t first_img_idx = num_labelled;
+    if(num_labelled >= num_frames) {
+        cout << boost::filesystem::path(argv[0]).filename() << ": all images have been labelled!" << endl;
+        first_img_idx = num_frames-1;
+    }
+
+    /* Per-stage latency histograms */
+    StageProfiler profiler;
+
+    rgb8_image_t imgs[2];
+    for(int v = 0; v < 2; ++v) {
+        point2<std::ptrdiff_t> const img_dims = png_read_dimensions(dirs[v] + "/" + img_files[v][first_img_idx]);
+        imgs[v].recreate(img_dims.x, img_dims.y);
+    }
+
+    const unsigned w[2] = {(unsigned)imgs[0].width(), (unsigned)imgs[1].width()};
+    const unsigned h[2] = {(unsigned)imgs[0].height(), (unsigned)imgs[1].height()};
+
+    uint32_t const ui_width = 180;
+    pangolin::View& container = SetupPangoGL(w[0] + w[1], max(h[0], h[1]), ui_width, "Label Biplane");
+    SetupContainer(container, 2, (float)w[0]/h[0]);
+    container[1].SetAspect((float)w[1]/h[1]);
+
+    /* Each plane zooms and pans on its own */
+    ViewTransform2D view_transforms[2] = {ViewTransform2D(w[0], h[0]), ViewTransform2D(w[1], h[1])};
+    Handler2D handlers[2] = {Handler2D(view_transforms[0]), Handler2D(view_transforms[1])};
+
+    GlTexture img_tex[2];
+    for(int v = 0; v < 2; ++v)
+        img_tex[v].Reinitialise(w[v], h[v], GL_RGBA, true, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+    DrawTexture tex_drawers[2] = {DrawTexture(view_transforms[0], img_tex[0]), DrawTexture(view_transforms[1], img_tex[1])};
+    DrawProjectedCurve curve_drawers[2] = {DrawProjectedCurve(view_transforms[0], bspline, proj[0]),
+                                           DrawProjectedCurve(view_transforms[1], bspline, proj[1])};
+
+    DrawingRoutine draw_routines[2];
+    for(int v = 0; v < 2; ++v) {
+        draw_routines[v].draw_funcs.push_back(std::ref(tex_drawers[v]));
+        draw_routines[v].draw_funcs.push_back(std::ref(curve_drawers[v]));
+        container[v].SetDrawFunction(std::ref(draw_routines[v])).SetHandler(&handlers[v]);
+    }
+
+    /* Both planes of a frame, a plane whose frame cannot be decoded keeps showing the previous one */
+    auto load_frame = [&](size_t const img_idx) {
+        ScopedTimer timer(profiler["decode"]);
+        for(int v = 0; v < 2; ++v) {
+            try {
+                png_read_view(dirs[v] + "/" + img_files[v][img_idx], view(imgs[v]));
+            } catch(std::exception& e) {
+                cerr << "Unable to decode " << dirs[v] << "/" << img_files[v][img_idx] << ": " << e.what() << endl;
+                continue;
+            }
+            img_tex[v].Upload(interleaved_view_get_raw_data(view(imgs[v])), GL_RGB, GL_UNSIGNED_BYTE);
+        }
+    };
+    load_frame(first_img_idx);
+
+    Var<int> totle_img("ui." + path(dirs[0]).filename().string());
+    totle_img = num_frames;
+
+    Var<int> img_cur_idx("ui.Image Current Idx");
+    img_cur_idx = first_img_idx;
+
+    Var<bool> check_show_bspline("ui.Show B-spline", true, true, false);
+    Var<bool> check_show_knot_pts("ui.Show Knot Pts", true, true, false);
+
+    /* A loop through the knots, e.g. a ring or a vessel contour */
+    Var<bool> check_closed("ui.Closed Spline", false, true);
+    check_closed = bspline.type == Bspline<float,3>::CLOSED;
+
+    /* Largest distance of the drawn projections from the curve in pixels */
+    Var<float> lod_tolerance("ui.LOD Tolerance", 0.25, 0.05, 2.0);
+    Var<int> num_curve_pts("ui.Curve Pts");
+
+    /* Knot picking radius in window pixels */
+    Var<float> pick_radius("ui.Pick Radius", 8, 2, 32);
+
+    /* The second click of a knot is moved onto the epipolar line of the first */
+    Var<bool> check_snap_epipolar("ui.Snap To Epipolar", true, true);
+    /* Larger of the two pixel distances between the clicks and the projections of the last triangulated knot */
+    Var<float> reproj_error("ui.Reproj Error");
+
+    Var<bool> check_carry_knots("ui.Carry Knots Forward", true, true);
+
+    Var<string> time_decode("ui.Decode");
+    Var<string> time_spline_solve("ui.Spline Solve");
+    Var<string> time_rasterise("ui.Rasterise");
+    Var<string> time_csv_write("ui.CSV Write");
+
+    Var<bool> button_reset("ui.Reset", false, false);
+    Var<bool> button_cancel_click("ui.Cancel Click", false, false);
+    Var<bool> button_export_label("ui.Export Label", false, false);
+
+    /* A click waiting for its counterpart in the other plane */
+    int click_view = -1;
+    Vector2f click_pt;
+
+    int drag_view = -1;
+    int drag_knot = -1;
+
+    /* Pixel chain of one plane while exporting */
+    vector<Vector2i> chain_pts;
+
+    /* Knot whose projection in plane v is within the picking radius of pt, or -1 */
+    auto pick_knot = [&](int const v, Vector2f const& pt) {
+        float min_dist = pick_radius*handlers[v].GetImagePerWindowPx();
+        int picked = -1;
+        for(size_t k = 0; k < bspline.GetNumKnotPts(); ++k) {
+            float const dist = (Project(proj[v], bspline.GetKnotPt(k)) - pt).norm();
+            if(dist <= min_dist) {
+                min_dist = dist;
+                picked = k;
+            }
+        }
+        return picked;
+    };
+
+    /* World point seen at pt in plane v and at other_pt in the other plane */
+    auto triangulate = [&](int const v, Vector2f const& pt, Vector2f const& other_pt) {
+        float error;
+        Vector3f const world_pt = v == 0 ? Triangulate(proj[0], pt, proj[1], other_pt, &error)
+                                         : Triangulate(proj[0], other_pt, proj[1], pt, &error);
+        reproj_error = error;
+        return world_pt;
+    };
+
+    // Register callback functions
+    pangolin::RegisterKeyPressCallback('r', [&button_reset]() { button_reset = true; } );
+    pangolin::RegisterKeyPressCallback('x', [&button_cancel_click]() { button_cancel_click = true; } );
+
+    pangolin::RegisterKeyPressCallback('b', [&bspline, &drag_knot, &profiler]() {
+        if(bspline.GetNumKnotPts() == 0 || drag_knot >= 0)
+            return;
+        ScopedTimer timer(profiler["spline solve"]);
+        bspline.RemoveBackKnotPt();
+    });
+    pangolin::RegisterKeyPressCallback(' ', [&button_export_label]() { button_export_label = true; });
+
+    while(!pangolin::ShouldQuit())
+    {
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        /* Click a point of the catheter in one plane then the same point in the other to add a knot; press on a knot to drag it */
+        for(int v = 0; v < 2; ++v) {
+            Handler2D::PointerEvent event;
+            while(handlers[v].PopEvent(event)) {
+                switch(event.type) {
+                case Handler2D::PointerEvent::PRESS:
+                    if(drag_knot >= 0)
+                        break;
+
+                    drag_knot = pick_knot(v, event.pt);
+                    if(drag_knot >= 0) {
+                        drag_view = v;
+                    } else if(click_view == 1-v) {
+                        ScopedTimer timer(profiler["spline solve"]);
+                        Vector2f pt = event.pt;
+                        if(check_snap_epipolar)
+                            pt = ClosestOnLine(EpipolarLine(proj[click_view], click_pt, proj[v]), pt);
+                        bspline.AddBackKnotPt(triangulate(v, pt, click_pt));
+                        click_view = -1;
+                    } else {
+                        click_view = v;
+                        click_pt = event.pt;
+                    }
+                    break;
+                case Handler2D::PointerEvent::DRAG:
+                    /* The knot keeps its projection in the other plane and follows the pointer in this one */
+                    if(drag_knot >= 0 && drag_view == v && drag_knot < (int)bspline.GetNumKnotPts()) {
+                        ScopedTimer timer(profiler["spline solve"]);
+                        Vector2f const other_pt = Project(proj[1-v], bspline.GetKnotPt(drag_knot));
+                        bspline.SetKnotPt(drag_knot, triangulate(v, event.pt, other_pt));
+                    }
+                    break;
+                case Handler2D::PointerEvent::RELEASE:
+                    if(drag_view == v) {
+                        drag_knot = -1;
+                        drag_view = -1;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if(Pushed(button_cancel_click))
+            click_view = -1;
+
+        for(int v = 0; v < 2; ++v) {
+            if(click_view == v)
+                curve_drawers[v].SetMarker(click_pt);
+            else
+                curve_drawers[v].ClearMarker();
+
+            if(click_view == 1-v)
+                curve_drawers[v].SetEpipolarLine(EpipolarLine(proj[click_view], click_pt, proj[v]));
+            else
+                curve_drawers[v].ClearEpipolarLine();
+
+            curve_drawers[v].SetSelectedKnotPt(drag_knot >= 0 ? drag_knot : (handlers[v].HasHoverPt() ? pick_knot(v, handlers[v].GetHoverPt()) : -1));
+            curve_drawers[v].ShowBspline(check_show_bspline);
+            curve_drawers[v].ShowKnotPts(check_show_knot_pts);
+            curve_drawers[v].SetTolerance(lod_tolerance);
+        }
+        num_curve_pts = curve_drawers[0].GetNumCurvePts() + curve_drawers[1].GetNumCurvePts();
+
+        if(check_closed != (bspline.type == Bspline<float,3>::CLOSED) && drag_knot < 0) {
+            ScopedTimer timer(profiler["spline solve"]);
+            bspline.SetBsplineType(check_closed ? Bspline<float,3>::CLOSED : Bspline<float,3>::OPEN);
+        }
+
+        if(Pushed(button_reset) && drag_knot < 0) {
+            bspline.Reset();
+            click_view = -1;
+        }
+
+        if(Pushed(button_export_label) && drag_knot < 0) {
+
+            if(img_cur_idx >= (int)num_frames) {
+                cout << boost::filesystem::path(argv[0]).filename() << ": all images have been labelled!" << endl;
+                continue;
+            }
+
+            /* The knots go to label3d.csv of the first plane, the projected pixel chains to label.csv of each */
+            {
+                ScopedTimer timer(profiler["csv write"]);
+                if(!AppendCSV3DFrame(csv3d_file, img_cur_idx, bspline))
+                    cerr << "Unable to write " << csv3d_file << endl;
+            }
+
+            for(int v = 0; v < 2; ++v) {
+                FrameLabel frame;
+                {
+                    ScopedTimer timer(profiler["rasterise"]);
+                    chain_pts.clear();
+                    RasteriseProjectedPts(bspline, proj[v], back_inserter(chain_pts));
+                    if(!chain_pts.empty())
+                        frame.AddCurve(1, chain_pts.begin(), chain_pts.end());
+                }
+
+                ScopedTimer timer(profiler["csv write"]);
+                if(!AppendCSVFrame(dirs[v] + "/" + "label.csv", img_cur_idx, frame))
+                    cerr << "Unable to write " << dirs[v] << "/label.csv" << endl;
+            }
+
+            /* Proceed the next */
+            img_cur_idx = img_cur_idx + 1;
+            if(img_cur_idx < (int)num_frames)
+                load_frame(img_cur_idx);
+
+            click_view = -1;
+            if(!check_carry_knots)
+                bspline.Reset();
+        }
+
+        time_decode = profiler.Summary("decode");
+        time_spline_solve = profiler.Summary("spline solve");
+        time_rasterise = profiler.Summary("rasterise");
+        time_csv_write = profiler.Summary("csv write");
+
+        // Swap frames and Process Events
+        pangolin::FinishFrame();
+
+    }
+
+    return 0;
+}
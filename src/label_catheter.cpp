@@ -1,10 +1,14 @@
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <iostream>
 #include <algorithm>
+#include <deque>
 #include <list>
 #include <iomanip>
+#include <future>
+#include <chrono>
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -19,8 +23,20 @@
 
 #include <extra/pango_display.h>
 #include <extra/pango_drawer.h>
+#include <extra/pango_pbo.h>
 #include <bspline.h>
-#include <csv.h>
+#include <edit_history.h>
+#include <enhance.h>
+#include <label_data.h>
+#include <image_pool.h>
+#include <knot_journal.h>
+#include <mask_rasteriser.h>
+#include <png_encoder.h>
+#include <ridge_tracker.h>
+#include <sparse_mask.h>
+#include <spatial_grid.h>
+#include <stage_timer.h>
+#include <vesselness.h>
 
 using namespace boost::filesystem;
 using namespace boost::gil;
@@ -28,81 +44,48 @@ using namespace boost::gil;
 using namespace pangolin;
 using namespace std;
 
-LabelData ParseCSVFile(string const& csv_file)
+/* Decode a frame into (mapped) pixel memory and a grayscale copy for tracking, safe to run off the GL thread */
+bool DecodeFrame(string const& img_file, unsigned char* dst, gray8_view_t const& gray, ImagePool<rgb8_image_t>& pool,
+                 unsigned char* enhanced_dst, FrameEnhancer& enhancer, EnhanceParams const enhance_params,
+                 VesselnessMap* ridge_map, StageProfiler& profiler)
 {
+    size_t const w = gray.width();
+    size_t const h = gray.height();
 
-    LabelData label_data;
-
-    if(exists(csv_file)) {
-        io::CSVReader<1> in(csv_file);
-        in.read_header(io::ignore_extra_column, "body_xy");
-        string body_xy;
-        while(in.read_row(body_xy)) {
-
-            int x, y;
-            Pts pts;
-            for(std::istringstream num_iss( body_xy ); num_iss >> x >> y; )
-                pts.push_back(Vector2i(x, y));
-
-            label_data.push_back(pts);
+    {
+        ScopedTimer timer(profiler["decode"]);
+
+        /* Mapped memory is write-only, decode into cached memory and stream the rows over */
+        ImagePool<rgb8_image_t>::Handle img = pool.Acquire(w, h);
+        try {
+            png_read_view(img_file, view(*img));
+        } catch(std::exception& e) {
+            cerr << "Unable to decode " << img_file << ": " << e.what() << endl;
+            return false;
         }
-    }
-
-    return label_data;
 
-}
+        rgb8c_view_t const src = const_view(*img);
+        for(size_t y = 0; y < h; ++y)
+            memcpy(dst + y*w*sizeof(rgb8_pixel_t), &src(0, y), w*sizeof(rgb8_pixel_t));
 
-list<Vector2i> GetContinuousPts(Bspline<float,2> const& bspline)
-{
-    /* Ensure connectibility by interpolation */
-    list<Vector2i> continuous_pts;
-    if(bspline.IsReady()) {
-        for(int pt_idx = -1, seg_idx = 0; seg_idx <= bspline.GetNumCtrlPts(); ++pt_idx, ++seg_idx)
-        {
-            for(int d = 0; d <= bspline.GetLOD(); ++d)
-            {
-                Vector2i int_pt = bspline.CubicIntplt(pt_idx, d/float(bspline.GetLOD())).cast<int>();
-
-                if(continuous_pts.size() == 0)
-                    continuous_pts.push_back(int_pt);
-                else if(continuous_pts.back() != int_pt) {
-                    int x0 = continuous_pts.back()[0];
-                    int y0 = continuous_pts.back()[1];
-                    int x1 = int_pt[0];
-                    int y1 = int_pt[1];
-
-                    int d_x = x1 - x0;
-                    int d_y = y1 - y0;
-
-                    if(d_x != 0) {
-                        for(int i = 1; i <= abs(d_x); ++i) {
-                            int inter_x = x0 + (d_x < 0 ? -i : i);
-                            int inter_y = y0 + round(d_y*(float(inter_x-x0)/float(d_x)));
-                            Vector2i inter_pt(inter_x, inter_y);
-                            if(continuous_pts.back() != inter_pt)
-                                continuous_pts.push_back(inter_pt);
-                        }
-                    }
+        copy_and_convert_pixels(src, gray);
+    }
 
-                    if(d_y != 0) {
-                        for(int i = 1; i <= abs(d_y); ++i) {
-                            int inter_y = y0 + (d_y < 0 ? -i : i);
-                            int inter_x = x0 + round(d_x*(float(inter_y-y0)/float(d_y)));
-                            Vector2i inter_pt(inter_x, inter_y);
-                            if(continuous_pts.back() != inter_pt)
-                                continuous_pts.push_back(inter_pt);
-                        }
-                    }
+    /* Enhanced copy for display */
+    {
+        ScopedTimer timer(profiler["enhance"]);
+        enhancer.Apply(gray, enhance_params, enhanced_dst);
+    }
 
-                }
-            }
-        }
+    /* Ridge map for snapping clicks, when enabled */
+    if(ridge_map) {
+        ScopedTimer timer(profiler["vesselness"]);
+        ridge_map->Compute(gray);
     }
 
-    return continuous_pts;
+    return true;
 }
 
-
 ////////////////////////////////////////////////////////////////////////////
 //  Main function
 ////////////////////////////////////////////////////////////////////////////
@@ -118,48 +101,123 @@ int main(int argc, char* argv[])
 
     /* Import all frames for labelling */
     vector<string> img_files;
-    directory_iterator end_itr;
     try {
-    for (directory_iterator itr(dir); itr != end_itr; ++itr)
-        if (is_regular_file(itr->path()))
-            if(itr->path().extension() == ".png" && itr->path().string().find("frame") != string::npos)
-                img_files.push_back(itr->path().filename().string());
+        img_files = FindFrameFiles(dir);
     } catch(filesystem_error& e) {
         cerr << e.code().message() << ": " << dir << endl;
         return 1;
     }
 
-    /* All label data is stored in a list */
-    LabelData label_data = ParseCSVFile(dir + "/" + "label.csv");
+    /* All label data, the curves of each frame stored contiguously */
+    bool has_class_id_column;
+    LabelData label_data = ParseCSVFile(dir + "/" + "label.csv", &has_class_id_column);
+
+    /* Exports append to label.csv, so a file without class ids is brought to the current format first */
+    if(exists(dir + "/" + "label.csv") && !has_class_id_column && !WriteCSVFile(dir + "/" + "label.csv", label_data))
+        cerr << "Unable to write " << dir << "/label.csv" << endl;
+
+    /* Per-stage latency histograms */
+    StageProfiler profiler;
+
+    /* Frame and mask buffers are recycled rather than reallocated */
+    ImagePool<rgb8_image_t> frame_pool;
+    ImagePool<gray8_image_t> mask_pool;
+
+    /* Masks and screenshots are encoded off the UI thread */
+    PngEncoder png_encoder(0, 8, &profiler);
 
     /* Read image */
-    rgb8_image_t img;
+    size_t first_img_idx = label_data.size();
     if(label_data.size() == img_files.size()) {
         cout << boost::filesystem::path(argv[0]).filename() << ": all images have been labelled!" << endl;
-        png_read_image(dir + "/" + img_files[label_data.size()-1], img);
-    } else {
-        png_read_image(dir + "/" + img_files[label_data.size()], img);
+        first_img_idx = label_data.size()-1;
     }
 
+    point2<std::ptrdiff_t> const img_dims = png_read_dimensions(dir + "/" + img_files[first_img_idx]);
+    ImagePool<rgb8_image_t>::Handle img = frame_pool.Acquire(img_dims.x, img_dims.y);
+    png_read_view(dir + "/" + img_files[first_img_idx], view(*img));
+
     // Setup Video Source
-    const unsigned w = img.width();
-    const unsigned h = img.height();
+    const unsigned w = img->width();
+    const unsigned h = img->height();
 
     uint32_t const ui_width = 180;
     pangolin::View& container = SetupPangoGL(w, h, ui_width, "Label Catheter");
     SetupContainer(container, 1, (float)w/h);
 
-    Handler2D handler2d(w, h);
-
-    Bspline<float,2> bspline;
-    DrawBSpline<float,2> bspline_drawer(w, h, bspline);
-    DrawTip tip_drawer(w, h, label_data);
-
-    pangolin::GlTexture img_tex(w, h, GL_RGBA, true, 0, GL_RGB, GL_UNSIGNED_BYTE, interleaved_view_get_raw_data(view(img)));
-    DrawTexture tex_drawer(img_tex);
+    /* Zoom and pan shared by picking and all drawers */
+    ViewTransform2D view_transform(w, h);
+    Handler2D handler2d(view_transform);
+
+    /* Curves of the frame in progress, knot edits go to the selected one */
+    std::deque<LabelCurve> curves;
+    size_t cur_curve = 0;
+
+    /* Knot edits are journaled in the background, an unfinished label survives a crash */
+    string const journal_file = dir + "/knots.journal";
+    int last_journal_export;
+    if(KnotJournal::Replay(journal_file, curves, &cur_curve, &last_journal_export) > 0)
+        cout << "Restored " << curves.size() << " curves from " << journal_file
+             << (last_journal_export >= 0 ? ", last exported frame " + to_string(last_journal_export) : string()) << endl;
+
+    KnotJournal journal;
+    if(!journal.Rewrite(journal_file, curves, cur_curve))
+        cerr << "Unable to write " << journal_file << ", knot edits are not journaled" << endl;
+
+    Bspline<float,2>* bspline = &curves[cur_curve].bspline;
+    DrawBSpline<float,2> bspline_drawer(view_transform, *bspline);
+    DrawCurves curves_drawer(view_transform, curves);
+
+    /* Undo and redo of knot edits and exports, kept as deltas */
+    EditHistory history;
+    Matrix<float,2,Dynamic> const no_knots(2, 0);
+    DrawTip tip_drawer(view_transform, label_data);
+
+    pangolin::GlTexture img_tex(w, h, GL_RGBA, true, 0, GL_RGB, GL_UNSIGNED_BYTE, interleaved_view_get_raw_data(view(*img)));
+    pangolin::GlTexture enhanced_tex(w, h, GL_RGBA, true, 0, GL_RGB, GL_UNSIGNED_BYTE, interleaved_view_get_raw_data(view(*img)));
+    DrawTexture tex_drawer(view_transform, img_tex, &enhanced_tex);
+
+    /* Grayscale copy of the shown frame, carried-forward knots are tracked on it */
+    gray8_image_t gray_frame(w, h);
+    copy_and_convert_pixels(const_view(*img), view(gray_frame));
+    img.reset();
+
+    RidgeTracker ridge_tracker;
+    bool track_on_load = false;
+
+    /* Ridge maps for snapping, the back one is computed along with the prefetched frame */
+    VesselnessMap ridge_maps[2];
+    int front_ridge_map = 0;
+    bool has_ridge_map = false;
+    bool pending_ridge_map = false;
+
+    /* Frames are decoded and enhanced in the background directly into mapped PBOs */
+    PboUploader img_uploader(img_tex, GL_RGB, GL_UNSIGNED_BYTE, w*h*sizeof(rgb8_pixel_t));
+    PboUploader enhanced_uploader(enhanced_tex, GL_RGB, GL_UNSIGNED_BYTE, w*h*sizeof(rgb8_pixel_t));
+    img_uploader.SetMipmaps(true);
+    enhanced_uploader.SetMipmaps(true);
+    std::future<bool> pending_frame;
+
+    /* Used by the prefetcher, or by the render loop while no frame is pending */
+    FrameEnhancer enhancer;
+    EnhanceParams enhance_params, pending_enhance_params, shown_enhance_params;
+    bool has_enhanced = false;
+
+    auto load_frame = [&](size_t const img_idx, bool const with_ridge_map) {
+        if(pending_frame.valid())
+            pending_frame.wait();
+        unsigned char* dst = img_uploader.Map();
+        unsigned char* enhanced_dst = enhanced_uploader.Map();
+        pending_ridge_map = with_ridge_map;
+        pending_enhance_params = enhance_params;
+        pending_frame = std::async(std::launch::async, DecodeFrame, dir + "/" + img_files[img_idx], dst, view(gray_frame), std::ref(frame_pool),
+                                   enhanced_dst, std::ref(enhancer), pending_enhance_params,
+                                   with_ridge_map ? &ridge_maps[1-front_ridge_map] : NULL, std::ref(profiler));
+    };
 
     DrawingRoutine draw_routine;
     draw_routine.draw_funcs.push_back(std::ref(tex_drawer));
+    draw_routine.draw_funcs.push_back(std::ref(curves_drawer));
     draw_routine.draw_funcs.push_back(std::ref(bspline_drawer));
     draw_routine.draw_funcs.push_back(std::ref(tip_drawer));
 
@@ -171,22 +229,178 @@ int main(int argc, char* argv[])
     Var<int> img_cur_idx("ui.Image Current Idx");
     img_cur_idx = label_data.size();
 
+    /* Display enhancement, computed with every prefetched frame so toggling is instant */
+    Var<bool> check_enhance("ui.Enhance", false, true);
+    Var<bool> check_denoise("ui.Denoise", true, true);
+    Var<int> window_black("ui.Black Level", 0, 0, 255);
+    Var<int> window_white("ui.White Level", 255, 0, 255);
+    Var<bool> check_clahe("ui.CLAHE", true, true);
+    Var<float> clahe_clip("ui.CLAHE Clip", 2.5, 1, 8);
+
     Var<bool> check_show_bspline("ui.Show B-spline", true, true, false);
+    Var<bool> check_show_all_curves("ui.Show All Curves", true, true, false);
     Var<bool> check_show_knot_pts("ui.Show Knot Pts", true, true, false);
     Var<bool> check_show_ctrl_pts("ui.Show Ctrl Pts", false, true, false);
     Var<bool> check_show_tip_pts("ui.Show Tip Pts", false, true, false);
     Var<bool> check_show_tip_traj("ui.Show Tip Traj", false, true, false);
 
+    /* Curvature-adaptive sampling, the tolerance is the largest distance from the curve in pixels */
+    Var<bool> check_adaptive_lod("ui.Adaptive LOD", true, true);
+    Var<float> lod_tolerance("ui.LOD Tolerance", 0.25, 0.05, 2.0);
+    Var<int> num_curve_pts("ui.Curve Pts");
+
+    /* Class of the selected curve, 'n' adds a curve of this class and 'c' selects the next */
+    Var<int> curve_class("ui.Class Id", 1, 1, 16);
+    Var<string> curve_status("ui.Curve");
+    /* The selected curve is a loop through its knots, e.g. a ring or a vessel contour */
+    Var<bool> check_closed("ui.Closed Curve", false, true);
+
+    /* Knot picking radius in window pixels */
+    Var<float> pick_radius("ui.Pick Radius", 8, 2, 32);
+
+    /* Wheel to zoom, right drag to pan, 'f' to fit */
+    Var<float> view_zoom("ui.Zoom");
+    Var<float> pixel_zoom("ui.Pixelate Above Zoom", 4, 1, 16);
+
+    /* Start each frame from the previous label, moved onto the catheter of the new frame */
+    Var<bool> check_carry_knots("ui.Carry Knots Forward", true, true);
+    Var<bool> check_track_knots("ui.Track Knots", true, true);
+    Var<float> track_radius("ui.Track Radius", 6, 1, 20);
+    Var<int> num_tracked_knots("ui.Tracked Knots");
+
+    /* Move clicked and dropped knots onto the closest ridge within the radius, in image pixels */
+    Var<bool> check_snap("ui.Snap To Ridge", false, true);
+    Var<float> snap_radius("ui.Snap Radius", 4, 1, 16);
+
+    Var<bool> check_sparse_mask("ui.Sparse Mask", false, true);
+    /* Mask pixels hold the class id of their curve rather than 255 */
+    Var<bool> check_class_mask("ui.Class Mask", false, true);
+    SparseMask sparse_mask(w, h);
+
+    /* Catheter diameter and edge fade of PNG masks in pixels, width 1 without fade keeps the pixel chain */
+    Var<float> mask_width("ui.Mask Width", 1, 1, 32);
+    Var<float> mask_falloff("ui.Mask Falloff", 0, 0, 16);
+    MaskRasteriser mask_rasteriser;
+
+    Var<int> pool_hits("ui.Pool Hits");
+    Var<int> pool_misses("ui.Pool Misses");
+
+    /* Latency p50/p99 of each stage */
+    Var<string> time_decode("ui.Decode");
+    Var<string> time_upload("ui.Upload");
+    Var<string> time_enhance("ui.Enhance Time");
+    Var<string> time_spline_solve("ui.Spline Solve");
+    Var<string> time_track("ui.Track");
+    Var<string> time_vesselness("ui.Vesselness");
+    Var<string> time_rasterise("ui.Rasterise");
+    Var<string> time_encode("ui.PNG Encode");
+    Var<string> time_fs_write("ui.FS Write");
+    Var<string> time_csv_write("ui.CSV Write");
+    Var<bool> check_dump_timing("ui.Dump Timing On Exit", false, true);
+
+    Var<int> num_undo("ui.Undo Steps");
+    Var<int> history_bytes("ui.History Bytes");
+
+    Var<bool> button_undo("ui.Undo", false, false);
+    Var<bool> button_redo("ui.Redo", false, false);
+    Var<bool> button_new_curve("ui.New Curve", false, false);
+    Var<bool> button_next_curve("ui.Next Curve", false, false);
     Var<bool> button_reset("ui.Reset", false, false);
     Var<bool> button_delete_last_label("ui.Delete Last Label", false, false);
     Var<bool> button_export_label("ui.Export Label", false, false);
     Var<bool> button_export_img("ui.Export Image", false, false);
 
+    /* Knot hit-testing, the grid is rebuilt lazily after the spline changed */
+    SpatialGrid knot_grid;
+    size_t knot_grid_revision = bspline->GetRevision() - 1;
+    int drag_knot = -1;
+    /* Pixel chain of one curve while exporting */
+    vector<Vector2i> chain_pts;
+    /* Where the dragged knot started, or whether the drag inserted it, for the history */
+    Vector2f drag_from;
+    bool drag_inserted = false;
+
+    auto select_curve = [&](size_t const curve_idx) {
+        cur_curve = curve_idx;
+        bspline = &curves[cur_curve].bspline;
+        bspline_drawer.SetBspline(*bspline);
+        curve_class = curves[cur_curve].class_id;
+        check_closed = bspline->type == Bspline<float,2>::CLOSED;
+        knot_grid_revision = bspline->GetRevision() - 1;
+        journal.SelectCurve(cur_curve);
+    };
+    curve_class = curves[cur_curve].class_id;
+    check_closed = bspline->type == Bspline<float,2>::CLOSED;
+
+    /* Knot edits are recorded against the selected curve */
+    auto record = [&](LabelEdit edit) {
+        if(edit.IsKnotEdit())
+            edit.curve_idx = cur_curve;
+        history.Record(edit);
+    };
+
+    /* Every curve to no knots, each an edit of its own */
+    auto reset_curves = [&]() {
+        for(size_t c = 0; c < curves.size(); ++c) {
+            LabelEdit edit = LabelEdit::ReplaceKnots(curves[c].bspline.GetKnotPts(), no_knots);
+            edit.curve_idx = c;
+            history.Record(edit);
+            curves[c].bspline.Reset();
+            journal.SelectCurve(c);
+            journal.Reset();
+        }
+        journal.SelectCurve(cur_curve);
+    };
+
+    /* Curve other than the selected one with a knot within the picking radius, or -1 */
+    auto pick_curve = [&](Vector2f const& pt) {
+        float const radius = pick_radius*handler2d.GetImagePerWindowPx();
+        int picked = -1;
+        float min_dist = radius;
+        for(size_t c = 0; c < curves.size(); ++c)
+            for(size_t k = 0; c != cur_curve && k < curves[c].bspline.GetNumKnotPts(); ++k) {
+                float const dist = (curves[c].bspline.GetKnotPt(k) - pt).norm();
+                if(dist <= min_dist) {
+                    min_dist = dist;
+                    picked = c;
+                }
+            }
+        return picked;
+    };
+
+    auto pick_knot = [&](Vector2f const& pt) {
+        if(knot_grid_revision != bspline->GetRevision()) {
+            knot_grid.Build(bspline->GetKnotPts());
+            knot_grid_revision = bspline->GetRevision();
+        }
+        return knot_grid.Nearest(pt, pick_radius*handler2d.GetImagePerWindowPx());
+    };
+
+    auto snap = [&](Vector2f const& pt) {
+        Vector2f snapped_pt = pt;
+        if(check_snap && has_ridge_map)
+            ridge_maps[front_ridge_map].Snap(pt, snap_radius, snapped_pt);
+        return snapped_pt;
+    };
+
     // Register callback functions
     pangolin::RegisterKeyPressCallback('r', [&button_reset]() { button_reset = true; } );
     pangolin::RegisterKeyPressCallback('d', [&button_delete_last_label]() { button_delete_last_label = true; });
 
-    pangolin::RegisterKeyPressCallback('b', [&bspline]() { bspline.RemoveBackKnotPt(); });
+    pangolin::RegisterKeyPressCallback('z', [&button_undo]() { button_undo = true; });
+    pangolin::RegisterKeyPressCallback('y', [&button_redo]() { button_redo = true; });
+
+    pangolin::RegisterKeyPressCallback('n', [&button_new_curve]() { button_new_curve = true; });
+    pangolin::RegisterKeyPressCallback('c', [&button_next_curve]() { button_next_curve = true; });
+
+    pangolin::RegisterKeyPressCallback('b', [&bspline, &journal, &record, &profiler]() {
+        if(bspline->GetNumKnotPts() == 0)
+            return;
+        ScopedTimer timer(profiler["spline solve"]);
+        record(LabelEdit::EraseKnot(bspline->GetNumKnotPts()-1, bspline->GetBackKnotPt()));
+        bspline->RemoveBackKnotPt();
+        journal.RemoveBack();
+    });
     pangolin::RegisterKeyPressCallback(' ', [&button_export_label]() { button_export_label = true; });
 
     while(!pangolin::ShouldQuit())
@@ -194,84 +408,321 @@ int main(int argc, char* argv[])
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        if(handler2d.HasPickedPt())
-            bspline.AddBackKnotPt(handler2d.GetPickedPt());
+        /* Show the prefetched frame as soon as it has been decoded */
+        if(pending_frame.valid() && pending_frame.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            if(pending_frame.get()) {
+                {
+                    ScopedTimer timer(profiler["upload"]);
+                    img_uploader.Upload();
+                    enhanced_uploader.Upload();
+                }
+                shown_enhance_params = pending_enhance_params;
+                has_enhanced = true;
+
+                if(pending_ridge_map)
+                    front_ridge_map = 1-front_ridge_map;
+                has_ridge_map = pending_ridge_map;
+
+                /* Unless the annotator already grabbed a knot */
+                if(track_on_load && drag_knot < 0) {
+                    ScopedTimer timer(profiler["track"]);
+                    ridge_tracker.SetSearchRadius(track_radius);
+                    num_tracked_knots = 0;
+                    for(size_t c = 0; c < curves.size(); ++c) {
+                        Matrix<float,2,Dynamic> const untracked = curves[c].bspline.GetKnotPts();
+                        size_t const num_tracked = ridge_tracker.Track(const_view(gray_frame), curves[c].bspline);
+                        if(num_tracked > 0) {
+                            LabelEdit edit = LabelEdit::MoveKnots(untracked, curves[c].bspline.GetKnotPts());
+                            edit.curve_idx = c;
+                            history.Record(edit);
+                            journal.SelectCurve(c);
+                            journal.Assign(curves[c].bspline.GetKnotPts());
+                        }
+                        num_tracked_knots = num_tracked_knots + num_tracked;
+                    }
+                    journal.SelectCurve(cur_curve);
+                }
+            } else {
+                img_uploader.Cancel();
+                enhanced_uploader.Cancel();
+                has_ridge_map = false;
+                has_enhanced = false;
+            }
+
+            track_on_load = false;
+        }
+
+        /* Enhancement settings changed, redo the shown frame once */
+        enhance_params.median = check_denoise;
+        enhance_params.black = window_black;
+        enhance_params.white = max<int>(window_black+1, window_white);
+        enhance_params.clahe = check_clahe;
+        enhance_params.clahe_clip = clahe_clip;
+
+        if(check_enhance && (!has_enhanced || shown_enhance_params != enhance_params) && !pending_frame.valid()) {
+            {
+                ScopedTimer timer(profiler["enhance"]);
+                enhancer.Apply(const_view(gray_frame), enhance_params, enhanced_uploader.Map());
+            }
+            enhanced_uploader.Upload();
+            shown_enhance_params = enhance_params;
+            has_enhanced = true;
+        }
+        tex_drawer.ShowAlt(check_enhance);
+
+        /* Snapping was just enabled, compute the map of the shown frame once */
+        if(check_snap && !has_ridge_map && !pending_frame.valid()) {
+            ScopedTimer timer(profiler["vesselness"]);
+            ridge_maps[front_ridge_map].Compute(const_view(gray_frame));
+            has_ridge_map = true;
+        }
+
+
+        /* Press on a knot to drag it, elsewhere to append a knot */
+        Handler2D::PointerEvent event;
+        while(handler2d.PopEvent(event)) {
+            switch(event.type) {
+            case Handler2D::PointerEvent::PRESS:
+                /* Pressing on a knot of another curve selects that curve */
+                if(pick_knot(event.pt) < 0) {
+                    int const picked_curve = pick_curve(event.pt);
+                    if(picked_curve >= 0)
+                        select_curve(picked_curve);
+                }
+
+                drag_knot = pick_knot(event.pt);
+                drag_inserted = drag_knot < 0;
+                if(drag_knot >= 0)
+                    drag_from = bspline->GetKnotPt(drag_knot);
+                if(drag_knot < 0) {
+                    ScopedTimer timer(profiler["spline solve"]);
+
+                    /* Clicking on the curve inserts a knot there and drags it, elsewhere extends the tip */
+                    float const radius = pick_radius*handler2d.GetImagePerWindowPx();
+                    int pt_idx;
+                    float t;
+                    if(bspline->ClosestPt(event.pt, pt_idx, t, radius) < radius) {
+                        drag_knot = bspline->GetInsertIdx(pt_idx);
+                        bspline->InsertKnotPt(drag_knot, snap(bspline->CubicIntplt(pt_idx, t)));
+                        journal.Insert(drag_knot, bspline->GetKnotPt(drag_knot));
+                    } else {
+                        bspline->AddBackKnotPt(snap(event.pt));
+                        journal.AddBack(bspline->GetBackKnotPt());
+                        record(LabelEdit::InsertKnot(bspline->GetNumKnotPts()-1, bspline->GetBackKnotPt()));
+                    }
+                }
+                break;
+            case Handler2D::PointerEvent::DRAG:
+                if(drag_knot >= 0 && drag_knot < (int)bspline->GetNumKnotPts()) {
+                    ScopedTimer timer(profiler["spline solve"]);
+                    bspline->SetKnotPt(drag_knot, event.pt);
+                    journal.Set(drag_knot, event.pt);
+                }
+                break;
+            case Handler2D::PointerEvent::RELEASE:
+                /* Dragged knots snap once dropped, not while following the pointer */
+                if(check_snap && drag_knot >= 0 && drag_knot < (int)bspline->GetNumKnotPts()) {
+                    ScopedTimer timer(profiler["spline solve"]);
+                    bspline->SetKnotPt(drag_knot, snap(bspline->GetKnotPt(drag_knot)));
+                    journal.Set(drag_knot, bspline->GetKnotPt(drag_knot));
+                }
+
+                /* The whole press-drag-release is one edit */
+                if(drag_knot >= 0 && drag_knot < (int)bspline->GetNumKnotPts()) {
+                    if(drag_inserted)
+                        record(LabelEdit::InsertKnot(drag_knot, bspline->GetKnotPt(drag_knot)));
+                    else
+                        record(LabelEdit::MoveKnot(drag_knot, drag_from, bspline->GetKnotPt(drag_knot)));
+                }
+                drag_knot = -1;
+                break;
+            }
+        }
+
+        bspline_drawer.SetSelectedKnotPt(drag_knot >= 0 ? drag_knot : (handler2d.HasHoverPt() ? pick_knot(handler2d.GetHoverPt()) : -1));
 
         bspline_drawer.ShowBspline(check_show_bspline);
         bspline_drawer.ShowCtrlPts(check_show_ctrl_pts);
         bspline_drawer.ShowKnotPts(check_show_knot_pts);
+        bspline_drawer.SetTolerance(check_adaptive_lod ? (float)lod_tolerance : 0.0f);
+        num_curve_pts = bspline_drawer.GetNumCurvePts();
+
+        curves_drawer.ShowCurves(check_show_all_curves);
+        curves_drawer.SetTolerance(check_adaptive_lod ? (float)lod_tolerance : 0.0f);
 
         tip_drawer.ShowTipPts(check_show_tip_pts);
         tip_drawer.ShowTipTraj(check_show_tip_traj);
 
-        if(Pushed(button_reset))
-            bspline.Reset();
-
-        if(Pushed(button_export_label)) {
+        tex_drawer.SetPixelZoom(pixel_zoom);
+        view_zoom = view_transform.GetZoom();
+
+        /* Step through the history, not in the middle of a drag */
+        bool const redo = Pushed(button_redo);
+        bool const undo = Pushed(button_undo) && !redo;
+        if((undo || redo) && drag_knot < 0) {
+            LabelEdit const* edit = redo ? history.Redo() : history.Undo();
+
+            /* The edited curve is selected, so the change is in view */
+            if(edit && edit->IsKnotEdit() && edit->curve_idx < curves.size()) {
+                ScopedTimer timer(profiler["spline solve"]);
+                select_curve(edit->curve_idx);
+                edit->Apply(*bspline, redo);
+                journal.Assign(bspline->GetKnotPts());
+            } else if(edit && edit->type == LabelEdit::ADD_CURVE) {
+                if(redo) {
+                    curves.push_back(LabelCurve(edit->class_after));
+                    journal.AddCurve(edit->class_after);
+                    select_curve(curves.size() - 1);
+                } else if(curves.size() > 1) {
+                    curves.pop_back();
+                    journal.RemoveLastCurve();
+                    select_curve(min(edit->from_curve_idx, curves.size() - 1));
+                }
+            } else if(edit && edit->type == LabelEdit::SET_CLASS && edit->curve_idx < curves.size()) {
+                select_curve(edit->curve_idx);
+                curves[cur_curve].class_id = redo ? edit->class_after : edit->class_before;
+                curve_class = curves[cur_curve].class_id;
+                journal.SetClass(curves[cur_curve].class_id);
+            } else if(edit && edit->type == LabelEdit::EXPORT_FRAME) {
+                /* Undoing an export goes back to the exported frame, redoing it moves past it again; mask files are left as written */
+                {
+                    ScopedTimer timer(profiler["csv write"]);
+                    if(redo) {
+                        label_data.push_back(edit->frame);
+                        AppendCSVFrame(dir + "/" + "label.csv", edit->frame_idx, label_data.back());
+                    } else {
+                        label_data.pop_back();
+                        WriteCSVFile(dir + "/" + "label.csv", label_data);
+                    }
+                }
 
-            if(img_cur_idx == img_files.size()) {
-                cout << boost::filesystem::path(argv[0]).filename() << ": all images have been labelled!" << endl;
-                continue;
+                img_cur_idx = edit->frame_idx + (redo ? 1 : 0);
+                if(img_cur_idx < (int)img_files.size())
+                    load_frame(img_cur_idx, check_snap);
+                track_on_load = false;
             }
+        }
 
-            /* Export label image */
-            gray8_image_t label_img(w, h);
-            fill_pixels(view(label_img), 0);
+        num_undo = history.GetNumUndo();
+        history_bytes = history.GetMemoryBytes();
 
-            label_data.push_back(GetContinuousPts(bspline));
-            for(auto pt : label_data.back())
-                view(label_img)(pt[0], pt[1]) = 255;
+        /* The class of the selected curve was changed in the panel */
+        if(curve_class != curves[cur_curve].class_id && drag_knot < 0) {
+            history.Record(LabelEdit::SetClass(cur_curve, curves[cur_curve].class_id, curve_class));
+            curves[cur_curve].class_id = curve_class;
+            journal.SetClass(curve_class);
+        }
 
-            string label_img_file = img_files[(int)img_cur_idx];
-            label_img_file.replace(0, 5, "label");
+        /* Opened or closed in the panel, not an edit of the history: toggling again reverts it */
+        if(check_closed != (bspline->type == Bspline<float,2>::CLOSED) && drag_knot < 0) {
+            ScopedTimer timer(profiler["spline solve"]);
+            bspline->SetBsplineType(check_closed ? Bspline<float,2>::CLOSED : Bspline<float,2>::OPEN);
+            journal.SetClosed(check_closed);
+        }
 
-            cout << "Write: " << dir << "/" << label_img_file << endl;
-            boost::gil::png_write_view(dir + "/" + label_img_file, const_view(label_img));
+        if(Pushed(button_new_curve) && drag_knot < 0) {
+            history.Record(LabelEdit::AddCurve(curves.size(), cur_curve, curve_class));
+            curves.push_back(LabelCurve(curve_class));
+            journal.AddCurve(curve_class);
+            select_curve(curves.size() - 1);
+        }
 
-            FILE* fout = fopen((dir + "/" + "label.csv").c_str(), "w");
+        if(Pushed(button_next_curve) && drag_knot < 0)
+            select_curve((cur_curve + 1) % curves.size());
 
-            /* Overwrite label data */
-            fprintf(fout, "frame_idx,\ttip_xy,\tbase_xy,\tnum_body_pt,\tbody_xy\n");
-            size_t frame_idx = 0;
-            for(auto label : label_data)
-            {
+        curve_status = to_string(cur_curve + 1) + " of " + to_string(curves.size());
 
-                fprintf(fout, "%d", frame_idx++); // Frame idx
+        if(Pushed(button_reset)) {
+            record(LabelEdit::ReplaceKnots(bspline->GetKnotPts(), no_knots));
+            bspline->Reset();
+            journal.Reset();
+        }
+
+        if(Pushed(button_export_label)) {
 
-                if(label.size() > 0) {
+            if(img_cur_idx == img_files.size()) {
+                cout << boost::filesystem::path(argv[0]).filename() << ": all images have been labelled!" << endl;
+                continue;
+            }
 
-                    fprintf(fout, ",\t%d %d", label.back()[0], label.back()[1]); // Tip point
-                    fprintf(fout, ",\t%d %d", label.front()[0], label.front()[1]); // Base point
+            /* Export label image, curves without a pixel chain are left out */
+            label_data.push_back(FrameLabel());
+            FrameLabel& frame = label_data.back();
+            {
+                ScopedTimer timer(profiler["rasterise"]);
+                for(auto const& curve : curves) {
+                    chain_pts.clear();
+                    RasterisePts(curve.bspline, back_inserter(chain_pts), check_adaptive_lod ? (float)lod_tolerance : 0.0f);
+                    if(!chain_pts.empty())
+                        frame.AddCurve(curve.class_id, chain_pts.begin(), chain_pts.end());
+                }
+            }
 
-                    fprintf(fout, ",\t%d", label.size()); // Num of body points
+            /* Where curves of different classes cross, the higher class id wins */
+            auto mask_value = [&check_class_mask](int const class_id) {
+                return (unsigned char)(check_class_mask ? min(255, max(1, class_id)) : 255);
+            };
 
-                    fprintf(fout, ",\t"); // Body point
-                    for(auto pt : label)
-                        fprintf(fout, "%d %d ", pt[0], pt[1]);
+            string label_img_file = img_files[(int)img_cur_idx];
+            label_img_file.replace(0, 5, "label");
 
-                    fprintf(fout, "\n");
-                } else {
+            if(check_sparse_mask) {
 
-                    fprintf(fout, ",\t"); // Tip point
-                    fprintf(fout, ",\t"); // Base point
+                /* Chain-coded mask, no full-resolution image is touched */
+                ScopedTimer timer(profiler["fs write"]);
+                sparse_mask.Reset(w, h);
+                for(size_t c = 0; c < frame.GetNumCurves(); ++c)
+                    sparse_mask.AddChain(frame.CurveBegin(c), frame.CurveEnd(c), mask_value(frame.GetClassId(c)));
 
-                    fprintf(fout, ",\t"); // Num of body points
+                label_img_file = path(label_img_file).replace_extension(".lcm").string();
+                cout << "Write: " << dir << "/" << label_img_file << endl;
+                if(!sparse_mask.Write(dir + "/" + label_img_file))
+                    cerr << "Unable to write " << dir << "/" << label_img_file << endl;
 
-                    fprintf(fout, ",\t"); // Body point
+            } else {
 
-                    fprintf(fout, "\n");
+                ImagePool<gray8_image_t>::Handle label_img = mask_pool.Acquire(w, h);
+                fill_pixels(view(*label_img), 0);
 
+                if(mask_width > 1 || mask_falloff > 0) {
+                    ScopedTimer timer(profiler["rasterise"]);
+                    mask_rasteriser.SetWidth(mask_width);
+                    mask_rasteriser.SetFalloff(mask_falloff);
+                    for(auto const& curve : curves)
+                        mask_rasteriser.Rasterise(curve.bspline, view(*label_img), mask_value(curve.class_id));
+                } else {
+                    /* Chains may leave the frame, only the pixels inside it are drawn */
+                    gray8_view_t const v = view(*label_img);
+                    for(size_t c = 0; c < frame.GetNumCurves(); ++c) {
+                        unsigned char const value = mask_value(frame.GetClassId(c));
+                        for(Vector2i const* pt = frame.CurveBegin(c); pt != frame.CurveEnd(c); ++pt)
+                            if((*pt)[0] >= 0 && (*pt)[1] >= 0 && (*pt)[0] < v.width() && (*pt)[1] < v.height() && v((*pt)[0], (*pt)[1]) < value)
+                                v((*pt)[0], (*pt)[1]) = value;
+                    }
                 }
+
+                cout << "Write: " << dir << "/" << label_img_file << endl;
+                png_encoder.Write(dir + "/" + label_img_file, std::move(label_img), PngParams::Mask());
             }
 
-            fclose(fout);
+            {
+                ScopedTimer timer(profiler["csv write"]);
+                if(!AppendCSVFrame(dir + "/" + "label.csv", img_cur_idx, frame))
+                    cerr << "Unable to write " << dir << "/label.csv" << endl;
+            }
+            journal.Export(img_cur_idx);
+            history.Record(LabelEdit::ExportFrame(img_cur_idx, frame));
 
             /* Proceed the next */
             img_cur_idx = img_cur_idx + 1;
-            png_read_image(dir + "/" + img_files[(int)img_cur_idx], img);
-            img_tex.Upload(interleaved_view_get_raw_data(view(img)), GL_RGB, GL_UNSIGNED_BYTE);
+            if(img_cur_idx < (int)img_files.size()) {
+                load_frame(img_cur_idx, check_snap);
+                track_on_load = check_carry_knots && check_track_knots;
+            }
 
-            bspline.Reset();
+            /* Curves and their classes stay, only their knots go */
+            if(!check_carry_knots)
+                reset_curves();
 
         }
 
@@ -280,27 +731,60 @@ int main(int argc, char* argv[])
             if(img_cur_idx > 0) {
 
                 label_data.pop_back();
+                {
+                    ScopedTimer timer(profiler["csv write"]);
+                    WriteCSVFile(dir + "/" + "label.csv", label_data);
+                }
 
                 img_cur_idx = img_cur_idx - 1;
-                png_read_image(dir + "/" + img_files[(int)img_cur_idx], img);
-                img_tex.Upload(interleaved_view_get_raw_data(view(img)), GL_RGB, GL_UNSIGNED_BYTE);
+                load_frame(img_cur_idx, check_snap);
+
+                reset_curves();
 
-                bspline.Reset();
+                /* Exports in the history no longer match label.csv */
+                history.Clear();
             }
         }
 
         if(Pushed(button_export_img)) {
 
+            ImagePool<rgb8_image_t>::Handle output_img = frame_pool.Acquire(w, h);
             glReadBuffer(GL_FRONT);
-            glReadPixels(container[0].v.l+0.5, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, interleaved_view_get_raw_data(view(img)));
+            glReadPixels(container[0].v.l+0.5, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, interleaved_view_get_raw_data(view(*output_img)));
 
-            boost::gil::png_write_view(dir + "/output_img.png", flipped_up_down_view(const_view(img)));
+            png_encoder.Write(dir + "/output_img.png", std::move(output_img), PngParams::Frame(), true);
         }
 
+        pool_hits = frame_pool.GetNumHits() + mask_pool.GetNumHits();
+        pool_misses = frame_pool.GetNumMisses() + mask_pool.GetNumMisses();
+
+        time_decode = profiler.Summary("decode");
+        time_upload = profiler.Summary("upload");
+        time_enhance = profiler.Summary("enhance");
+        time_spline_solve = profiler.Summary("spline solve");
+        time_track = profiler.Summary("track");
+        time_vesselness = profiler.Summary("vesselness");
+        time_rasterise = profiler.Summary("rasterise");
+        time_encode = profiler.Summary("encode");
+        time_fs_write = profiler.Summary("fs write");
+        time_csv_write = profiler.Summary("csv write");
+
         // Swap frames and Process Events
         pangolin::FinishFrame();
 
     }
 
+    if(pending_frame.valid())
+        pending_frame.wait();
+
+    png_encoder.Flush();
+    journal.Close();
+
+    if(check_dump_timing) {
+        profiler.Dump(cout);
+        if(profiler.Dump(dir + "/timing.txt"))
+            cout << "Write: " << dir << "/timing.txt" << endl;
+    }
+
     return 0;
 }
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/gil/gil_all.hpp>
+#define png_infopp_NULL (png_infopp)NULL
+#define int_p_NULL (int*)NULL
+#include <boost/gil/extension/io/png_io.hpp>
+
+#include <distance_transform.h>
+#include <label_data.h>
+#include <image_pool.h>
+#include <png_encoder.h>
+#include <stage_timer.h>
+
+using namespace boost::filesystem;
+using namespace boost::gil;
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+/* Row-major 32 bit floats in native byte order, no header */
+bool WriteRawFloat(string const& file, vector<float> const& data)
+{
+    FILE* fout = fopen(file.c_str(), "wb");
+    if(!fout)
+        return false;
+
+    bool const ok = fwrite(data.data(), sizeof(float), data.size(), fout) == data.size();
+    return fclose(fout) == 0 && ok;
+}
+
+/* Raise heatmap to the Gaussian of the distance to the tip, zero beyond 4 sigma */
+void AddTipHeatmap(size_t const w, size_t const h, Vector2i const& tip, float const sigma, vector<float>& heatmap)
+{
+    int const r = ceil(4*sigma);
+    int const x0 = max(0, tip[0]-r), x1 = min<int>(w-1, tip[0]+r);
+    int const y0 = max(0, tip[1]-r), y1 = min<int>(h-1, tip[1]+r);
+
+    for(int y = y0; y <= y1; ++y)
+        for(int x = x0; x <= x1; ++x)
+            heatmap[y*w+x] = max(heatmap[y*w+x], exp(-((x-tip[0])*(x-tip[0]) + (y-tip[1])*(y-tip[1]))/(2*sigma*sigma)));
+}
+
+////////////////////////////////////////////////////////////////////////////
+//  Main function
+////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+
+    if(argc < 2) {
+        cerr << "Usage: " << argv[0] << " <images dir> [format = png|float] [distance scale = 64] [tip sigma = 4] [num threads = all]" << endl;
+        exit(1);
+    }
+
+    string const dir = argv[1];
+    bool const raw_float = argc > 2 && string(argv[2]) == "float";
+    float const dist_scale = argc > 3 ? atof(argv[3]) : 64;
+    float const tip_sigma = argc > 4 ? atof(argv[4]) : 4;
+    size_t const num_threads = argc > 5 ? atoi(argv[5]) : 0;
+
+    if(argc > 2 && !raw_float && string(argv[2]) != "png") {
+        cerr << argv[0] << ": unknown format " << argv[2] << endl;
+        exit(1);
+    }
+
+    if(dist_scale <= 0 || tip_sigma <= 0) {
+        cerr << argv[0] << ": invalid distance scale or tip sigma" << endl;
+        exit(1);
+    }
+
+    vector<string> img_files;
+    try {
+        img_files = FindFrameFiles(dir);
+    } catch(filesystem_error& e) {
+        cerr << e.code().message() << ": " << dir << endl;
+        return 1;
+    }
+
+    if(img_files.empty()) {
+        cerr << argv[0] << ": no frames in " << dir << endl;
+        return 1;
+    }
+
+    point2<std::ptrdiff_t> const img_dims = png_read_dimensions(dir + "/" + img_files[0]);
+    size_t const w = img_dims.x;
+    size_t const h = img_dims.y;
+
+    StageProfiler profiler;
+
+    /* 16 bit maps are encoded in the background */
+    ImagePool<gray16_image_t> map_pool(16);
+    PngEncoder png_encoder(0, 8, &profiler);
+    size_t num_failed = 0;
+
+    vector<char> is_chain(w*h);
+    vector<float> sq_dist;
+    vector<int> nearest;
+    vector<float> dist;
+    vector<float> tip_map;
+
+    /* Encode a map in [0, max_value] as 16 bit, values above are saturated */
+    auto write_png16 = [&](string const& file, vector<float> const& map, float const scale, PngParams const& params) {
+        ImagePool<gray16_image_t>::Handle img = map_pool.Acquire(w, h);
+        for(size_t y = 0; y < h; ++y) {
+            gray16_view_t::x_iterator row = view(*img).row_begin(y);
+            float const* in = &map[y*w];
+            for(size_t x = 0; x < w; ++x)
+                row[x] = min(65535.0f, in[x]*scale + 0.5f);
+        }
+        png_encoder.Write(file, std::move(img), params);
+    };
+
+    auto write_map = [&](string const& name, vector<float> const& map, float const scale, PngParams const& params) {
+        if(raw_float) {
+            ScopedTimer timer(profiler["fs write"]);
+            string const file = dir + "/" + path(name).replace_extension(".raw").string();
+            if(!WriteRawFloat(file, map)) {
+                cerr << "Unable to write " << file << endl;
+                ++num_failed;
+            }
+        } else {
+            write_png16(dir + "/" + name, map, scale, params);
+        }
+    };
+
+    Clock::time_point start = Clock::now();
+    size_t const num_rows = ForEachCSVFrame(dir + "/" + "label.csv", [&](size_t const frame_idx, FrameLabel const& frame) {
+
+        if(frame_idx >= img_files.size())
+            return;
+
+        {
+            ScopedTimer timer(profiler["transform"]);
+
+            /* Distance to the closest curve of any class */
+            fill(is_chain.begin(), is_chain.end(), 0);
+            for(auto const& pt : frame.GetPts())
+                if(pt[0] >= 0 && pt[1] >= 0 && pt[0] < (int)w && pt[1] < (int)h)
+                    is_chain[pt[1]*w + pt[0]] = 1;
+
+            FeatureTransform(w, h, [&is_chain, w](size_t x, size_t y) { return is_chain[y*w+x] != 0; }, sq_dist, nearest, num_threads);
+
+            /* Frames without a label are at infinite distance */
+            dist.resize(w*h);
+            for(size_t i = 0; i < w*h; ++i)
+                dist[i] = sqrt(sq_dist[i]);
+        }
+
+        {
+            ScopedTimer timer(profiler["heatmap"]);
+            tip_map.assign(w*h, 0);
+            for(size_t c = 0; c < frame.GetNumCurves(); ++c)
+                AddTipHeatmap(w, h, *(frame.CurveEnd(c)-1), tip_sigma, tip_map);
+        }
+
+        /* frame_XXXXX.png -> dist_XXXXX.png and tip_XXXXX.png */
+        string dist_file = img_files[frame_idx];
+        dist_file.replace(0, 5, "dist");
+        string tip_file = img_files[frame_idx];
+        tip_file.replace(0, 5, "tip");
+
+        write_map(dist_file, dist, dist_scale, PngParams::Frame());
+        write_map(tip_file, tip_map, 65535, PngParams::Mask());
+
+        if((frame_idx+1)%100 == 0)
+            cout << "\r" << frame_idx+1 << " frames" << flush;
+    });
+
+    png_encoder.Flush();
+    num_failed += png_encoder.GetNumFailed();
+
+    double const sec = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t const num_frames = min(num_rows, img_files.size());
+
+    cout << "\r" << num_frames << " distance maps and tip heatmaps of " << w << "x" << h << " written to " << dir << " as "
+         << (raw_float ? "raw float" : "16 bit PNG") << " in " << fixed << setprecision(1) << sec << " s" << endl;
+    profiler.Dump(cout);
+
+    return num_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/gil/gil_all.hpp>
+#define png_infopp_NULL (png_infopp)NULL
+#define int_p_NULL (int*)NULL
+#include <boost/gil/extension/io/png_io.hpp>
+
+#include <png_encoder.h>
+#include <image_pool.h>
+
+using namespace boost::filesystem;
+using namespace boost::gil;
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+/* One pixel wide wavy curve on a black background, like a label mask */
+void SynthMask(gray8_view_t const& v)
+{
+    fill_pixels(v, 0);
+    for(int x = 0; x < v.width(); ++x) {
+        int y = v.height()/2 + v.height()/4*sin(6.0*M_PI*x/v.width());
+        v(x, y) = 255;
+    }
+}
+
+/* Smooth vignetted background with quantum noise and a dark wire, like a fluoroscopy frame */
+void SynthFrame(rgb8_view_t const& v)
+{
+    std::mt19937 rng(0);
+    std::normal_distribution<float> noise(0, 6);
+
+    for(int y = 0; y < v.height(); ++y) {
+        for(int x = 0; x < v.width(); ++x) {
+            float dx = (x - v.width()/2.0)/v.width();
+            float dy = (y - v.height()/2.0)/v.height();
+            float i = 170 - 160*(dx*dx + dy*dy) + noise(rng);
+
+            float wire_y = v.height()/2 + v.height()/4*sin(6.0*M_PI*x/v.width());
+            if(fabs(y - wire_y) < 2)
+                i -= 60;
+
+            unsigned char c = max(0.0f, min(255.0f, i));
+            v(x, y) = rgb8_pixel_t(c, c, c);
+        }
+    }
+}
+
+template<typename View>
+void BenchSettings(string const& name, View const& v, vector<PngParams> const& settings, int const repeats)
+{
+    double const raw_mb = v.width()*v.height()*sizeof(typename View::value_type)/1e6;
+
+    cout << name << " (" << v.width() << "x" << v.height() << ", " << raw_mb << " MB raw)" << endl;
+    cout << "    " << setw(32) << left << "setting" << right << setw(12) << "size KB" << setw(10) << "ratio" << setw(12) << "MB/s" << endl;
+
+    vector<unsigned char> out;
+    for(auto params : settings) {
+
+        Clock::time_point start = Clock::now();
+        for(int r = 0; r < repeats; ++r)
+            EncodePng(v, params, out);
+        double sec = std::chrono::duration<double>(Clock::now() - start).count()/repeats;
+
+        cout << "    " << setw(32) << left << params.Name() << right << fixed << setprecision(1)
+             << setw(12) << out.size()/1024.0 << setw(10) << raw_mb*1e6/out.size() << setw(12) << raw_mb/sec << endl;
+        cout.unsetf(ios_base::floatfield);
+    }
+    cout << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////
+//  Main function
+////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+
+    int const w = 1024;
+    int const h = 1024;
+    int const repeats = 3;
+
+    vector<PngParams> settings;
+    int const levels[] = {0, 1, 3, 6, 9};
+    int const strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY};
+    int const filters[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_ALL_FILTERS};
+    for(auto level : levels)
+        for(auto strategy : strategies)
+            for(auto filter : filters)
+                settings.push_back(PngParams(level, strategy, filter));
+
+    gray8_image_t mask(w, h);
+    SynthMask(view(mask));
+    BenchSettings("Synthetic mask", const_view(mask), settings, repeats);
+
+    rgb8_image_t frame(w, h);
+    SynthFrame(view(frame));
+    BenchSettings("Synthetic frame", const_view(frame), settings, repeats);
+
+    /* Optionally benchmark real frames or masks */
+    for(int i = 1; i < argc; ++i) {
+        rgb8_image_t img;
+        try {
+            png_read_and_convert_image(argv[i], img);
+        } catch(std::exception& e) {
+            cerr << "Unable to read " << argv[i] << ": " << e.what() << endl;
+            continue;
+        }
+        BenchSettings(argv[i], const_view(img), settings, repeats);
+    }
+
+    /* Throughput of background encoding against the number of threads */
+    path const tmp_dir = temp_directory_path() / unique_path("png_bench_%%%%%%%%");
+    create_directories(tmp_dir);
+
+    int const num_frames = 32;
+    unsigned const max_threads = max(1u, std::thread::hardware_concurrency());
+    ImagePool<rgb8_image_t> frame_pool(16);
+
+    cout << "Background encoding of " << num_frames << " frames (" << PngParams::Frame().Name() << ")" << endl;
+    for(unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+
+        PngEncoder encoder(num_threads);
+
+        Clock::time_point start = Clock::now();
+        for(int f = 0; f < num_frames; ++f) {
+            ImagePool<rgb8_image_t>::Handle img = frame_pool.Acquire(w, h);
+            copy_pixels(const_view(frame), view(*img));
+
+            ostringstream oss;
+            oss << (tmp_dir / "frame_").string() << setw(5) << setfill('0') << f << ".png";
+            encoder.Write(oss.str(), std::move(img), PngParams::Frame());
+        }
+        encoder.Flush();
+        double sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+        cout << "    " << num_threads << " threads: " << fixed << setprecision(1)
+             << num_frames/sec << " fps, " << encoder.GetNumBytes()/1e6/sec << " MB/s" << endl;
+        cout.unsetf(ios_base::floatfield);
+    }
+
+    cout << "Pool hits/misses: " << frame_pool.GetNumHits() << "/" << frame_pool.GetNumMisses() << endl;
+
+    remove_all(tmp_dir);
+
+    return 0;
+}
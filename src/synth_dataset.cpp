@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/gil/gil_all.hpp>
+
+#include <bspline.h>
+#include <label_data.h>
+#include <image_pool.h>
+#include <png_encoder.h>
+
+using namespace boost::filesystem;
+using namespace boost::gil;
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+//! @brief Smoothly moving synthetic catheter
+/*!
+ * The rest shape is a random walk of num_knots knots entering from the left
+ * edge. Every knot then sways with a slow "respiratory" and a faster
+ * "cardiac" sinusoid of random phase, growing towards the tip, and the
+ * visible length follows a mean-reverting random walk so the tip advances
+ * and retracts smoothly.
+ */
+class SynthCatheter
+{
+public:
+    SynthCatheter(size_t const w, size_t const h, size_t const num_knots, unsigned const seed)
+        : w(w), h(h), rng(seed), rest_knots(2, num_knots), phases(4, num_knots), extent(0.8), extent_vel(0)
+    {
+        std::uniform_real_distribution<float> turn(-0.6, 0.6);
+        std::uniform_real_distribution<float> phase(0, 2*M_PI);
+
+        float const step = 0.9*w/max<size_t>(1, num_knots-1);
+        float heading = turn(rng)*0.5;
+        Vector2f pt(0, h*(0.3 + 0.4*phase(rng)/(2*M_PI)));
+
+        for(size_t k = 0; k < num_knots; ++k) {
+            rest_knots.col(k) = pt;
+            heading = 0.7*heading + turn(rng);
+            pt += step*Vector2f(cos(heading), sin(heading));
+            pt[1] = max(0.1f*h, min(0.9f*h, pt[1]));
+
+            for(int i = 0; i < phases.rows(); ++i)
+                phases(i, k) = phase(rng);
+        }
+    }
+
+    /* Knots of the given frame, the tip moves by at most a few pixels per frame */
+    Matrix<float,2,Dynamic> Knots(size_t const frame_idx)
+    {
+        std::normal_distribution<float> jerk(0, 0.004);
+        extent_vel = 0.9*extent_vel + 0.05*(0.8 - extent) + jerk(rng);
+        extent = max(0.3f, min(1.0f, extent + extent_vel));
+
+        size_t const num_knots = rest_knots.cols();
+        size_t const num_visible = max<size_t>(4, ceil(extent*num_knots));
+
+        float const t = frame_idx;
+        Matrix<float,2,Dynamic> knots(2, num_visible);
+        for(size_t k = 0; k < num_visible; ++k) {
+            float const amp = 2 + 10*float(k)/num_knots;
+            knots(0, k) = rest_knots(0, k) + amp*(0.6*sin(2*M_PI*t/120 + phases(0, k)) + 0.4*sin(2*M_PI*t/25 + phases(1, k)));
+            knots(1, k) = rest_knots(1, k) + amp*(0.6*sin(2*M_PI*t/120 + phases(2, k)) + 0.4*sin(2*M_PI*t/25 + phases(3, k)));
+            knots(0, k) = max(1.0f, min(w-2.0f, knots(0, k)));
+            knots(1, k) = max(1.0f, min(h-2.0f, knots(1, k)));
+        }
+
+        /* The last visible knot slides between its neighbours for continuous motion */
+        float const frac = extent*num_knots - (num_visible-1);
+        if(num_visible >= 2 && frac < 1)
+            knots.col(num_visible-1) = knots.col(num_visible-2) + max(0.2f, frac)*(knots.col(num_visible-1) - knots.col(num_visible-2));
+
+        return knots;
+    }
+
+private:
+    size_t w, h;
+    std::mt19937 rng;
+
+    Matrix<float,2,Dynamic> rest_knots;
+    Matrix<float,4,Dynamic> phases;
+
+    float extent;
+    float extent_vel;
+};
+
+/* Vignetted fluoroscopy-like background */
+void SynthBackground(gray8_view_t const& v)
+{
+    for(int y = 0; y < v.height(); ++y) {
+        for(int x = 0; x < v.width(); ++x) {
+            float dx = (x - v.width()/2.0)/v.width();
+            float dy = (y - v.height()/2.0)/v.height();
+            v(x, y) = max(0.0f, 170 - 160*(dx*dx + dy*dy));
+        }
+    }
+}
+
+/* Background, dark wire along the pixel chain and quantum noise */
+void SynthFrame(gray8c_view_t const& background, Pts const& pts, std::minstd_rand& rng, rgb8_view_t const& v)
+{
+    copy_and_convert_pixels(background, v);
+
+    for(auto const& pt : pts)
+        for(int y = pt[1]-1; y <= pt[1]+1; ++y)
+            for(int x = pt[0]-1; x <= pt[0]+1; ++x)
+                if(x >= 0 && y >= 0 && x < v.width() && y < v.height())
+                    v(x, y) = rgb8_pixel_t(60, 60, 60);
+
+    std::uniform_int_distribution<int> noise(-12, 12);
+    for(int y = 0; y < v.height(); ++y) {
+        rgb8_view_t::x_iterator itr = v.row_begin(y);
+        for(int x = 0; x < v.width(); ++x) {
+            unsigned char c = max(0, min(255, itr[x][0] + noise(rng)));
+            itr[x] = rgb8_pixel_t(c, c, c);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+//  Main function
+////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+
+    if(argc < 2) {
+        cerr << "Usage: " << argv[0] << " <output dir> [num frames = 1000] [width = 512] [height = 512] [num knots = 12] [num labelled = all] [seed = 0]" << endl;
+        exit(1);
+    }
+
+    string const dir = argv[1];
+    size_t const num_frames = argc > 2 ? atoi(argv[2]) : 1000;
+    size_t const w = argc > 3 ? atoi(argv[3]) : 512;
+    size_t const h = argc > 4 ? atoi(argv[4]) : 512;
+    size_t const num_knots = argc > 5 ? max(4, atoi(argv[5])) : 12;
+    size_t const num_labelled = argc > 6 ? min<size_t>(atoi(argv[6]), num_frames) : num_frames;
+    unsigned const seed = argc > 7 ? atoi(argv[7]) : 0;
+
+    if(num_frames == 0 || w < 16 || h < 16) {
+        cerr << argv[0] << ": invalid sequence size" << endl;
+        exit(1);
+    }
+
+    create_directories(dir);
+
+    gray8_image_t background(w, h);
+    SynthBackground(view(background));
+
+    SynthCatheter catheter(w, h, num_knots, seed);
+    std::minstd_rand noise_rng(seed);
+
+    ImagePool<rgb8_image_t> frame_pool(16);
+    PngEncoder png_encoder;
+
+    LabelData label_data;
+    size_t num_body_pts = 0;
+
+    Clock::time_point start = Clock::now();
+    for(size_t f = 0; f < num_frames; ++f) {
+
+        Bspline<float,2> bspline;
+        bspline.AddBackKnotPts(catheter.Knots(f));
+        Pts const pts = GetContinuousPts(bspline);
+
+        ImagePool<rgb8_image_t>::Handle img = frame_pool.Acquire(w, h);
+        SynthFrame(const_view(background), pts, noise_rng, view(*img));
+
+        ostringstream oss;
+        oss << dir << "/frame_" << setw(5) << setfill('0') << f << ".png";
+        png_encoder.Write(oss.str(), std::move(img), PngParams::Frame());
+
+        if(f < num_labelled) {
+            label_data.push_back(FrameLabel(pts.begin(), pts.end()));
+            num_body_pts += pts.size();
+        }
+
+        if((f+1)%100 == 0)
+            cout << "\r" << f+1 << "/" << num_frames << " frames" << flush;
+    }
+
+    png_encoder.Flush();
+
+    if(num_labelled > 0 && !WriteCSVFile(dir + "/label.csv", label_data)) {
+        cerr << argv[0] << ": unable to write " << dir << "/label.csv" << endl;
+        exit(1);
+    }
+
+    double const sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+    cout << "\r" << num_frames << " frames of " << w << "x" << h << " written to " << dir << " in " << fixed << setprecision(1) << sec << " s, "
+         << num_labelled << " labelled with " << (num_labelled > 0 ? num_body_pts/num_labelled : 0) << " body points on average" << endl;
+
+    return png_encoder.GetNumFailed() == 0 ? 0 : 1;
+}
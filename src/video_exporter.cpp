@@ -1,4 +1,8 @@
 #include <iomanip>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <chrono>
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -9,12 +13,17 @@
 
 #include <extra/pango_display.h>
 #include <extra/pango_drawer.h>
+#include <extra/pango_pbo.h>
 
 #include <boost/gil/gil_all.hpp>
 #define png_infopp_NULL (png_infopp)NULL
 #define int_p_NULL (int*)NULL
 #include <boost/gil/extension/io/png_io.hpp>
 
+#include <image_pool.h>
+#include <png_encoder.h>
+#include <stage_timer.h>
+
 using namespace boost::filesystem;
 
 using namespace pangolin;
@@ -37,17 +46,59 @@ void SetGLFormat(GLint& glchannels, GLenum& glformat, const pangolin::VideoPixel
     }
 }
 
-void ExportViewport(string const img_name, Viewport const& viewport)
+/* Grab the next sampled frame, skipping the ones in between, safe to run off the GL thread */
+int GrabSampledFrame(pangolin::VideoInput& video, unsigned char* dst, int const sample_rate, StageStats& stats)
+{
+    ScopedTimer timer(stats);
+
+    if(!video.GrabNext(dst, true))
+        return 0;
+
+    int num_grabbed = 1;
+    for(int i = 0; i < sample_rate-1; ++i)
+        if(video.GrabNext(dst, true))
+            ++num_grabbed;
+
+    return num_grabbed;
+}
+
+/* enqueue_sec accumulates the time the readback callback waits for room in the encoder queue */
+void ExportViewport(PboReader& reader, PngEncoder& encoder, ImagePool<boost::gil::rgb8_image_t>& pool, PngParams const& params,
+                    string const img_name, Viewport const& viewport, double& enqueue_sec)
 {
 
-    boost::gil::rgb8_image_t img(viewport.w, viewport.h);
     glReadBuffer(GL_FRONT);
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(viewport.l, viewport.b, viewport.w, viewport.h, GL_RGB, GL_UNSIGNED_BYTE, boost::gil::interleaved_view_get_raw_data( boost::gil::view(img)));
-    boost::gil::png_write_view(img_name, flipped_up_down_view(boost::gil::const_view(img)));
+    reader.Read(viewport, [&encoder, &pool, &enqueue_sec, params, img_name](unsigned char const* data, Viewport const& vp) {
+        /* Copy out of the mapped buffer so encoding can happen in the background */
+        ImagePool<boost::gil::rgb8_image_t>::Handle img = pool.Acquire(vp.w, vp.h);
+        boost::gil::copy_pixels(flipped_up_down_view(boost::gil::interleaved_view(vp.w, vp.h, (boost::gil::rgb8_pixel_t const*)data, vp.w*3)), boost::gil::view(*img));
+        std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+        encoder.Write(img_name, std::move(img), params);
+        enqueue_sec += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    });
 
 }
 
+void WriteExportSummary(ostream& out, string const& video_file, string const& output_dir, int const sample_rate,
+                        size_t const frames_decoded, size_t const frames_skipped, size_t const frames_written, size_t const frames_failed,
+                        double const elapsed, StageProfiler& profiler)
+{
+    out << "{" << endl;
+    out << "  \"video\": " << StageProfiler::JsonQuote(video_file) << "," << endl;
+    out << "  \"output_dir\": " << StageProfiler::JsonQuote(output_dir) << "," << endl;
+    out << "  \"sample_rate\": " << sample_rate << "," << endl;
+    out << "  \"frames_decoded\": " << frames_decoded << "," << endl;
+    out << "  \"frames_skipped\": " << frames_skipped << "," << endl;
+    out << "  \"frames_written\": " << frames_written << "," << endl;
+    out << "  \"frames_failed\": " << frames_failed << "," << endl;
+    out << "  \"elapsed_s\": " << elapsed << "," << endl;
+    out << "  \"fps\": " << (elapsed > 0 ? frames_written/elapsed : 0) << "," << endl;
+    out << "  \"stages\": ";
+    profiler.WriteJson(out, "  ");
+    out << endl << "}" << endl;
+}
+
 int main(int argc, char* argv[])
 {
 
@@ -71,8 +122,10 @@ int main(int argc, char* argv[])
     pangolin::View& container = SetupPangoGL(w, h, ui_width, "Video Exporter");
     SetupContainer(container, 1, (float)w/h);
 
+    /* Frames are exported as shown, so the view stays fitted to the frame */
+    ViewTransform2D frame_view(w, h);
     pangolin::GlTexture frame_tex(w, h);
-    DrawTexture tex_drawer(frame_tex);
+    DrawTexture tex_drawer(frame_view, frame_tex);
 
     DrawingRoutine draw_routine;
     draw_routine.draw_funcs.push_back(std::ref(tex_drawer));
@@ -81,15 +134,64 @@ int main(int argc, char* argv[])
 
     Var<int> sample_rate("ui.Sample Rate", 10, 1, 100);
     Var<int> num_export_frames("ui.Frames to Export", 10000, 1, 10000);
+    Var<int> png_level("ui.PNG Level", 3, 0, 9);
     Var<int> frame_cur_idx("ui.Frame Idx");
     frame_cur_idx = 0;
 
     Var<bool> button_export_frames("ui.Export Frames", false, false);
     Var<bool> button_exist("ui.Exist", false, false);
 
-    unsigned char* frame_buf = new unsigned char[video.SizeBytes()];
-    if(video.GrabNext(frame_buf, true))
-        frame_tex.Upload(frame_buf, glchannels, glformat);
+    /* Throughput and per-stage latency p50/p99 */
+    Var<int> frames_decoded("ui.Frames Decoded");
+    Var<int> frames_skipped("ui.Frames Skipped");
+    Var<int> frames_written("ui.Frames Written");
+    Var<float> export_fps("ui.Export FPS");
+    Var<string> time_decode("ui.Decode");
+    Var<string> time_upload("ui.Upload");
+    Var<string> time_readback("ui.Readback");
+    Var<string> time_encode("ui.PNG Encode");
+    Var<string> time_fs_write("ui.FS Write");
+
+    StageProfiler profiler;
+    int num_decoded = 0;
+    int num_skipped = 0;
+    std::chrono::steady_clock::time_point export_start;
+    double export_elapsed = 0;
+    string output_dir;
+
+    /* Frames are grabbed in the background directly into a mapped PBO */
+    PboUploader frame_uploader(frame_tex, glchannels, glformat, video.SizeBytes());
+    if(video.GrabNext(frame_uploader.Map(), true))
+        frame_uploader.Upload();
+    else
+        frame_uploader.Cancel();
+
+    /* Viewport readbacks overlap the rendering of the following frame, encoding happens in the background */
+    ImagePool<boost::gil::rgb8_image_t> frame_pool(16);
+    PngEncoder png_encoder(0, 8, &profiler);
+    PboReader frame_reader;
+
+    /* Readback covers fence waits, maps and copies; time its callbacks spend blocked on the encoder queue is left out */
+    double enqueue_sec = 0;
+    auto timed_readback = [&](std::function<void()> const& f) {
+        double const enqueue_before = enqueue_sec;
+        std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+        f();
+        profiler["readback"].Add(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - (enqueue_sec - enqueue_before));
+    };
+
+    auto update_report = [&]() {
+        export_elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - export_start).count();
+        frames_decoded = num_decoded;
+        frames_skipped = num_skipped;
+        frames_written = png_encoder.GetNumWritten();
+        export_fps = export_elapsed > 0 ? png_encoder.GetNumWritten()/export_elapsed : 0;
+        time_decode = profiler.Summary("decode");
+        time_upload = profiler.Summary("upload");
+        time_readback = profiler.Summary("readback");
+        time_encode = profiler.Summary("encode");
+        time_fs_write = profiler.Summary("fs write");
+    };
 
     while(!pangolin::ShouldQuit())
     {
@@ -106,34 +208,58 @@ int main(int argc, char* argv[])
                 boost::filesystem::create_directories(path(oss_output_dir.str()));
 
             cout << "Export video images to " << oss_output_dir.str() << endl;
+            output_dir = oss_output_dir.str();
+            export_start = std::chrono::steady_clock::now();
+            num_decoded = 1;
 
             /* Export the very fast frame */
             ostringstream oss_output_img;
             oss_output_img << oss_output_dir.str() << "/frame_" << setw(5) << setfill('0') << (int)frame_cur_idx << ".png";
-            ExportViewport(oss_output_img.str(), container[0].v);
+            timed_readback([&]() {
+                ExportViewport(frame_reader, png_encoder, frame_pool, PngParams::Frame(png_level), oss_output_img.str(), container[0].v, enqueue_sec);
+            });
 
             frame_cur_idx = frame_cur_idx + sample_rate;
             int lock_sample_rate = sample_rate;
 
-            while(video.GrabNext(frame_buf, true)) {
+            /* Grab frame N+1 while frame N is rendered and exported */
+            std::future<int> pending_frame = std::async(std::launch::async, GrabSampledFrame, std::ref(video), frame_uploader.Map(), lock_sample_rate, std::ref(profiler["decode"]));
+
+            for(int num_grabbed; (num_grabbed = pending_frame.get()) > 0; ) {
 
-                for(int i = 0; i < sample_rate-1; ++i)
-                    video.GrabNext(frame_buf, true);
+                num_decoded += num_grabbed;
+                num_skipped += num_grabbed-1;
 
-                frame_tex.Upload(frame_buf, glchannels, glformat);
+                {
+                    ScopedTimer timer(profiler["upload"]);
+                    frame_uploader.Upload();
+                }
+                pending_frame = std::async(std::launch::async, GrabSampledFrame, std::ref(video), frame_uploader.Map(), lock_sample_rate, std::ref(profiler["decode"]));
+
+                update_report();
                 pangolin::FinishFrame();
 
                 oss_output_img.str("");
                 oss_output_img << oss_output_dir.str() << "/frame_" << setw(5) << setfill('0') << (int)frame_cur_idx << ".png";
-                ExportViewport(oss_output_img.str(), container[0].v);
+                timed_readback([&]() {
+                    ExportViewport(frame_reader, png_encoder, frame_pool, PngParams::Frame(png_level), oss_output_img.str(), container[0].v, enqueue_sec);
+                    frame_reader.Poll();
+                });
 
                 frame_cur_idx = frame_cur_idx + sample_rate;
                 sample_rate = lock_sample_rate;
 
-                if(Pushed(button_exist) || frame_cur_idx == num_export_frames)
+                if(Pushed(button_exist) || frame_cur_idx == num_export_frames) {
+                    pending_frame.wait();
                     break;
+                }
             }
 
+            frame_uploader.Cancel();
+            timed_readback([&]() { frame_reader.Flush(); });
+            png_encoder.Flush();
+            update_report();
+
             pangolin::Quit();
         }
 
@@ -145,7 +271,18 @@ int main(int argc, char* argv[])
 
     }
 
-    delete [] frame_buf;
+    if(!output_dir.empty()) {
+        ostringstream oss_summary;
+        WriteExportSummary(oss_summary, argv[1], output_dir, sample_rate, num_decoded, num_skipped,
+                           png_encoder.GetNumWritten(), png_encoder.GetNumFailed(), export_elapsed, profiler);
+
+        cout << oss_summary.str();
+
+        ofstream fout((output_dir + "/export_summary.json").c_str());
+        if(fout << oss_summary.str())
+            cout << "Write: " << output_dir << "/export_summary.json" << endl;
+    }
+
     return 0;
 
 }
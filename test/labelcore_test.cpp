@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include <biplane.h>
+#include <bspline.h>
+#include <edit_history.h>
+#include <knot_journal.h>
+#include <label_data.h>
+#include <sparse_mask.h>
+
+using namespace std;
+
+/* Checks of the labelling core, run by ctest; exits non-zero on the first failed check */
+
+static int num_checks = 0;
+
+#define CHECK(cond) \
+    do { \
+        ++num_checks; \
+        if(!(cond)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+bool SameFrame(FrameLabel const& a, FrameLabel const& b)
+{
+    if(a.GetNumCurves() != b.GetNumCurves())
+        return false;
+
+    for(size_t c = 0; c < a.GetNumCurves(); ++c)
+        if(a.GetClassId(c) != b.GetClassId(c) || a.CurveEnd(c) - a.CurveBegin(c) != b.CurveEnd(c) - b.CurveBegin(c) ||
+           !equal(a.CurveBegin(c), a.CurveEnd(c), b.CurveBegin(c)))
+            return false;
+
+    return true;
+}
+
+bool SameLabelData(LabelData const& a, LabelData const& b)
+{
+    if(a.size() != b.size())
+        return false;
+
+    for(size_t f = 0; f < a.size(); ++f)
+        if(!SameFrame(a[f], b[f]))
+            return false;
+
+    return true;
+}
+
+void WriteTextFile(string const& file, string const& text)
+{
+    FILE* fout = fopen(file.c_str(), "w");
+    CHECK(fout != NULL);
+    fputs(text.c_str(), fout);
+    CHECK(fclose(fout) == 0);
+}
+
+/* Exact comparison of the knots, whatever their number */
+bool HasKnots(Bspline<float,2> const& bspline, Matrix<float,2,Dynamic> const& knots)
+{
+    Matrix<float,2,Dynamic> const pts = bspline.GetKnotPts();
+    return pts.cols() == knots.cols() && pts == knots;
+}
+
+/* label.csv with class ids survives a write and parse unchanged, including frames without curves */
+void TestCSVRoundTrip(string const& dir)
+{
+    vector<Vector2i> const wire = {Vector2i(1, 2), Vector2i(2, 3), Vector2i(3, 3)};
+    vector<Vector2i> const catheter = {Vector2i(10, 10), Vector2i(11, 9)};
+
+    LabelData label_data(3);
+    label_data[0].AddCurve(1, wire.begin(), wire.end());
+    label_data[2].AddCurve(1, wire.begin(), wire.end());
+    label_data[2].AddCurve(3, catheter.begin(), catheter.end());
+
+    string const csv_file = dir + "/label.csv";
+    CHECK(WriteCSVFile(csv_file, label_data));
+    CHECK(!boost::filesystem::exists(csv_file + ".tmp"));
+
+    bool has_class_id = false;
+    LabelData const parsed = ParseCSVFile(csv_file, &has_class_id);
+    CHECK(has_class_id);
+    CHECK(SameLabelData(parsed, label_data));
+
+    /* Appending a frame is the same as writing them all */
+    FrameLabel const frame(catheter.begin(), catheter.end(), 2);
+    CHECK(AppendCSVFrame(csv_file, label_data.size(), frame));
+    label_data.push_back(frame);
+    CHECK(SameLabelData(ParseCSVFile(csv_file), label_data));
+}
+
+/* label.csv without the class_id column reads every curve as class 1 and is rewritten with it */
+void TestCSVOldFormat(string const& dir)
+{
+    string const csv_file = dir + "/label.csv";
+    WriteTextFile(csv_file,
+                  "frame_idx,\ttip_xy,\tbase_xy,\tnum_body_pt,\tbody_xy\n"
+                  "0,\t3 3,\t1 2,\t3,\t1 2 2 3 3 3 \n"
+                  "1,\t,\t,\t,\t\n"
+                  "2,\t11 9,\t10 10,\t2,\t10 10 11 9 \n");
+
+    bool has_class_id = true;
+    LabelData const parsed = ParseCSVFile(csv_file, &has_class_id);
+    CHECK(!has_class_id);
+    CHECK(parsed.size() == 3);
+    CHECK(parsed[0].GetNumCurves() == 1 && parsed[0].GetNumPts() == 3 && parsed[0].GetClassId(0) == 1);
+    CHECK(parsed[1].GetNumCurves() == 0);
+    CHECK(parsed[2].GetNumCurves() == 1 && parsed[2].GetClassId(0) == 1);
+    CHECK(*parsed[2].CurveBegin(0) == Vector2i(10, 10));
+
+    CHECK(WriteCSVFile(csv_file, parsed));
+    LabelData const rewritten = ParseCSVFile(csv_file, &has_class_id);
+    CHECK(has_class_id);
+    CHECK(SameLabelData(rewritten, parsed));
+}
+
+/* Consecutive pixels are distinct 8-neighbours and the chain never steps back onto the pixel before */
+template<typename Chain>
+void CheckChain(Chain const& chain)
+{
+    CHECK(chain.size() > 1);
+    vector<Vector2i> const pts(chain.begin(), chain.end());
+    for(size_t i = 1; i < pts.size(); ++i) {
+        Vector2i const step = pts[i] - pts[i-1];
+        CHECK(step != Vector2i::Zero());
+        CHECK(abs(step[0]) <= 1 && abs(step[1]) <= 1);
+        if(i >= 2)
+            CHECK(pts[i] != pts[i-2]);
+    }
+}
+
+void TestRasterisePts()
+{
+    Bspline<float,2> bspline;
+    Matrix<float,2,Dynamic> knots(2, 5);
+    knots << 10.6, 40.6, 70.1, 60.4, 20.8,
+             10.7, 12.7, 50.5, 90.3, 95.6;
+    bspline.AddBackKnotPts(knots);
+
+    /* Uniform and adaptive sampling, open and closed */
+    for(int closed = 0; closed < 2; ++closed) {
+        bspline.SetBsplineType(closed ? Bspline<float,2>::CLOSED : Bspline<float,2>::OPEN);
+        for(float const tolerance : {0.0f, 0.25f, 1.0f}) {
+            vector<Vector2i> chain;
+            RasterisePts(bspline, back_inserter(chain), tolerance);
+            CheckChain(chain);
+
+            /* Pixel centres are at integer coordinates, the chain starts on the pixel of the first knot */
+            CHECK(chain.front() == Vector2i(11, 11));
+        }
+    }
+
+    /* Samples far apart are bridged along the major axis */
+    vector<Vector2i> bridged;
+    PixelChainWriter<back_insert_iterator<vector<Vector2i> > > writer(back_inserter(bridged));
+    writer = Vector2f(0.0f, 0.0f);
+    writer = Vector2f(7.0f, -3.0f);
+    writer = Vector2f(6.6f, 9.4f);
+    CheckChain(bridged);
+    CHECK(bridged.back() == Vector2i(7, 9));
+}
+
+/* Only frame*.png files, in name order */
+void TestFindFrameFiles(string const& dir)
+{
+    string const frame_dir = dir + "/images";
+    boost::filesystem::create_directory(frame_dir);
+    for(char const* name : {"frame_00010.png", "frame_00002.png", "label_00001.png", "frame_00001.png", "notes.txt", "frame_00003.jpg"})
+        WriteTextFile(frame_dir + "/" + name, "");
+    boost::filesystem::create_directory(frame_dir + "/frame_00004.png");
+
+    vector<string> const img_files = FindFrameFiles(frame_dir);
+    CHECK(img_files.size() == 3);
+    CHECK(img_files[0] == "frame_00001.png");
+    CHECK(img_files[1] == "frame_00002.png");
+    CHECK(img_files[2] == "frame_00010.png");
+}
+
+/* Chains with neighbour steps, gaps and repeated pixels decode as written; a corrupt escape count is rejected */
+void TestSparseMask(string const& dir)
+{
+    vector<Vector2i> const wire = {Vector2i(5, 5), Vector2i(6, 5), Vector2i(7, 6), Vector2i(7, 6), Vector2i(20, 3), Vector2i(19, 2)};
+    vector<Vector2i> const dot = {Vector2i(0, 0)};
+
+    SparseMask mask(32, 24);
+    mask.AddChain(wire.begin(), wire.end(), 255);
+    mask.AddChain(dot.begin(), dot.end(), 2);
+
+    string const mask_file = dir + "/label_00000.lcm";
+    CHECK(mask.Write(mask_file));
+
+    SparseMask read_mask;
+    CHECK(read_mask.Read(mask_file));
+    CHECK(read_mask.Width() == 32 && read_mask.Height() == 24);
+    CHECK(read_mask.GetNumChains() == 2);
+    CHECK(read_mask.GetValue(0) == 255 && read_mask.GetValue(1) == 2);
+
+    vector<Vector2i> decoded;
+    read_mask.DecodeChain(0, back_inserter(decoded));
+    CHECK(decoded == wire);
+
+    decoded.clear();
+    read_mask.DecodeChain(1, back_inserter(decoded));
+    CHECK(decoded == dot);
+
+    /* Turn the first code of the wire, a neighbour step, into an escape without an escape */
+    FILE* fmask = fopen(mask_file.c_str(), "r+b");
+    CHECK(fmask != NULL);
+    unsigned char code;
+    CHECK(fseek(fmask, 18 + 21, SEEK_SET) == 0 && fread(&code, 1, 1, fmask) == 1);
+    code = (code & 0xf0) | 8;
+    CHECK(fseek(fmask, 18 + 21, SEEK_SET) == 0 && fwrite(&code, 1, 1, fmask) == 1);
+    CHECK(fclose(fmask) == 0);
+
+    CHECK(!read_mask.Read(mask_file));
+}
+
+/* Edits replay in order across curves, a torn last line is ignored and a rewrite replays to the same curves */
+void TestKnotJournal(string const& dir)
+{
+    string const journal_file = dir + "/knots.journal";
+
+    {
+        KnotJournal journal;
+        CHECK(journal.Open(journal_file));
+        journal.AddBack(Vector2f(1, 2));
+        journal.AddBack(Vector2f(5, 6));
+        journal.Insert(1, Vector2f(3, 4));
+        journal.Set(2, Vector2f(7, 8));
+        journal.Set(2, Vector2f(9, 10));
+        journal.AddBack(Vector2f(11, 12));
+        journal.RemoveBack();
+
+        /* A second curve of class 2, a third removed again, then the first relabelled */
+        journal.AddCurve(2);
+        journal.AddBack(Vector2f(20, 21));
+        journal.AddBack(Vector2f(22, 23));
+        journal.SetClosed(true);
+        journal.AddCurve(5);
+        journal.AddBack(Vector2f(30, 31));
+        journal.RemoveLastCurve();
+        journal.SelectCurve(0);
+        journal.SetClass(3);
+        journal.Export(4);
+        CHECK(journal.Flush());
+    }
+
+    Matrix<float,2,Dynamic> expected(2, 3);
+    expected << 1, 3, 9,
+                2, 4, 10;
+    Matrix<float,2,Dynamic> expected_second(2, 2);
+    expected_second << 20, 22,
+                       21, 23;
+
+    auto check_curves = [&](deque<LabelCurve> const& curves, size_t const current_curve) {
+        CHECK(curves.size() == 2);
+        CHECK(current_curve == 0);
+        CHECK(curves[0].class_id == 3);
+        CHECK(HasKnots(curves[0].bspline, expected));
+        CHECK(curves[1].class_id == 2);
+        CHECK(HasKnots(curves[1].bspline, expected_second));
+        CHECK((curves[0].bspline.type == Bspline<float,2>::OPEN));
+        CHECK((curves[1].bspline.type == Bspline<float,2>::CLOSED));
+    };
+
+    deque<LabelCurve> curves;
+    size_t current_curve;
+    int last_export;
+    size_t const num_applied = KnotJournal::Replay(journal_file, curves, &current_curve, &last_export);
+    CHECK(num_applied > 0);
+    CHECK(last_export == 4);
+    check_curves(curves, current_curve);
+
+    /* A crash in the middle of a record leaves a line without its newline */
+    FILE* fout = fopen(journal_file.c_str(), "a");
+    CHECK(fout != NULL);
+    fputs("A 13 1", fout);
+    CHECK(fclose(fout) == 0);
+
+    deque<LabelCurve> replayed;
+    CHECK(KnotJournal::Replay(journal_file, replayed, &current_curve) == num_applied);
+    check_curves(replayed, current_curve);
+
+    /* Replay also stops at a line it cannot parse, here a curve that does not exist */
+    WriteTextFile(journal_file, "A 1 2\nA 3 4\nC 7\nA 5 6\n");
+    deque<LabelCurve> stopped;
+    CHECK(KnotJournal::Replay(journal_file, stopped) == 2);
+    CHECK(stopped.size() == 1 && stopped[0].bspline.GetNumKnotPts() == 2);
+
+    /* A snapshot replays to the same curves, and later edits append to it */
+    {
+        KnotJournal journal;
+        CHECK(journal.Rewrite(journal_file, replayed, 1));
+        journal.AddBack(Vector2f(13.5, 14.25));
+        CHECK(journal.Flush());
+    }
+
+    deque<LabelCurve> rewritten;
+    CHECK(KnotJournal::Replay(journal_file, rewritten, &current_curve) > 0);
+    CHECK(current_curve == 1);
+    CHECK(rewritten[1].bspline.GetBackKnotPt() == Vector2f(13.5, 14.25));
+    rewritten[1].bspline.RemoveBackKnotPt();
+    check_curves(rewritten, 0);
+    CHECK(!boost::filesystem::exists(journal_file + ".tmp"));
+}
+
+/* Undoing a knot edit restores the knots exactly, and the history accounts for the memory it holds */
+void TestEditHistory()
+{
+    Bspline<float,2> bspline;
+    Matrix<float,2,Dynamic> knots(2, 4);
+    knots << 1.5, 10.25, 20, 30.75,
+             2.5, 12.5, 18, 40.125;
+    bspline.AddBackKnotPts(knots);
+
+    Matrix<float,2,Dynamic> moved = knots;
+    moved.col(1) += Vector2f(0.5, -1);
+    moved.col(3) += Vector2f(2, 3);
+    Matrix<float,2,Dynamic> const none(2, 0);
+
+    vector<LabelEdit> const edits = {
+        LabelEdit::InsertKnot(2, Vector2f(15.5, 16.5)),
+        LabelEdit::EraseKnot(1, knots.col(1)),
+        LabelEdit::MoveKnots(knots, moved),
+        LabelEdit::MoveKnot(0, knots.col(0), Vector2f(-1, -2)),
+        LabelEdit::ReplaceKnots(knots, moved.leftCols(2)),
+        LabelEdit::ReplaceKnots(knots, none),
+    };
+
+    for(auto const& edit : edits) {
+        edit.Apply(bspline, true);
+        CHECK(!HasKnots(bspline, knots));
+        edit.Apply(bspline, false);
+        CHECK(HasKnots(bspline, knots));
+    }
+
+    /* A move keeps only the knots it moved */
+    CHECK(edits[2].knot_idx.size() == 2);
+    CHECK(HasKnots(bspline, knots));
+    edits[2].Apply(bspline, true);
+    CHECK(HasKnots(bspline, moved));
+    edits[2].Apply(bspline, false);
+
+    vector<Vector2i> const chain = {Vector2i(1, 1), Vector2i(2, 2)};
+    LabelEdit const export_edit = LabelEdit::ExportFrame(3, FrameLabel(chain.begin(), chain.end()));
+
+    EditHistory history(3);
+    auto undo_bytes = [&]() {
+        size_t const num_undo = history.GetNumUndo();
+        size_t bytes = 0;
+        for(size_t i = 0; i < num_undo; ++i)
+            bytes += history.Undo()->MemoryBytes();
+        for(size_t i = 0; i < num_undo; ++i)
+            history.Redo();
+        return bytes;
+    };
+
+    /* An empty edit is not recorded */
+    history.Record(LabelEdit::MoveKnots(knots, knots));
+    CHECK(!history.CanUndo() && history.GetMemoryBytes() == 0);
+
+    history.Record(edits[0]);
+    history.Record(edits[2]);
+    history.Record(export_edit);
+    CHECK(history.GetNumUndo() == 3);
+    CHECK(history.GetMemoryBytes() == edits[0].MemoryBytes() + edits[2].MemoryBytes() + export_edit.MemoryBytes());
+
+    /* Undo and redo move edits between the stacks, the memory held stays the same */
+    CHECK(history.Undo()->type == LabelEdit::EXPORT_FRAME);
+    CHECK(history.Undo()->type == LabelEdit::MOVE_KNOTS);
+    CHECK(history.GetNumUndo() == 1 && history.GetNumRedo() == 2);
+    CHECK(history.GetMemoryBytes() == edits[0].MemoryBytes() + edits[2].MemoryBytes() + export_edit.MemoryBytes());
+    CHECK(history.Redo()->type == LabelEdit::MOVE_KNOTS);
+
+    /* Recording drops what was left to redo */
+    history.Record(edits[1]);
+    CHECK(!history.CanRedo() && history.Redo() == NULL);
+    CHECK(history.GetNumUndo() == 3);
+    CHECK(history.GetMemoryBytes() == edits[0].MemoryBytes() + edits[2].MemoryBytes() + edits[1].MemoryBytes());
+    CHECK(history.GetMemoryBytes() == undo_bytes());
+
+    /* Beyond max_edits the oldest goes */
+    history.Record(edits[4]);
+    CHECK(history.GetNumUndo() == 3);
+    CHECK(history.GetMemoryBytes() == edits[2].MemoryBytes() + edits[1].MemoryBytes() + edits[4].MemoryBytes());
+    CHECK(history.GetMemoryBytes() == undo_bytes());
+
+    history.Clear();
+    CHECK(!history.CanUndo() && !history.CanRedo() && history.GetMemoryBytes() == 0);
+}
+
+/* A closed curve passes through every knot and ends where it starts */
+void TestClosedSpline()
+{
+    Bspline<float,2> bspline;
+    Matrix<float,2,Dynamic> knots(2, 7);
+    for(int k = 0; k < 7; ++k)
+        knots.col(k) = Vector2f(50, 50) + Vector2f(30 + 5*(k%2), 0).norm()*Vector2f(cos(2*M_PI*k/7), sin(2*M_PI*k/7));
+    bspline.AddBackKnotPts(knots);
+    bspline.SetBsplineType(Bspline<float,2>::CLOSED);
+    CHECK(bspline.IsReady());
+
+    vector<Vector2f> samples;
+    bspline.SampleUniform(0.5f, back_inserter(samples));
+    CHECK(samples.size() > 2);
+    CHECK((samples.front() - knots.col(0)).norm() < 1e-3f);
+    CHECK((samples.back() - knots.col(0)).norm() < 1e-3f);
+
+    /* Every knot starts a segment */
+    auto check_knots = [&]() {
+        for(int k = 0; k < 7; ++k) {
+            float dist = INFINITY;
+            for(int seg = 0; seg < 7; ++seg)
+                dist = min(dist, (bspline.CubicIntplt(seg, 0) - knots.col(k)).norm());
+            CHECK(dist < 1e-3f);
+        }
+    };
+    check_knots();
+
+    /* Moving a knot keeps the curve through all of them */
+    bspline.SetKnotPt(3, Vector2f(40, 90));
+    knots.col(3) = Vector2f(40, 90);
+    check_knots();
+}
+
+/* Knots clicked in both planes of a synthetic calibration triangulate back to the world point */
+void TestBiplane(string const& dir)
+{
+    /* Plane A looks down z, plane B down x, 1000 px focal length and centre (256, 256) */
+    ProjMatrix proj[2];
+    Matrix3f K;
+    K << 1000, 0, 256,
+         0, 1000, 256,
+         0, 0, 1;
+    Matrix<float,3,4> Rt_a, Rt_b;
+    Rt_a << 1, 0, 0, 0,
+            0, 1, 0, 0,
+            0, 0, 1, 800;
+    Rt_b << 0, 0, -1, 0,
+            0, 1, 0, 0,
+            1, 0, 0, 900;
+    proj[0] = K*Rt_a;
+    proj[1] = K*Rt_b;
+
+    string const calib_file = dir + "/calibration.txt";
+    FILE* fout = fopen(calib_file.c_str(), "w");
+    CHECK(fout != NULL);
+    fprintf(fout, "# plane A\n");
+    for(int v = 0; v < 2; ++v)
+        for(int r = 0; r < 3; ++r)
+            fprintf(fout, "%.9g %.9g %.9g %.9g\n", proj[v](r, 0), proj[v](r, 1), proj[v](r, 2), proj[v](r, 3));
+    CHECK(fclose(fout) == 0);
+
+    ProjMatrix read_proj[2];
+    CHECK(ReadBiplaneCalibration(calib_file, read_proj));
+    CHECK(read_proj[0] == proj[0] && read_proj[1] == proj[1]);
+
+    Vector3f const world_pts[3] = {Vector3f(0, 0, 0), Vector3f(12.5, -20.25, 31), Vector3f(-40, 35, -15.5)};
+    for(auto const& world_pt : world_pts) {
+        Vector2f const pt_a = Project(proj[0], world_pt);
+        Vector2f const pt_b = Project(proj[1], world_pt);
+
+        float reproj_error;
+        Vector3f const triangulated = Triangulate(proj[0], pt_a, proj[1], pt_b, &reproj_error);
+        CHECK((triangulated - world_pt).norm() < 1e-3f);
+        CHECK(reproj_error < 1e-2f);
+
+        /* The point seen in B lies on the epipolar line of its view in A, and the other way round */
+        Vector3f const line_b = EpipolarLine(proj[0], pt_a, proj[1]);
+        CHECK(fabs(line_b.head<2>().norm() - 1) < 1e-4f);
+        CHECK(fabs(line_b.dot(pt_b.homogeneous())) < 1e-2f);
+        CHECK((ClosestOnLine(line_b, pt_b) - pt_b).norm() < 1e-2f);
+
+        Vector3f const line_a = EpipolarLine(proj[1], pt_b, proj[0]);
+        CHECK(fabs(line_a.dot(pt_a.homogeneous())) < 1e-2f);
+    }
+
+    /* label3d.csv keeps the knots to float precision */
+    Bspline<float,3> bspline;
+    Matrix<float,3,Dynamic> knots(3, 4);
+    knots << 12.345678, -20.25, 31.000002, 123456.79,
+             0.1, 1e-7, -35.123457, 7,
+             -15.5, 3.3333333, 0, -0.00012345678;
+    bspline.AddBackKnotPts(knots);
+    bspline.SetBsplineType(Bspline<float,3>::CLOSED);
+
+    string const csv3d_file = dir + "/label3d.csv";
+    CHECK(AppendCSV3DFrame(csv3d_file, 0, bspline));
+    CHECK(AppendCSV3DFrame(csv3d_file, 1, bspline));
+
+    size_t num_rows = 0;
+    CHECK(ForEachCSV3DRow(csv3d_file, [&](size_t const frame_idx, bool const closed, Matrix<float,3,Dynamic> const& read_knots) {
+        CHECK(frame_idx == num_rows);
+        CHECK(closed);
+        CHECK(read_knots == knots);
+        ++num_rows;
+    }) == 2);
+    CHECK(num_rows == 2);
+}
+
+int main(int argc, char* argv[])
+{
+    boost::filesystem::path const dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("labelcore_test_%%%%%%%%");
+    boost::filesystem::create_directories(dir);
+
+    TestCSVRoundTrip(dir.string());
+    TestCSVOldFormat(dir.string());
+    TestRasterisePts();
+    TestFindFrameFiles(dir.string());
+    TestSparseMask(dir.string());
+    TestKnotJournal(dir.string());
+    TestEditHistory();
+    TestClosedSpline();
+    TestBiplane(dir.string());
+
+    boost::filesystem::remove_all(dir);
+
+    cout << num_checks << " checks passed" << endl;
+    return 0;
+}